@@ -11,6 +11,7 @@
 
 #include "esp_lfs.h"
 #include "lfs.h"
+#include "lfs_trace.h"
 #include "esp_log.h"
 #include "esp_partition.h"
 #include "esp_spi_flash.h"
@@ -23,13 +24,33 @@
 #include <sys/errno.h>
 #include <sys/fcntl.h>
 #include <sys/lock.h>
+#include <sys/ioctl.h>
+#include <stdarg.h>
 #include "esp_vfs.h"
 #include "esp_err.h"
+#include "esp_timer.h"
 #include "rom/spi_flash.h"
 #include "lfs_api.h"
 
 static const char* TAG = "LFS";
 
+/**
+ * ioctl request of esp_lfs_file_mmap
+ */
+#define ESP_LFS_IOCTL_MMAP 0x4c460001
+
+/**
+ * ioctl request of esp_lfs_file_reserve
+ */
+#define ESP_LFS_IOCTL_RESERVE 0x4c460002
+
+typedef struct {
+    size_t off;                         // file offset to map
+    size_t len;                         // bytes to map, bytes mapped
+    const void *ptr;                    // mapped data
+    spi_flash_mmap_handle_t handle;     // handle for spi_flash_munmap
+} esp_lfs_mmap_req_t;
+
 static esp_lfs_t *_efs[CONFIG_LFS_MAX_PARTITIONS];
 
 static ssize_t write_p(void *ctx, int fd, const void *data, size_t size);
@@ -50,29 +71,73 @@ static int closedir_p(void *ctx, DIR *pdir);
 static int mkdir_p(void *ctx, const char *name, mode_t mode);
 static int rmdir_p(void *ctx, const char *name);
 static int fsync_p(void *ctx, int fd);
+static int ioctl_p(void *ctx, int fd, int cmd, va_list args);
 
 static int map_lfs_error(int res);
 static esp_err_t esp_lfs_init(const esp_vfs_lfs_conf_t *conf);
 static esp_err_t esp_lfs_by_label(const char *label, int *index);
 static esp_err_t esp_lfs_get_empty(int *index);
 static void esp_lfs_free(esp_lfs_t **efs);
+static esp_err_t esp_lfs_mount(esp_lfs_t *efs);
+static void esp_lfs_mount_task(void *arg);
 static int get_free_fd(esp_lfs_t *efs);
+#if CONFIG_LFS_GC_TASK_PERIOD_MS > 0
+static void esp_lfs_gc_task(void *arg);
+#endif
+#if CONFIG_LFS_LATENCY_HIST
+static void esp_lfs_latency_record(esp_lfs_op_latency_t *op, int64_t wait, int64_t busy);
+static void esp_lfs_latency_log(const char *label, const esp_lfs_latency_t *latency);
+#endif
+#if CONFIG_LFS_LATENCY_DUMP_PERIOD_MS > 0
+static void esp_lfs_latency_task(void *arg);
+#endif
+
+/**
+ * Timestamps of a VFS operation, for the latency histograms
+ */
+typedef struct {
+    int64_t start;      // time the lock was requested
+    int64_t locked;     // time the lock was taken
+} esp_lfs_timing_t;
+
+static inline esp_lfs_timing_t esp_lfs_lock(esp_lfs_t *efs)
+{
+    esp_lfs_timing_t t = {0};
+#if CONFIG_LFS_LATENCY_HIST
+    t.start = esp_timer_get_time();
+#endif
+    xSemaphoreTake(efs->lock, portMAX_DELAY);
+#if CONFIG_LFS_LATENCY_HIST
+    t.locked = esp_timer_get_time();
+#endif
+    return t;
+}
+
+static inline void esp_lfs_unlock(esp_lfs_t *efs, esp_lfs_op_t op, esp_lfs_timing_t t)
+{
+#if CONFIG_LFS_LATENCY_HIST
+    // record while still holding the lock, which also protects the histograms
+    esp_lfs_latency_record(&efs->latency.ops[op],
+            t.locked - t.start, esp_timer_get_time() - t.locked);
+#endif
+    xSemaphoreGive(efs->lock);
+}
 
 static ssize_t write_p(void *ctx, int fd, const void *data, size_t size)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     if (efs->fds[fd].file == NULL) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_WRITE, t);
         errno = EBADF;
         return -1;
     }
 
     lfs_ssize_t written = lfs_file_write(efs->fs, efs->fds[fd].file, data, size);
 
-	xSemaphoreGive(efs->lock);
+	esp_lfs_unlock(efs, ESP_LFS_OP_WRITE, t);
 
     if (written < 0) {
         return map_lfs_error(written);
@@ -98,10 +163,10 @@ static off_t lseek_p(void *ctx, int fd, off_t size, int mode)
         return -1;
     }
 
-    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     if (efs->fds[fd].file == NULL) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_LSEEK, t);
         errno = EBADF;
         return -1;
     }
@@ -112,7 +177,7 @@ static off_t lseek_p(void *ctx, int fd, off_t size, int mode)
 		pos = lfs_file_tell(efs->fs, efs->fds[fd].file);
 	}
 
-	xSemaphoreGive(efs->lock);
+	esp_lfs_unlock(efs, ESP_LFS_OP_LSEEK, t);
 
     if (pos < 0) {
         return map_lfs_error(pos);
@@ -125,17 +190,17 @@ static ssize_t read_p(void *ctx, int fd, void *dst, size_t size)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     if (efs->fds[fd].file == NULL) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_READ, t);
         errno = EBADF;
         return -1;
     }
 
     lfs_ssize_t read = lfs_file_read(efs->fs, efs->fds[fd].file, dst, size);
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_READ, t);
 
     if (read < 0) {
         return map_lfs_error(read);
@@ -187,11 +252,19 @@ static int open_p(void *ctx, const char *path, int flags, int mode)
         return -1;
     }
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
+
+    if (!efs->mounted) {
+    	esp_lfs_unlock(efs, ESP_LFS_OP_OPEN, t);
+        free(file_name);
+        free(file);
+        errno = ENODEV;
+        return -1;
+    }
 
 	int fd = get_free_fd(efs);
     if (fd == -1) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_OPEN, t);
         free(file_name);
         free(file);
         errno = ENFILE;
@@ -200,7 +273,7 @@ static int open_p(void *ctx, const char *path, int flags, int mode)
 
     int err = lfs_file_open(efs->fs, file, path, lfs_flags);
     if (err < 0) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_OPEN, t);
         free(file_name);
         free(file);
         return map_lfs_error(err);
@@ -209,7 +282,7 @@ static int open_p(void *ctx, const char *path, int flags, int mode)
     efs->fds[fd].file = file;
     efs->fds[fd].path = file_name;
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_OPEN, t);
 
     return fd;
 }
@@ -218,10 +291,10 @@ static int close_p(void *ctx, int fd)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     if (efs->fds[fd].file == NULL) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_CLOSE, t);
         errno = EBADF;
         return -1;
     }
@@ -232,7 +305,7 @@ static int close_p(void *ctx, int fd)
     free(efs->fds[fd].file);
     memset(&efs->fds[fd], 0L, sizeof(vfs_fd_t));
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_CLOSE, t);
 
     return map_lfs_error(err);
 }
@@ -241,10 +314,10 @@ static int fstat_p(void *ctx, int fd, struct stat *st)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     if (efs->fds[fd].file == NULL) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_STAT, t);
         errno = EBADF;
         return -1;
     }
@@ -252,7 +325,7 @@ static int fstat_p(void *ctx, int fd, struct stat *st)
     struct lfs_info lfs_info;
     int err = lfs_stat(efs->fs, efs->fds[fd].path, &lfs_info);
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_STAT, t);
 
     if (err < 0) {
         return map_lfs_error(err);
@@ -273,12 +346,18 @@ static int stat_p(void *ctx, const char *path, struct stat *st)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
+
+    if (!efs->mounted) {
+    	esp_lfs_unlock(efs, ESP_LFS_OP_STAT, t);
+        errno = ENODEV;
+        return -1;
+    }
 
     struct lfs_info lfs_info;
     int err = lfs_stat(efs->fs, path, &lfs_info);
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_STAT, t);
 
     if (err < 0) {
         return map_lfs_error(err);
@@ -299,11 +378,17 @@ static int unlink_p(void *ctx, const char *path)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
+
+	if (!efs->mounted) {
+		esp_lfs_unlock(efs, ESP_LFS_OP_UNLINK, t);
+		errno = ENODEV;
+		return -1;
+	}
 
 	int err = lfs_remove(efs->fs, path);
 
-	xSemaphoreGive(efs->lock);
+	esp_lfs_unlock(efs, ESP_LFS_OP_UNLINK, t);
 
 	return map_lfs_error(err);
 }
@@ -312,11 +397,17 @@ static int rename_p(void *ctx, const char *src, const char *dst)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
+
+	if (!efs->mounted) {
+		esp_lfs_unlock(efs, ESP_LFS_OP_RENAME, t);
+		errno = ENODEV;
+		return -1;
+	}
 
 	int err = lfs_rename(efs->fs, src, dst);
 
-	xSemaphoreGive(efs->lock);
+	esp_lfs_unlock(efs, ESP_LFS_OP_RENAME, t);
 
 	return map_lfs_error(err);
 }
@@ -333,11 +424,18 @@ static DIR *opendir_p(void *ctx, const char *name)
 
     memset(vfs_dir, 0L, sizeof(vfs_lfs_dir_t));
 
-    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    esp_lfs_timing_t t = esp_lfs_lock(efs);
+
+    if (!efs->mounted) {
+        esp_lfs_unlock(efs, ESP_LFS_OP_OPENDIR, t);
+        free(vfs_dir);
+        errno = ENODEV;
+        return NULL;
+    }
 
     int err = lfs_dir_open(efs->fs, &vfs_dir->lfs_dir, name);
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_OPENDIR, t);
 
     if (err != LFS_ERR_OK) {
         free(vfs_dir);
@@ -377,12 +475,12 @@ static int readdir_r_p(void *ctx, DIR *pdir, struct dirent *entry, struct dirent
         return errno;
     }
 
-    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     struct lfs_info lfs_info;
     int err = lfs_dir_read(efs->fs, &vfs_dir->lfs_dir, &lfs_info);
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_READDIR, t);
 
     if (err == 0) {
         *out_dirent = NULL;
@@ -440,7 +538,7 @@ static void seekdir_p(void *ctx, DIR *pdir, long offset)
         return;
     }
 
-    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     // ESP32 VFS expects simple 0 to n counted directory offsets but lfs
     // doesn't so we need to "translate"...
@@ -455,7 +553,7 @@ static void seekdir_p(void *ctx, DIR *pdir, long offset)
         }
     }
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_READDIR, t);
 
     if (err < 0) {
         map_lfs_error(err);
@@ -475,11 +573,11 @@ static int closedir_p(void *ctx, DIR *pdir)
         return errno;
     }
 
-    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     int err = lfs_dir_close(efs->fs, &vfs_dir->lfs_dir);
 
-    xSemaphoreGive(efs->lock);
+    esp_lfs_unlock(efs, ESP_LFS_OP_CLOSEDIR, t);
 
     free(vfs_dir);
 
@@ -490,11 +588,17 @@ static int mkdir_p(void *ctx, const char *name, mode_t mode)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
+
+	if (!efs->mounted) {
+		esp_lfs_unlock(efs, ESP_LFS_OP_MKDIR, t);
+		errno = ENODEV;
+		return -1;
+	}
 
 	int err = lfs_mkdir(efs->fs, name);
 
-	xSemaphoreGive(efs->lock);
+	esp_lfs_unlock(efs, ESP_LFS_OP_MKDIR, t);
 
 	return map_lfs_error(err);
 }
@@ -503,11 +607,17 @@ static int rmdir_p(void *ctx, const char *name)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
+
+	if (!efs->mounted) {
+		esp_lfs_unlock(efs, ESP_LFS_OP_RMDIR, t);
+		errno = ENODEV;
+		return -1;
+	}
 
 	int err = lfs_remove(efs->fs, name);
 
-	xSemaphoreGive(efs->lock);
+	esp_lfs_unlock(efs, ESP_LFS_OP_RMDIR, t);
 
 	return map_lfs_error(err);
 }
@@ -516,21 +626,86 @@ static int fsync_p(void *ctx, int fd)
 {
 	esp_lfs_t *efs = (esp_lfs_t *)ctx;
 
-	xSemaphoreTake(efs->lock, portMAX_DELAY);
+	esp_lfs_timing_t t = esp_lfs_lock(efs);
 
     if (efs->fds[fd].file == NULL) {
-    	xSemaphoreGive(efs->lock);
+    	esp_lfs_unlock(efs, ESP_LFS_OP_FSYNC, t);
         errno = EBADF;
         return -1;
     }
 
     int err = lfs_file_sync(efs->fs, efs->fds[fd].file);
 
-	xSemaphoreGive(efs->lock);
+	esp_lfs_unlock(efs, ESP_LFS_OP_FSYNC, t);
 
 	return map_lfs_error(err);
 }
 
+static int ioctl_p(void *ctx, int fd, int cmd, va_list args)
+{
+	esp_lfs_t *efs = (esp_lfs_t *)ctx;
+
+	if (cmd != ESP_LFS_IOCTL_MMAP && cmd != ESP_LFS_IOCTL_RESERVE) {
+		errno = ENOTTY;
+		return -1;
+	}
+
+	xSemaphoreTake(efs->lock, portMAX_DELAY);
+
+    if (efs->fds[fd].file == NULL) {
+    	xSemaphoreGive(efs->lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    if (cmd == ESP_LFS_IOCTL_RESERVE) {
+    	size_t *size = va_arg(args, size_t *);
+    	if ((efs->fds[fd].file->flags & LFS_O_WRONLY) == 0) {
+    		xSemaphoreGive(efs->lock);
+    		errno = EBADF;
+    		return -1;
+    	}
+
+    	lfs_ssize_t res = lfs_file_reserve(efs->fs, efs->fds[fd].file, *size);
+    	xSemaphoreGive(efs->lock);
+    	if (res < 0) {
+    		errno = (res == LFS_ERR_FBIG) ? EFBIG : map_lfs_error(res);
+    		return -1;
+    	}
+
+    	*size = res * efs->sector_sz;
+    	return 0;
+    }
+
+	esp_lfs_mmap_req_t *req = va_arg(args, esp_lfs_mmap_req_t *);
+
+    lfs_block_t block;
+    lfs_off_t boff;
+    lfs_ssize_t size = lfs_file_map(efs->fs, efs->fds[fd].file, req->off, &block, &boff);
+    if (size <= 0) {
+    	xSemaphoreGive(efs->lock);
+    	errno = (size == 0) ? EINVAL : (size == LFS_ERR_INVAL) ? ENOTSUP : EIO;
+    	return -1;
+    }
+
+    if (req->len == 0 || req->len > (size_t) size) {
+    	req->len = size;
+    }
+
+    esp_err_t err = esp_partition_mmap(efs->partition, (block * efs->sector_sz) + boff, req->len,
+    		SPI_FLASH_MMAP_DATA, &req->ptr, &req->handle);
+
+    xSemaphoreGive(efs->lock);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "failed to map block %08x, off %08x, size %08x, err %d", block, boff, (unsigned) req->len, err);
+        errno = ENOMEM;
+        return -1;
+    }
+
+	return 0;
+}
+
 static int map_lfs_error(int res)
 {
     switch (res) {
@@ -623,6 +798,15 @@ static esp_err_t esp_lfs_init(const esp_vfs_lfs_conf_t *conf)
     efs->cfg.block_count = partition->size / efs->cfg.block_size;
     efs->cfg.lookahead_size = 256;
     efs->cfg.block_cycles = 500;
+    // the partition is read by address, so reads can span blocks
+    efs->cfg.linear_reads = true;
+    efs->cfg.tag_index_size = CONFIG_LFS_TAG_INDEX_SIZE;
+#ifdef CONFIG_LFS_NAME_HASH
+    efs->cfg.name_hash = true;
+#endif
+#ifdef CONFIG_LFS_MOUNT_CHECKPOINT
+    efs->cfg.mount_checkpoint = true;
+#endif
 
     efs->by_label = conf->partition_label != NULL;
 
@@ -652,9 +836,21 @@ static esp_err_t esp_lfs_init(const esp_vfs_lfs_conf_t *conf)
 
     efs->cfg.context = (void *)efs;
     efs->partition = partition;
+    efs->format_if_mount_failed = conf->format_if_mount_failed;
+
+    // esp_vfs_lfs_register mounts from a task instead
+    if (!conf->mount_in_background && esp_lfs_mount(efs) != ESP_OK) {
+        esp_lfs_free(&efs);
+        return ESP_FAIL;
+    }
+    _efs[index] = efs;
+	return ESP_OK;
+}
 
+static esp_err_t esp_lfs_mount(esp_lfs_t *efs)
+{
     int err = lfs_mount(efs->fs, &efs->cfg);
-    if (conf->format_if_mount_failed && err != LFS_ERR_OK) {
+    if (efs->format_if_mount_failed && err != LFS_ERR_OK) {
     	ESP_LOGW(TAG, "mount failed, %i. formatting...", err);
 
     	// Try to format the partition
@@ -664,7 +860,6 @@ static esp_err_t esp_lfs_init(const esp_vfs_lfs_conf_t *conf)
     	err = lfs_format(efs->fs, &efs->cfg);
     	if (err != LFS_ERR_OK) {
             ESP_LOGE(TAG, "format lfs failed, %d", err);
-            esp_lfs_free(&efs);
             return ESP_FAIL;
     	}
 
@@ -673,12 +868,43 @@ static esp_err_t esp_lfs_init(const esp_vfs_lfs_conf_t *conf)
     }
     if (err != LFS_ERR_OK) {
     	ESP_LOGE(TAG, "mount lfs failed, %d", err);
-        esp_lfs_free(&efs);
         return ESP_FAIL;
     }
     efs->mounted = true;
-    _efs[index] = efs;
-	return ESP_OK;
+    return ESP_OK;
+}
+
+/**
+ * Handed to esp_lfs_mount_task, which notifies waiter once it holds the
+ * FS lock so that nothing can get to the filesystem before the mount
+ */
+typedef struct {
+    esp_lfs_t *efs;
+    TaskHandle_t waiter;
+} esp_lfs_mount_arg_t;
+
+static void esp_lfs_mount_task(void *arg)
+{
+    esp_lfs_t *efs = ((esp_lfs_mount_arg_t *)arg)->efs;
+
+    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    xTaskNotifyGive(((esp_lfs_mount_arg_t *)arg)->waiter);
+    esp_lfs_mount(efs);
+    xSemaphoreGive(efs->lock);
+
+    // operations waiting for the mount go first, then check every metadata
+    // pair, finish any interrupted operation and fill the block allocator's
+    // lookahead so none of that lands on a later write
+    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    if (efs->mounted) {
+        int res = lfs_fs_gc(efs->fs);
+        if (res < 0) {
+            ESP_LOGW(TAG, "background validation failed, %d", res);
+        }
+    }
+    efs->mount_task = NULL;
+    xSemaphoreGive(efs->lock);
+    vTaskDelete(NULL);
 }
 
 static esp_err_t esp_lfs_by_label(const char *label, int *index)
@@ -725,15 +951,185 @@ static void esp_lfs_free(esp_lfs_t **efs)
 	}
 	*efs = NULL;
 
+	if (e->gc_task) {
+		// make sure the task isn't in the middle of a compaction
+		xSemaphoreTake(e->lock, portMAX_DELAY);
+		vTaskDelete(e->gc_task);
+		xSemaphoreGive(e->lock);
+	}
+
+	if (e->lock) {
+		// same for a mount that is still running
+		xSemaphoreTake(e->lock, portMAX_DELAY);
+		if (e->mount_task) {
+			vTaskDelete(e->mount_task);
+		}
+		xSemaphoreGive(e->lock);
+	}
+
+#if CONFIG_LFS_LATENCY_DUMP_PERIOD_MS > 0
+	if (e->latency_task) {
+		// the task may be logging, let it finish and clear latency_task
+		// itself before freeing anything it uses
+		xTaskNotifyGive(e->latency_task);
+		while (true) {
+			xSemaphoreTake(e->lock, portMAX_DELAY);
+			bool running = e->latency_task != NULL;
+			xSemaphoreGive(e->lock);
+			if (!running) {
+				break;
+			}
+			vTaskDelay(1);
+		}
+	}
+#endif
+
 	if (e->fs) {
-		lfs_unmount(e->fs);
+		if (e->mounted) {
+			lfs_unmount(e->fs);
+		}
 		free(e->fs);
 	}
+	lfs_api_unmap(e);
 	vSemaphoreDelete(e->lock);
 	free(e->fds);
 	free(e);
 }
 
+#if CONFIG_LFS_GC_TASK_PERIOD_MS > 0
+static void esp_lfs_gc_task(void *arg)
+{
+    esp_lfs_t *efs = (esp_lfs_t *)arg;
+
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_LFS_GC_TASK_PERIOD_MS));
+
+        xSemaphoreTake(efs->lock, portMAX_DELAY);
+        int res = efs->mounted ? lfs_fs_gc(efs->fs) : 0;
+        xSemaphoreGive(efs->lock);
+
+        if (res < 0) {
+            ESP_LOGW(TAG, "background compaction failed, %d", res);
+        }
+    }
+}
+#endif
+
+#if CONFIG_LFS_LATENCY_HIST
+static void esp_lfs_latency_record(esp_lfs_op_latency_t *op, int64_t wait, int64_t busy)
+{
+    uint32_t us[2] = {
+        wait < UINT32_MAX ? (uint32_t)wait : UINT32_MAX,
+        busy < UINT32_MAX ? (uint32_t)busy : UINT32_MAX,
+    };
+    uint32_t *buckets[2] = {op->wait, op->lfs};
+
+    for (int i = 0; i < 2; i++) {
+        // bucket 0 is below 1 us, bucket b from 2^(b-1) up to 2^b us
+        uint32_t b = us[i] ? 32 - __builtin_clz(us[i]) : 0;
+        if (b >= ESP_LFS_LATENCY_BUCKETS) {
+            b = ESP_LFS_LATENCY_BUCKETS - 1;
+        }
+        buckets[i][b] += 1;
+    }
+
+    op->count += 1;
+    op->wait_total += us[0];
+    op->lfs_total += us[1];
+    if (us[0] > op->wait_max) {
+        op->wait_max = us[0];
+    }
+    if (us[1] > op->lfs_max) {
+        op->lfs_max = us[1];
+    }
+}
+
+static void esp_lfs_latency_log(const char *label, const esp_lfs_latency_t *latency)
+{
+    static const char *const names[ESP_LFS_OP_MAX] = {
+        [ESP_LFS_OP_OPEN]     = "open",
+        [ESP_LFS_OP_CLOSE]    = "close",
+        [ESP_LFS_OP_READ]     = "read",
+        [ESP_LFS_OP_WRITE]    = "write",
+        [ESP_LFS_OP_LSEEK]    = "lseek",
+        [ESP_LFS_OP_FSYNC]    = "fsync",
+        [ESP_LFS_OP_STAT]     = "stat",
+        [ESP_LFS_OP_UNLINK]   = "unlink",
+        [ESP_LFS_OP_RENAME]   = "rename",
+        [ESP_LFS_OP_MKDIR]    = "mkdir",
+        [ESP_LFS_OP_RMDIR]    = "rmdir",
+        [ESP_LFS_OP_OPENDIR]  = "opendir",
+        [ESP_LFS_OP_READDIR]  = "readdir",
+        [ESP_LFS_OP_CLOSEDIR] = "closedir",
+    };
+
+    ESP_LOGI(TAG, "latency of %s, in us:", label ? label : "lfs");
+
+    for (int op = 0; op < ESP_LFS_OP_MAX; op++) {
+        const esp_lfs_op_latency_t *l = &latency->ops[op];
+        if (l->count == 0) {
+            continue;
+        }
+
+        ESP_LOGI(TAG, "%-8s %u ops, wait avg %u max %u, lfs avg %u max %u",
+                names[op], l->count,
+                (uint32_t)(l->wait_total / l->count), l->wait_max,
+                (uint32_t)(l->lfs_total / l->count), l->lfs_max);
+
+        const uint32_t *buckets[2] = {l->wait, l->lfs};
+        for (int i = 0; i < 2; i++) {
+            char line[256] = "";
+            size_t len = 0;
+            for (int b = 0; b < ESP_LFS_LATENCY_BUCKETS && len < sizeof(line); b++) {
+                if (buckets[i][b] == 0) {
+                    continue;
+                }
+                // label each bucket with its upper bound
+                len += snprintf(&line[len], sizeof(line) - len,
+                        b < ESP_LFS_LATENCY_BUCKETS - 1 ? " <%u:%u" : " >=%u:%u",
+                        b < ESP_LFS_LATENCY_BUCKETS - 1 ? 1u << b : 1u << (b - 1),
+                        buckets[i][b]);
+            }
+            ESP_LOGI(TAG, "%-8s %s%s", "", i == 0 ? "wait" : "lfs ", line);
+        }
+    }
+}
+#endif
+
+#if CONFIG_LFS_LATENCY_DUMP_PERIOD_MS > 0
+static void esp_lfs_latency_task(void *arg)
+{
+    esp_lfs_t *efs = (esp_lfs_t *)arg;
+
+    // copy the histograms so that logging doesn't hold up other tasks
+    esp_lfs_latency_t *latency = malloc(sizeof(esp_lfs_latency_t));
+    if (latency == NULL) {
+        ESP_LOGW(TAG, "latency log buffer could not be malloced");
+    }
+
+    // esp_lfs_free notifies the task to stop
+    while (ulTaskNotifyTake(pdTRUE,
+            pdMS_TO_TICKS(CONFIG_LFS_LATENCY_DUMP_PERIOD_MS)) == 0) {
+        if (latency == NULL) {
+            continue;
+        }
+
+        xSemaphoreTake(efs->lock, portMAX_DELAY);
+        *latency = efs->latency;
+        xSemaphoreGive(efs->lock);
+
+        esp_lfs_latency_log(efs->by_label ? efs->partition->label : NULL,
+                latency);
+    }
+
+    free(latency);
+    xSemaphoreTake(efs->lock, portMAX_DELAY);
+    efs->latency_task = NULL;
+    xSemaphoreGive(efs->lock);
+    vTaskDelete(NULL);
+}
+#endif
+
 static int get_free_fd(esp_lfs_t *efs)
 {
     for (int i = 0; i < efs->max_files; i++) {
@@ -763,6 +1159,27 @@ esp_err_t esp_vfs_lfs_register(const esp_vfs_lfs_conf_t *conf)
         return ESP_ERR_INVALID_STATE;
     }
 
+    if (conf->mount_in_background) {
+        // the task takes the FS lock before the VFS is registered, so early
+        // operations block until the mount is done
+        esp_lfs_mount_arg_t arg = {
+            .efs = _efs[index],
+            .waiter = xTaskGetCurrentTaskHandle(),
+        };
+        if (xTaskCreate(esp_lfs_mount_task, "lfs_mount",
+                CONFIG_LFS_TASK_STACK_SIZE, &arg,
+                tskIDLE_PRIORITY + 1, &_efs[index]->mount_task) == pdPASS) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else {
+            ESP_LOGW(TAG, "mount task could not be created, mounting now");
+            _efs[index]->mount_task = NULL;
+            if (esp_lfs_mount(_efs[index]) != ESP_OK) {
+                esp_lfs_free(&_efs[index]);
+                return ESP_FAIL;
+            }
+        }
+    }
+
     vfs.flags = ESP_VFS_FLAG_CONTEXT_PTR;
     vfs.write_p = &write_p;
     vfs.lseek_p = &lseek_p;
@@ -783,6 +1200,7 @@ esp_err_t esp_vfs_lfs_register(const esp_vfs_lfs_conf_t *conf)
     vfs.mkdir_p = &mkdir_p;
     vfs.rmdir_p = &rmdir_p;
     vfs.fsync_p = &fsync_p;
+    vfs.ioctl_p = &ioctl_p;
 
     strlcat(_efs[index]->base_path, conf->base_path, ESP_VFS_PATH_MAX + 1);
     err = esp_vfs_register(conf->base_path, &vfs, _efs[index]);
@@ -791,6 +1209,23 @@ esp_err_t esp_vfs_lfs_register(const esp_vfs_lfs_conf_t *conf)
         return err;
     }
 
+#if CONFIG_LFS_GC_TASK_PERIOD_MS > 0
+    if (xTaskCreate(esp_lfs_gc_task, "lfs_gc",
+            CONFIG_LFS_TASK_STACK_SIZE, _efs[index],
+            tskIDLE_PRIORITY + 1, &_efs[index]->gc_task) != pdPASS) {
+        ESP_LOGW(TAG, "background compaction task could not be created");
+        _efs[index]->gc_task = NULL;
+    }
+#endif
+
+#if CONFIG_LFS_LATENCY_DUMP_PERIOD_MS > 0
+    if (xTaskCreate(esp_lfs_latency_task, "lfs_latency", 3072, _efs[index],
+            tskIDLE_PRIORITY + 1, &_efs[index]->latency_task) != pdPASS) {
+        ESP_LOGW(TAG, "latency log task could not be created");
+        _efs[index]->latency_task = NULL;
+    }
+#endif
+
     return ESP_OK;
 }
 
@@ -821,7 +1256,13 @@ bool esp_lfs_mounted(const char* partition_label)
     if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
         return false;
     }
-    return _efs[index]->mounted;
+
+    // the background mount task holds the lock until it is done
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+    bool mounted = _efs[index]->mounted;
+    xSemaphoreGive(_efs[index]->lock);
+
+    return mounted;
 }
 
 esp_err_t esp_lfs_info(const char* partition_label, size_t *total_bytes, size_t *used_bytes)
@@ -834,7 +1275,18 @@ esp_err_t esp_lfs_info(const char* partition_label, size_t *total_bytes, size_t
         return ESP_ERR_INVALID_STATE;
     }
 
-    uint32_t allocated_blocks = lfs_fs_size(_efs[index]->fs);
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lfs_ssize_t allocated_blocks = lfs_fs_size(_efs[index]->fs);
+    xSemaphoreGive(_efs[index]->lock);
+    if (allocated_blocks < 0) {
+        return ESP_FAIL;
+    }
+
     *total_bytes = _efs[index]->partition->size;
     *used_bytes = allocated_blocks * _efs[index]->cfg.block_size;
 
@@ -854,22 +1306,428 @@ esp_err_t esp_lfs_format(const char* partition_label)
     	return ESP_ERR_NOT_FOUND;
     }
 
-    lfs_unmount(_efs[index]->fs);
+    // don't let background compaction race with the format
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (_efs[index]->mounted) {
+        lfs_unmount(_efs[index]->fs);
+        _efs[index]->mounted = false;
+    }
 
     int res = lfs_format(_efs[index]->fs, &_efs[index]->cfg);
     if (res != LFS_ERR_OK) {
         ESP_LOGE(TAG, "format lfs failed, %d", res);
         // The partition was previously mounted, but format failed, don't
         // try to mount the partition back (it will probably fail).
+        _efs[index]->mounted = false;
+        xSemaphoreGive(_efs[index]->lock);
     	return ESP_FAIL;
     }
 
 	res = lfs_mount(_efs[index]->fs, &(_efs[index]->cfg));
 	if (res != LFS_ERR_OK) {
 		ESP_LOGE(TAG, "mount lfs failed, %d", res);
+		_efs[index]->mounted = false;
+		xSemaphoreGive(_efs[index]->lock);
 		return ESP_FAIL;
 	}
 	_efs[index]->mounted = true;
 
+	xSemaphoreGive(_efs[index]->lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_lfs_gc(const char* partition_label)
+{
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int res = lfs_fs_gc(_efs[index]->fs);
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    if (res < 0) {
+        ESP_LOGE(TAG, "compaction failed, %d", res);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_lfs_batch_begin(const char* partition_label)
+{
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int res = lfs_fs_batch_begin(_efs[index]->fs);
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    if (res < 0) {
+        ESP_LOGE(TAG, "starting batch failed, %d", res);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_lfs_batch_end(const char* partition_label)
+{
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int res = lfs_fs_batch_end(_efs[index]->fs);
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    if (res < 0) {
+        ESP_LOGE(TAG, "ending batch failed, %d", res);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_lfs_batch_abort(const char* partition_label)
+{
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int res = lfs_fs_batch_abort(_efs[index]->fs);
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    if (res < 0) {
+        ESP_LOGE(TAG, "aborting batch failed, %d", res);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_lfs_file_mmap(int fd, size_t off, size_t *len, const void **ptr, spi_flash_mmap_handle_t *handle)
+{
+    esp_lfs_mmap_req_t req = {
+    		.off = off,
+    		.len = *len,
+    };
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (ioctl(fd, ESP_LFS_IOCTL_MMAP, &req) != 0) {
+        switch (errno) {
+        case EINVAL:
+            return ESP_ERR_INVALID_SIZE;
+        case ENOTSUP:
+            return ESP_ERR_NOT_SUPPORTED;
+        case ENOMEM:
+            return ESP_ERR_NO_MEM;
+        case EIO:
+            return ESP_FAIL;
+        default:
+            // not a file on a LittleFS partition
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    *len = req.len;
+    *ptr = req.ptr;
+    *handle = req.handle;
+    return ESP_OK;
+}
+
+esp_err_t esp_lfs_file_reserve(int fd, size_t size, size_t *reserved)
+{
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (ioctl(fd, ESP_LFS_IOCTL_RESERVE, &size) != 0) {
+        switch (errno) {
+        case ENOSPC:
+            return ESP_ERR_NO_MEM;
+        case EFBIG:
+            return ESP_ERR_INVALID_SIZE;
+        case EIO:
+            return ESP_FAIL;
+        default:
+            // not a file on a LittleFS partition
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (reserved) {
+        *reserved = size;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_lfs_get_stats(const char* partition_label, esp_lfs_stats_t *stats)
+{
+#if CONFIG_LFS_STATS
+    int index;
+    struct lfs_stats s;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lfs_fs_stats(_efs[index]->fs, &s);
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    stats->read_count = s.read_count;
+    stats->prog_count = s.prog_count;
+    stats->erase_count = s.erase_count;
+    stats->read_bytes = s.read_bytes;
+    stats->prog_bytes = s.prog_bytes;
+    stats->erase_bytes = s.erase_bytes;
+    stats->rcache_hits = s.rcache_hits;
+    stats->rcache_misses = s.rcache_misses;
+    stats->pcache_hits = s.pcache_hits;
+    stats->pcache_misses = s.pcache_misses;
+    stats->alloc_scans = s.alloc_scans;
+    stats->compacts = s.compacts;
+    stats->splits = s.splits;
+    stats->relocations = s.relocations;
+    stats->bad_blocks = s.bad_blocks;
+    stats->read_time = s.read_time;
+    stats->prog_time = s.prog_time;
+    stats->erase_time = s.erase_time;
+    stats->alloc_time = s.alloc_time;
+    stats->compact_time = s.compact_time;
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_lfs_reset_stats(const char* partition_label)
+{
+#if CONFIG_LFS_STATS
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lfs_fs_stats_reset(_efs[index]->fs);
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_lfs_get_flash_counters(const char* partition_label, esp_lfs_flash_counters_t *counters)
+{
+#if CONFIG_LFS_FLASH_COUNTERS
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    *counters = _efs[index]->counters;
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_lfs_reset_flash_counters(const char* partition_label)
+{
+#if CONFIG_LFS_FLASH_COUNTERS
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(&_efs[index]->counters, 0, sizeof(_efs[index]->counters));
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_lfs_get_latency(const char* partition_label, esp_lfs_latency_t *latency)
+{
+#if CONFIG_LFS_LATENCY_HIST
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    *latency = _efs[index]->latency;
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_lfs_reset_latency(const char* partition_label)
+{
+#if CONFIG_LFS_LATENCY_HIST
+    int index;
+
+    ESP_LOGD(TAG, "%s", __func__);
+
+    if (esp_lfs_by_label(partition_label, &index) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(_efs[index]->lock, portMAX_DELAY);
+
+    if (!_efs[index]->mounted) {
+        xSemaphoreGive(_efs[index]->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(&_efs[index]->latency, 0, sizeof(esp_lfs_latency_t));
+
+    xSemaphoreGive(_efs[index]->lock);
+
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_lfs_dump_latency(const char* partition_label)
+{
+#if CONFIG_LFS_LATENCY_HIST
+    ESP_LOGD(TAG, "%s", __func__);
+
+    esp_lfs_latency_t *latency = malloc(sizeof(esp_lfs_latency_t));
+    if (latency == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = esp_lfs_get_latency(partition_label, latency);
+    if (err == ESP_OK) {
+        esp_lfs_latency_log(partition_label, latency);
+    }
+
+    free(latency);
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_lfs_trace_read(uint32_t *cursor, void *buf, size_t size, size_t *read_bytes)
+{
+#if CONFIG_LFS_TRACE_EVENTS
+    uint32_t count = size / sizeof(struct lfs_trace_record);
+    *read_bytes = lfs_trace_read(cursor, buf, count) * sizeof(struct lfs_trace_record);
     return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
 }
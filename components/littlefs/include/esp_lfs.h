@@ -14,7 +14,9 @@
 #define _ESP_LFS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "esp_spi_flash.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,11 +30,110 @@ typedef struct {
         const char* partition_label;    /*!< Optional, label of LFS partition to use. If set to NULL, first partition with subtype=lfs will be used. */
         size_t max_files;               /*!< Maximum files that could be open at the same time. */
         bool format_if_mount_failed;    /*!< If true, it will format the file system if it fails to mount. */
+        bool mount_in_background;       /*!< If true, it will return before mounting and mount from a background task. File operations wait for the mount. */
 } esp_vfs_lfs_conf_t;
 
+/**
+ * @brief I/O statistics of a mounted LFS partition, see esp_lfs_get_stats
+ */
+typedef struct {
+        uint32_t read_count;            /*!< Flash reads */
+        uint32_t prog_count;            /*!< Flash programs */
+        uint32_t erase_count;           /*!< Flash erases */
+        uint64_t read_bytes;            /*!< Bytes read from flash */
+        uint64_t prog_bytes;            /*!< Bytes programmed to flash */
+        uint64_t erase_bytes;           /*!< Bytes erased */
+        uint32_t rcache_hits;           /*!< Reads served from the read cache */
+        uint32_t rcache_misses;         /*!< Reads that had to fill the read cache from flash */
+        uint32_t pcache_hits;           /*!< Reads and programs served from a pending program cache */
+        uint32_t pcache_misses;         /*!< Programs that had to start a new program cache */
+        uint32_t alloc_scans;           /*!< Block allocator scans, each a full traversal of the filesystem */
+        uint32_t compacts;              /*!< Metadata compactions */
+        uint32_t splits;                /*!< Metadata splits into a new block pair */
+        uint32_t relocations;           /*!< Metadata relocations for wear leveling or bad blocks */
+        uint32_t bad_blocks;            /*!< Blocks that failed to verify after programming */
+        uint64_t read_time;             /*!< Time spent reading flash, in microseconds */
+        uint64_t prog_time;             /*!< Time spent programming flash, in microseconds */
+        uint64_t erase_time;            /*!< Time spent erasing flash, in microseconds */
+        uint64_t alloc_time;            /*!< Time spent in allocator scans, in microseconds */
+        uint64_t compact_time;          /*!< Time spent compacting metadata, in microseconds */
+} esp_lfs_stats_t;
+
+/**
+ * @brief Flash driver counters of a mounted LFS partition, see esp_lfs_get_flash_counters
+ */
+typedef struct {
+        uint32_t read_count;            /*!< esp_partition_read calls */
+        uint32_t prog_count;            /*!< esp_partition_write calls */
+        uint32_t erase_count;           /*!< esp_partition_erase_range calls, one per block */
+        uint32_t sync_count;            /*!< Sync calls */
+        uint64_t read_bytes;            /*!< Bytes read from flash */
+        uint64_t prog_bytes;            /*!< Bytes written to flash */
+        uint32_t errors;                /*!< Flash operations that failed */
+        uint32_t mmap_reads;            /*!< Reads served from the memory-mapped window, see CONFIG_LFS_MMAP_READ */
+        uint32_t mmap_maps;             /*!< Times the memory-mapped window was moved */
+} esp_lfs_flash_counters_t;
+
+/**
+ * @brief VFS operations with a latency histogram, see esp_lfs_get_latency
+ */
+typedef enum {
+        ESP_LFS_OP_OPEN,                /*!< open */
+        ESP_LFS_OP_CLOSE,               /*!< close */
+        ESP_LFS_OP_READ,                /*!< read */
+        ESP_LFS_OP_WRITE,               /*!< write */
+        ESP_LFS_OP_LSEEK,               /*!< lseek */
+        ESP_LFS_OP_FSYNC,               /*!< fsync */
+        ESP_LFS_OP_STAT,                /*!< stat and fstat */
+        ESP_LFS_OP_UNLINK,              /*!< unlink */
+        ESP_LFS_OP_RENAME,              /*!< rename */
+        ESP_LFS_OP_MKDIR,               /*!< mkdir */
+        ESP_LFS_OP_RMDIR,               /*!< rmdir */
+        ESP_LFS_OP_OPENDIR,             /*!< opendir */
+        ESP_LFS_OP_READDIR,             /*!< readdir and seekdir */
+        ESP_LFS_OP_CLOSEDIR,            /*!< closedir */
+        ESP_LFS_OP_MAX,
+} esp_lfs_op_t;
+
+/**
+ * @brief Number of buckets in a latency histogram
+ *
+ * Bucket 0 counts latencies below 1 us, bucket i latencies from 2^(i-1) up
+ * to 2^i us. The last bucket also counts everything longer.
+ */
+#define ESP_LFS_LATENCY_BUCKETS 24
+
+/**
+ * @brief Latency histogram of one VFS operation
+ *
+ * The latency is split into the time spent waiting for the partition lock,
+ * which is held by other tasks and the background compaction, and the time
+ * spent in LittleFS itself.
+ */
+typedef struct {
+        uint32_t count;                 /*!< Number of operations */
+        uint64_t wait_total;            /*!< Total time waiting for the lock, in microseconds */
+        uint64_t lfs_total;             /*!< Total time in LittleFS, in microseconds */
+        uint32_t wait_max;              /*!< Longest wait for the lock, in microseconds */
+        uint32_t lfs_max;               /*!< Longest time in LittleFS, in microseconds */
+        uint32_t wait[ESP_LFS_LATENCY_BUCKETS]; /*!< Histogram of the lock wait times */
+        uint32_t lfs[ESP_LFS_LATENCY_BUCKETS];  /*!< Histogram of the times in LittleFS */
+} esp_lfs_op_latency_t;
+
+/**
+ * @brief Latency histograms of a mounted LFS partition, see esp_lfs_get_latency
+ */
+typedef struct {
+        esp_lfs_op_latency_t ops[ESP_LFS_OP_MAX];   /*!< Histograms indexed by esp_lfs_op_t */
+} esp_lfs_latency_t;
+
 /**
  * Register and mount LFS to VFS with given path prefix.
  *
+ * With mount_in_background set this returns before the mount has finished,
+ * and a mount or format failure is only reported by esp_lfs_mounted
+ * returning false.
+ *
  * @param   conf                      Pointer to esp_vfs_lfs_conf_t configuration structure
  *
  * @return  
@@ -59,6 +160,9 @@ esp_err_t esp_vfs_lfs_unregister(const char* partition_label);
 /**
  * Check if LFS is mounted
  *
+ * Waits for a background mount to finish, see mount_in_background in
+ * esp_vfs_lfs_conf_t.
+ *
  * @param partition_label  Optional, label of the partition to check.
  *                         If not specified, first partition with subtype=lfs is used.
  *
@@ -93,6 +197,270 @@ esp_err_t esp_lfs_format(const char* partition_label);
  */
 esp_err_t esp_lfs_info(const char* partition_label, size_t *total_bytes, size_t *used_bytes);
 
+/**
+ * Compact LFS metadata ahead of time
+ *
+ * Compacts any metadata blocks that are close to full. Otherwise the
+ * compaction happens during whichever write fills the block, which then
+ * takes much longer than a normal write. Call this from idle time to keep
+ * write latency predictable, or enable CONFIG_LFS_GC_TASK_PERIOD_MS.
+ *
+ * @param partition_label  Optional, label of the partition to compact.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ *          - ESP_FAIL                on error
+ */
+esp_err_t esp_lfs_gc(const char* partition_label);
+
+/**
+ * Start batching LFS metadata updates
+ *
+ * Until the matching esp_lfs_batch_end, fsync and close hold back their
+ * metadata updates so that updates to files in the same metadata pair are
+ * written together as one commit. A small directory fits in one pair, a
+ * larger one is split over several. Batches may be nested. While a batch
+ * is open, fsync fails with ENOMEM if an update can't be held back, and
+ * rename fails with EINVAL once updates are held back.
+ *
+ * @param partition_label  Optional, label of the partition to batch.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ *          - ESP_FAIL                on error
+ */
+esp_err_t esp_lfs_batch_begin(const char* partition_label);
+
+/**
+ * Stop batching LFS metadata updates
+ *
+ * Writes out the held back metadata updates once the outermost batch ends.
+ * On failure the batch stays open and this can be retried.
+ *
+ * @param partition_label  Optional, label of the partition to batch.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ *          - ESP_FAIL                on error
+ */
+esp_err_t esp_lfs_batch_end(const char* partition_label);
+
+/**
+ * Abort batching LFS metadata updates
+ *
+ * Discards the held back metadata updates and closes the batch. Files in
+ * the same metadata pair that were rewritten during the batch are then
+ * either all updated by esp_lfs_batch_end, or all left as they were if the
+ * batch is aborted or power is lost. Creating, removing or renaming files
+ * is not part of the batch.
+ *
+ * @param partition_label  Optional, label of the partition to batch.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ *          - ESP_FAIL                on error
+ */
+esp_err_t esp_lfs_batch_abort(const char* partition_label);
+
+/**
+ * Map part of an open LFS file into memory
+ *
+ * Maps the file data at off with esp_partition_mmap, so it can be used in
+ * place, for example sent straight from flash by a web server without a
+ * copy. LittleFS stores a file in blocks linked from the end, so only data
+ * within one block is contiguous in flash: the mapping stops at the end of
+ * the block, and len is set to what was mapped. To serve a larger file as a
+ * scatter list, map it piece by piece, advancing off by len. Pending writes
+ * of the file are flushed first.
+ *
+ * Unmap with spi_flash_munmap before the file is written, truncated or
+ * removed, as the blocks may be reused. Small files stored inline in their
+ * directory can't be mapped.
+ *
+ * @param fd               File descriptor of a file opened on a LFS partition
+ * @param off              Offset in the file to map from
+ * @param[inout] len       Bytes to map, 0 for as many as possible. Set to the
+ *                         bytes mapped, which may be fewer.
+ * @param[out] ptr         Mapped data
+ * @param[out] handle      Handle to unmap with spi_flash_munmap
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_ARG     if fd is not a file on a LFS partition
+ *          - ESP_ERR_INVALID_SIZE    if off is at or past the end of the file
+ *          - ESP_ERR_NOT_SUPPORTED   if the file is stored inline
+ *          - ESP_ERR_NO_MEM          if there are no free MMU pages to map
+ *          - ESP_FAIL                on error
+ */
+esp_err_t esp_lfs_file_mmap(int fd, size_t off, size_t *len, const void **ptr, spi_flash_mmap_handle_t *handle);
+
+/**
+ * Reserve flash for an open LFS file to grow to a known size
+ *
+ * Finds a run of consecutive free blocks for the file to grow to size bytes,
+ * such as the final size of an OTA image or a recording, and holds it for the
+ * file. Later writes take their blocks from the run instead of scanning for
+ * free blocks, which keeps their latency predictable and the file contiguous
+ * in flash. The reservation counts as used space until it is written, and is
+ * given back when the file is closed or reserved again, a size of 0 just
+ * gives it back.
+ *
+ * @param fd               File descriptor of a file opened for writing on a
+ *                         LFS partition
+ * @param size             Size in bytes the file is expected to grow to
+ * @param[out] reserved    Optional, bytes of flash reserved, which are fewer
+ *                         than needed if free space is too fragmented
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_INVALID_ARG     if fd is not a file opened for writing on a LFS partition
+ *          - ESP_ERR_INVALID_SIZE    if size is larger than a file can be
+ *          - ESP_ERR_NO_MEM          if there are no free blocks
+ *          - ESP_FAIL                on error
+ */
+esp_err_t esp_lfs_file_reserve(int fd, size_t size, size_t *reserved);
+
+/**
+ * Get the I/O statistics of LFS
+ *
+ * The statistics are gathered from mount, or from the last call to
+ * esp_lfs_reset_stats, and help explain where the time of a slow operation
+ * went. Requires CONFIG_LFS_STATS.
+ *
+ * @param partition_label  Optional, label of the partition to get statistics for.
+ *                         If not specified, first partition with subtype=lfs is used.
+ * @param[out] stats       Statistics of the partition
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_STATS is disabled
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ */
+esp_err_t esp_lfs_get_stats(const char* partition_label, esp_lfs_stats_t *stats);
+
+/**
+ * Reset the I/O statistics of LFS to zero
+ *
+ * @param partition_label  Optional, label of the partition to reset statistics for.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_STATS is disabled
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ */
+esp_err_t esp_lfs_reset_stats(const char* partition_label);
+
+/**
+ * Get the flash driver counters of LFS
+ *
+ * The counters are kept by the flash driver under LittleFS, gathered from
+ * mount or from the last call to esp_lfs_reset_flash_counters. They cost an
+ * increment per flash operation, which is cheaper than debug logging in the
+ * driver and than CONFIG_LFS_STATS. Requires CONFIG_LFS_FLASH_COUNTERS.
+ *
+ * @param partition_label  Optional, label of the partition to get counters for.
+ *                         If not specified, first partition with subtype=lfs is used.
+ * @param[out] counters    Counters of the partition
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_FLASH_COUNTERS is disabled
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ */
+esp_err_t esp_lfs_get_flash_counters(const char* partition_label, esp_lfs_flash_counters_t *counters);
+
+/**
+ * Reset the flash driver counters of LFS to zero
+ *
+ * @param partition_label  Optional, label of the partition to reset counters for.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_FLASH_COUNTERS is disabled
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ */
+esp_err_t esp_lfs_reset_flash_counters(const char* partition_label);
+
+/**
+ * Get the VFS latency histograms of LFS
+ *
+ * Averages hide the occasional long stall, for example a write that has to
+ * compact a metadata block while other tasks wait for the lock. The
+ * histograms show how often these happen and whether the time went into
+ * waiting for the lock or into LittleFS. Requires CONFIG_LFS_LATENCY_HIST.
+ *
+ * @param partition_label  Optional, label of the partition to get histograms for.
+ *                         If not specified, first partition with subtype=lfs is used.
+ * @param[out] latency     Histograms of the partition
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_LATENCY_HIST is disabled
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ */
+esp_err_t esp_lfs_get_latency(const char* partition_label, esp_lfs_latency_t *latency);
+
+/**
+ * Reset the VFS latency histograms of LFS to zero
+ *
+ * @param partition_label  Optional, label of the partition to reset histograms for.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_LATENCY_HIST is disabled
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ */
+esp_err_t esp_lfs_reset_latency(const char* partition_label);
+
+/**
+ * Print the VFS latency histograms of LFS with ESP_LOGI
+ *
+ * Prints one line per operation that happened, with the average and longest
+ * lock wait and time in LittleFS, followed by the non-empty buckets of both
+ * histograms. This is what CONFIG_LFS_LATENCY_DUMP_PERIOD_MS prints.
+ *
+ * @param partition_label  Optional, label of the partition to print histograms for.
+ *                         If not specified, first partition with subtype=lfs is used.
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_LATENCY_HIST is disabled
+ *          - ESP_ERR_INVALID_STATE   if not mounted
+ *          - ESP_ERR_NO_MEM          if the histograms could not be copied
+ */
+esp_err_t esp_lfs_dump_latency(const char* partition_label);
+
+/**
+ * Copy out LFS trace events
+ *
+ * Copies the oldest events not yet read from the trace ring buffer, which is
+ * shared by all partitions. Write them out as they are, for example to a
+ * file or a socket, and decode them on a host with scripts/trace.py.
+ * Requires CONFIG_LFS_TRACE_EVENTS.
+ *
+ * @param[inout] cursor    Position in the trace, start with 0. Advanced past
+ *                         the events copied.
+ * @param[out] buf         Buffer for the events, 24 bytes per event
+ * @param size             Size of buf in bytes
+ * @param[out] read_bytes  Number of bytes copied, 0 if there are no new events
+ *
+ * @return  
+ *          - ESP_OK                  if success
+ *          - ESP_ERR_NOT_SUPPORTED   if CONFIG_LFS_TRACE_EVENTS is disabled
+ */
+esp_err_t esp_lfs_trace_read(uint32_t *cursor, void *buf, size_t size, size_t *read_bytes);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,23 +9,121 @@
  * x
  */
 
+#include "sdkconfig.h"
+
+// The flash driver runs on every block device operation, so its debug logs
+// are compiled out unless asked for. Even when filtered at runtime, each
+// ESP_LOGD costs a level lookup and pushes its arguments.
+#if CONFIG_LFS_FLASH_DEBUG_LOG
+#define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
+#elif CONFIG_LOG_DEFAULT_LEVEL > 3
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+
 #include "freertos/FreeRTOS.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_partition.h"
 #include "esp_lfs.h"
 #include "esp_vfs.h"
 #include "lfs_api.h"
+#include "lfs_trace.h"
 
 static const char* TAG = "LFS";
 
+#if CONFIG_LFS_FLASH_COUNTERS
+#define LFS_API_COUNT(efs, field, n) ((efs)->counters.field += (n))
+#else
+#define LFS_API_COUNT(efs, field, n)
+#endif
+
+#if CONFIG_LFS_MMAP_READ
+#define LFS_API_MMAP_WINDOW (CONFIG_LFS_MMAP_READ_WINDOW_SIZE * 1024)
+
+// Serve a read with memcpy from the mapped window, moving the window to the
+// read if needed. Returns false if the read has to go through the flash
+// driver instead.
+static bool lfs_api_mmap_read(esp_lfs_t *efs, uint32_t addr, void *buffer, lfs_size_t size)
+{
+	if (size < CONFIG_LFS_MMAP_READ_MIN_SIZE || efs->mmap_failed) {
+		return false;
+	}
+
+	if (efs->mmap_ptr == NULL || addr < efs->mmap_off ||
+			addr + size > efs->mmap_off + efs->mmap_size) {
+		uint32_t start = addr - (addr % LFS_API_MMAP_WINDOW);
+		uint32_t len = efs->partition->size - start;
+		if (len > LFS_API_MMAP_WINDOW) {
+			len = LFS_API_MMAP_WINDOW;
+		}
+		if (addr + size > start + len) {
+			return false;
+		}
+
+		lfs_api_unmap(efs);
+
+		const void *ptr;
+		spi_flash_mmap_handle_t handle;
+		esp_err_t err = esp_partition_mmap(efs->partition, start, len, SPI_FLASH_MMAP_DATA, &ptr, &handle);
+		if (err != ESP_OK) {
+			// most likely out of MMU pages, don't try again on every read
+			ESP_LOGW(TAG, "failed to map addr %08x, size %08x, err %d, reading through the flash driver", start, len, err);
+			efs->mmap_failed = true;
+			return false;
+		}
+
+		efs->mmap_ptr = ptr;
+		efs->mmap_handle = handle;
+		efs->mmap_off = start;
+		efs->mmap_size = len;
+		LFS_API_COUNT(efs, mmap_maps, 1);
+	}
+
+	memcpy(buffer, (const uint8_t *)efs->mmap_ptr + (addr - efs->mmap_off), size);
+	LFS_API_COUNT(efs, mmap_reads, 1);
+	return true;
+}
+
+// Drop the window if a program or erase changes flash under it
+static void lfs_api_mmap_invalidate(esp_lfs_t *efs, uint32_t addr, uint32_t size)
+{
+	if (efs->mmap_ptr != NULL && addr < efs->mmap_off + efs->mmap_size &&
+			addr + size > efs->mmap_off) {
+		lfs_api_unmap(efs);
+	}
+}
+#endif
+
+void lfs_api_unmap(esp_lfs_t *efs)
+{
+#if CONFIG_LFS_MMAP_READ
+	if (efs->mmap_ptr != NULL) {
+		spi_flash_munmap(efs->mmap_handle);
+		efs->mmap_ptr = NULL;
+		efs->mmap_off = 0;
+		efs->mmap_size = 0;
+	}
+#endif
+}
+
 int lfs_api_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
 {
 	esp_lfs_t *efs = (esp_lfs_t *) (c->context);
 
 	ESP_LOGD(TAG, "%s - block=0x%08x off=0x%08x size=%d", __func__, block, off, size);
 
+	LFS_API_COUNT(efs, read_count, 1);
+	LFS_API_COUNT(efs, read_bytes, size);
+
+#if CONFIG_LFS_MMAP_READ
+	if (lfs_api_mmap_read(efs, (block * efs->sector_sz) + off, buffer, size)) {
+		return LFS_ERR_OK;
+	}
+#endif
+
 	esp_err_t err = esp_partition_read(efs->partition, (block * efs->sector_sz) + off, buffer, size);
     if (err != ESP_OK ) {
+        LFS_API_COUNT(efs, errors, 1);
         ESP_LOGE(TAG, "failed to read addr %08x, size %08x, err %d", (block * efs->sector_sz) + off, size, err);
         return LFS_ERR_IO;
     }
@@ -38,8 +136,16 @@ int lfs_api_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, c
 
 	ESP_LOGD(TAG, "%s - block=0x%08x off=0x%08x size=%d", __func__, block, off, size);
 
+	LFS_API_COUNT(efs, prog_count, 1);
+	LFS_API_COUNT(efs, prog_bytes, size);
+
+#if CONFIG_LFS_MMAP_READ
+	lfs_api_mmap_invalidate(efs, (block * efs->sector_sz) + off, size);
+#endif
+
 	esp_err_t err = esp_partition_write(efs->partition, (block * efs->sector_sz) + off, buffer, size);
     if (err != ESP_OK ) {
+        LFS_API_COUNT(efs, errors, 1);
         ESP_LOGE(TAG, "failed to write addr %08x, size %08x, err %d", (block * efs->sector_sz) + off, size, err);
         return LFS_ERR_IO;
     }
@@ -52,8 +158,15 @@ int lfs_api_erase(const struct lfs_config *c, lfs_block_t block)
 
 	ESP_LOGD(TAG, "%s - block=0x%08x", __func__, block);
 
+	LFS_API_COUNT(efs, erase_count, 1);
+
+#if CONFIG_LFS_MMAP_READ
+	lfs_api_mmap_invalidate(efs, block * efs->sector_sz, efs->sector_sz);
+#endif
+
 	esp_err_t err = esp_partition_erase_range(efs->partition, block * efs->sector_sz, efs->sector_sz);
     if (err != ESP_OK ) {
+        LFS_API_COUNT(efs, errors, 1);
         ESP_LOGE(TAG, "failed to erase addr %08x, size %08x, err %d", (block * efs->sector_sz), block, err);
         return LFS_ERR_IO;
     }
@@ -64,5 +177,21 @@ int lfs_api_sync(const struct lfs_config *c)
 {
 	ESP_LOGD(TAG, "%s", __func__);
 
+	LFS_API_COUNT((esp_lfs_t *) (c->context), sync_count, 1);
+
 	return LFS_ERR_OK;
 }
+
+#if CONFIG_LFS_STATS
+uint64_t lfs_stats_clock(void)
+{
+	return esp_timer_get_time();
+}
+#endif
+
+#if CONFIG_LFS_TRACE_EVENTS
+uint32_t lfs_trace_clock(void)
+{
+	return (uint32_t)esp_timer_get_time();
+}
+#endif
@@ -19,6 +19,8 @@
 #include "freertos/semphr.h"
 #include "lfs.h"
 #include "esp_vfs.h"
+#include "esp_partition.h"
+#include "esp_lfs.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -52,6 +54,23 @@ typedef struct {
     size_t max_files;						/*!< Maximum files that could be open at the same time. */
     bool mounted;							/*!< Partition was mounted */
     uint32_t sector_sz;						/*!< Sector size */
+    TaskHandle_t gc_task;					/*!< Background compaction task */
+    TaskHandle_t mount_task;				/*!< Background mount task */
+    bool format_if_mount_failed;			/*!< Format the partition if it fails to mount */
+#if CONFIG_LFS_FLASH_COUNTERS
+    esp_lfs_flash_counters_t counters;		/*!< Flash driver counters */
+#endif
+#if CONFIG_LFS_MMAP_READ
+    const void *mmap_ptr;					/*!< Mapped read window, NULL if none */
+    spi_flash_mmap_handle_t mmap_handle;	/*!< Handle of the read window */
+    uint32_t mmap_off;						/*!< Partition offset of the read window */
+    uint32_t mmap_size;						/*!< Size of the read window */
+    bool mmap_failed;						/*!< Mapping failed, read through the flash driver */
+#endif
+#if CONFIG_LFS_LATENCY_HIST
+    esp_lfs_latency_t latency;				/*!< VFS latency histograms */
+    TaskHandle_t latency_task;				/*!< Periodic latency histogram log task */
+#endif
 } esp_lfs_t;
 
 int lfs_api_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
@@ -62,6 +81,8 @@ int lfs_api_erase(const struct lfs_config *c, lfs_block_t block);
 
 int lfs_api_sync(const struct lfs_config *c);
 
+void lfs_api_unmap(esp_lfs_t *efs);
+
 #ifdef __cplusplus
 }
 #endif
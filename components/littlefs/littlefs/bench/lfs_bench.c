@@ -0,0 +1,1047 @@
+/*
+ * Host benchmarks for littlefs
+ *
+ * Runs littlefs through a set of representative workloads on the RAM block
+ * device and reports throughput, block device traffic per operation and
+ * latency percentiles, both in wall time and in modeled flash time.
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "lfs.h"
+#include "lfs_trace.h"
+#include "emubd/lfs_rambd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+
+// bench configuration options, these match the test configuration options
+#ifndef LFS_READ_SIZE
+#define LFS_READ_SIZE 16
+#endif
+
+#ifndef LFS_PROG_SIZE
+#define LFS_PROG_SIZE LFS_READ_SIZE
+#endif
+
+#ifndef LFS_BLOCK_SIZE
+#define LFS_BLOCK_SIZE 4096
+#endif
+
+#ifndef LFS_BLOCK_COUNT
+#define LFS_BLOCK_COUNT 1024
+#endif
+
+#ifndef LFS_BLOCK_CYCLES
+#define LFS_BLOCK_CYCLES 500
+#endif
+
+#ifndef LFS_CACHE_SIZE
+#define LFS_CACHE_SIZE 256
+#endif
+
+#ifndef LFS_LOOKAHEAD_SIZE
+#define LFS_LOOKAHEAD_SIZE 32
+#endif
+
+#ifndef LFS_NAME_HASH
+#define LFS_NAME_HASH false
+#endif
+
+#ifndef LFS_MOUNT_CHECKPOINT
+#define LFS_MOUNT_CHECKPOINT false
+#endif
+
+#ifndef LFS_SPLIT_SIZE
+#define LFS_SPLIT_SIZE 0
+#endif
+
+#ifndef LFS_COMPACT_THRESH
+#define LFS_COMPACT_THRESH 0
+#endif
+
+#ifndef LFS_TAG_INDEX_SIZE
+#define LFS_TAG_INDEX_SIZE 1024
+#endif
+
+static lfs_t lfs;
+static lfs_rambd_t bd;
+
+static const struct lfs_rambd_config bdcfg = {
+    .erase_value = -1,
+};
+
+static const struct lfs_config cfg = {
+    .context = &bd,
+    .read  = &lfs_rambd_read,
+    .prog  = &lfs_rambd_prog,
+    .erase = &lfs_rambd_erase,
+    .sync  = &lfs_rambd_sync,
+
+    .read_size      = LFS_READ_SIZE,
+    .prog_size      = LFS_PROG_SIZE,
+    .block_size     = LFS_BLOCK_SIZE,
+    .block_count    = LFS_BLOCK_COUNT,
+    .block_cycles   = LFS_BLOCK_CYCLES,
+    .cache_size     = LFS_CACHE_SIZE,
+    .lookahead_size = LFS_LOOKAHEAD_SIZE,
+    .name_hash      = LFS_NAME_HASH,
+    .mount_checkpoint = LFS_MOUNT_CHECKPOINT,
+    .split_size     = LFS_SPLIT_SIZE,
+    .compact_thresh = LFS_COMPACT_THRESH,
+    .tag_index_size = LFS_TAG_INDEX_SIZE,
+};
+
+#ifdef LFS_YES_STATS
+uint64_t lfs_stats_clock(void) {
+    return lfs_rambd_clock(&cfg);
+}
+#endif
+
+#ifdef LFS_YES_TRACE_EVENTS
+// trace events are timestamped with the modeled flash time in us, which
+// keeps counting across workloads
+static uint64_t bench_trace_base;
+
+uint32_t lfs_trace_clock(void) {
+    return (bench_trace_base + lfs_rambd_clock(&cfg)) / 1000;
+}
+
+static FILE *bench_trace;
+static uint32_t bench_trace_cursor;
+
+static void bench_trace_drain(void) {
+    struct lfs_trace_record records[64];
+    uint32_t n;
+    while ((n = lfs_trace_read(&bench_trace_cursor, records, 64)) > 0) {
+        if (bench_trace) {
+            fwrite(records, sizeof(struct lfs_trace_record), n, bench_trace);
+        }
+    }
+}
+#endif
+
+
+/// Measurement ///
+struct bench_params {
+    lfs_size_t ops;
+    lfs_size_t size;
+    lfs_size_t depth;
+    lfs_size_t entries;
+};
+
+struct bench {
+    const char *name;
+    const struct bench_params *params;
+
+    lfs_size_t ops;
+    uint64_t *wall;
+    uint64_t *modeled;
+
+    uint64_t read;
+    uint64_t prog;
+    uint64_t erase;
+
+    // state of the op in flight
+    uint64_t wall0;
+    uint64_t modeled0;
+    uint64_t read0;
+    uint64_t prog0;
+    uint64_t erase0;
+};
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void bench_start(struct bench *b) {
+    b->read0 = bd.stats.read_count;
+    b->prog0 = bd.stats.prog_count;
+    b->erase0 = bd.stats.erase_count;
+    b->modeled0 = lfs_rambd_clock(&cfg);
+    b->wall0 = bench_now();
+}
+
+static void bench_stop(struct bench *b) {
+    uint64_t wall = bench_now();
+    b->wall[b->ops] = wall - b->wall0;
+    b->modeled[b->ops] = lfs_rambd_clock(&cfg) - b->modeled0;
+    b->read += bd.stats.read_count - b->read0;
+    b->prog += bd.stats.prog_count - b->prog0;
+    b->erase += bd.stats.erase_count - b->erase0;
+    b->ops += 1;
+#ifdef LFS_YES_TRACE_EVENTS
+    bench_trace_drain();
+#endif
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t bench_percentile(uint64_t *samples, lfs_size_t count,
+        unsigned p) {
+    if (count == 0) {
+        return 0;
+    }
+
+    qsort(samples, count, sizeof(uint64_t), bench_cmp);
+    return samples[((uint64_t)count-1)*p / 100];
+}
+
+static uint64_t bench_sum(const uint64_t *samples, lfs_size_t count) {
+    uint64_t sum = 0;
+    for (lfs_size_t i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    return sum;
+}
+
+// deterministic so runs can be compared
+static uint32_t bench_prng(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int bench_mount(void) {
+    int err = lfs_format(&lfs, &cfg);
+    if (err) {
+        return err;
+    }
+
+    return lfs_mount(&lfs, &cfg);
+}
+
+static int bench_mkfile(const char *path, lfs_size_t size, uint8_t *buffer,
+        lfs_size_t chunk) {
+    lfs_file_t file;
+    int err = lfs_file_open(&lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < size; i += chunk) {
+        lfs_ssize_t res = lfs_file_write(&lfs, &file, buffer,
+                lfs_min(chunk, size - i));
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+    }
+
+    return lfs_file_close(&lfs, &file);
+}
+
+
+/// Workloads ///
+
+// sequential writes to one large file, the final op includes the close
+static int bench_seqwrite(struct bench *b, uint8_t *buffer) {
+    lfs_file_t file;
+    int err = lfs_file_open(&lfs, &file, "seq",
+            LFS_O_WRONLY | LFS_O_CREAT);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        bench_start(b);
+        lfs_ssize_t res = lfs_file_write(&lfs, &file,
+                buffer, b->params->size);
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+
+        if (i == b->params->ops-1) {
+            err = lfs_file_close(&lfs, &file);
+            if (err) {
+                return err;
+            }
+        }
+        bench_stop(b);
+    }
+
+    return 0;
+}
+
+// sequential reads of one large file
+static int bench_seqread(struct bench *b, uint8_t *buffer) {
+    int err = bench_mkfile("seq", b->params->ops*b->params->size,
+            buffer, b->params->size);
+    if (err) {
+        return err;
+    }
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "seq", LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        bench_start(b);
+        lfs_ssize_t res = lfs_file_read(&lfs, &file,
+                buffer, b->params->size);
+        bench_stop(b);
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+    }
+
+    return lfs_file_close(&lfs, &file);
+}
+
+// sequential reads of one large indexed file, with linear reads the runs
+// of consecutive blocks are read with one call
+static int bench_idxseqread(struct bench *b, uint8_t *buffer) {
+    // the config must outlive us since it is used until the final unmount
+    static struct lfs_config icfg;
+    icfg = cfg;
+    icfg.indexed_files = true;
+    icfg.linear_reads = true;
+    int err = lfs_unmount(&lfs);
+    if (!err) {
+        err = lfs_format(&lfs, &icfg);
+    }
+    if (!err) {
+        err = lfs_mount(&lfs, &icfg);
+    }
+    if (err) {
+        return err;
+    }
+
+    const struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_size_t size = b->params->ops*b->params->size;
+    lfs_file_t file;
+    err = lfs_file_opencfg(&lfs, &file, "seq",
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &fcfg);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < size; i += b->params->size) {
+        lfs_ssize_t res = lfs_file_write(&lfs, &file, buffer,
+                lfs_min(b->params->size, size - i));
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+    }
+
+    err = lfs_file_close(&lfs, &file);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_file_open(&lfs, &file, "seq", LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        bench_start(b);
+        lfs_ssize_t res = lfs_file_read(&lfs, &file,
+                buffer, b->params->size);
+        bench_stop(b);
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+    }
+
+    return lfs_file_close(&lfs, &file);
+}
+
+// append-only logging, reopening the log for every record
+static int bench_append(struct bench *b, uint8_t *buffer) {
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        bench_start(b);
+        lfs_file_t file;
+        int err = lfs_file_open(&lfs, &file, "log",
+                LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+        if (err) {
+            return err;
+        }
+
+        lfs_ssize_t res = lfs_file_write(&lfs, &file,
+                buffer, b->params->size);
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+
+        err = lfs_file_close(&lfs, &file);
+        if (err) {
+            return err;
+        }
+        bench_stop(b);
+    }
+
+    return 0;
+}
+
+// many small files in one directory
+static int bench_smallfiles(struct bench *b, uint8_t *buffer) {
+    int err = lfs_mkdir(&lfs, "small");
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        char path[64];
+        sprintf(path, "small/f%"PRIu32, i);
+        bench_start(b);
+        err = bench_mkfile(path, b->params->size, buffer, b->params->size);
+        if (err) {
+            return err;
+        }
+        bench_stop(b);
+    }
+
+    return 0;
+}
+
+// path lookups through a deep directory tree
+static int bench_deeppaths(struct bench *b, uint8_t *buffer) {
+    char path[LFS_NAME_MAX*4];
+    if (b->params->depth*strlen("/dir0") + strlen("/file") >= sizeof(path)) {
+        return LFS_ERR_NAMETOOLONG;
+    }
+
+    path[0] = '\0';
+    for (lfs_size_t i = 0; i < b->params->depth; i++) {
+        // a few siblings at each level so lookups have to search
+        for (int j = 0; j < 4; j++) {
+            char sibling[sizeof(path) + 16];
+            sprintf(sibling, "%s%sdir%d", path, i ? "/" : "", j);
+            int err = lfs_mkdir(&lfs, sibling);
+            if (err) {
+                return err;
+            }
+        }
+
+        sprintf(path + strlen(path), "%sdir3", i ? "/" : "");
+    }
+
+    strcat(path, "/file");
+    int err = bench_mkfile(path, b->params->size, buffer, b->params->size);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        struct lfs_info info;
+        bench_start(b);
+        err = lfs_stat(&lfs, path, &info);
+        bench_stop(b);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+// full listings of a directory
+static int bench_dirlist(struct bench *b, uint8_t *buffer) {
+    int err = lfs_mkdir(&lfs, "list");
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->entries; i++) {
+        char path[64];
+        sprintf(path, "list/f%"PRIu32, i);
+        err = bench_mkfile(path, 0, buffer, b->params->size);
+        if (err) {
+            return err;
+        }
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        bench_start(b);
+        lfs_dir_t dir;
+        err = lfs_dir_open(&lfs, &dir, "list");
+        if (err) {
+            return err;
+        }
+
+        struct lfs_info info;
+        int res;
+        while ((res = lfs_dir_read(&lfs, &dir, &info)) > 0) {
+        }
+
+        err = lfs_dir_close(&lfs, &dir);
+        bench_stop(b);
+        if (res < 0) {
+            return res;
+        }
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+// lookups in a directory split over many metadata pairs, filled either by
+// appending entries or by inserting them in a scattered order
+static int bench_split(struct bench *b, uint8_t *buffer, bool append) {
+    int err = lfs_mkdir(&lfs, "split");
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->entries; i++) {
+        // a multiplicative permutation of the entries
+        lfs_size_t n = append ? i
+                : (lfs_size_t)((uint64_t)i*2654435761u % b->params->entries);
+        char path[64];
+        sprintf(path, "split/f%08"PRIu32, n);
+        err = bench_mkfile(path, 0, buffer, b->params->size);
+        if (err) {
+            return err;
+        }
+    }
+
+    uint32_t prng = 42;
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        char path[64];
+        sprintf(path, "split/f%08"PRIu32,
+                bench_prng(&prng) % b->params->entries);
+        struct lfs_info info;
+        bench_start(b);
+        err = lfs_stat(&lfs, path, &info);
+        bench_stop(b);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_seqsplit(struct bench *b, uint8_t *buffer) {
+    return bench_split(b, buffer, true);
+}
+
+static int bench_randsplit(struct bench *b, uint8_t *buffer) {
+    return bench_split(b, buffer, false);
+}
+
+// random seeks and reads in one large file
+static int bench_randread(struct bench *b, uint8_t *buffer) {
+    lfs_size_t size = lfs_min(b->params->ops*b->params->size,
+            cfg.block_size*cfg.block_count / 4);
+    int err = bench_mkfile("rand", size, buffer, b->params->size);
+    if (err) {
+        return err;
+    }
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "rand", LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+
+    uint32_t prng = 42;
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        lfs_soff_t off = bench_prng(&prng) % (size - b->params->size + 1);
+        bench_start(b);
+        lfs_soff_t pos = lfs_file_seek(&lfs, &file, off, LFS_SEEK_SET);
+        lfs_ssize_t res = lfs_file_read(&lfs, &file,
+                buffer, b->params->size);
+        bench_stop(b);
+        if (pos < 0 || res < 0) {
+            lfs_file_close(&lfs, &file);
+            return (pos < 0) ? pos : res;
+        }
+    }
+
+    return lfs_file_close(&lfs, &file);
+}
+
+// renames bouncing files back and forth in one directory
+static int bench_rename(struct bench *b, uint8_t *buffer) {
+    int err = lfs_mkdir(&lfs, "ren");
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->entries; i++) {
+        char path[64];
+        sprintf(path, "ren/a%"PRIu32, i);
+        err = bench_mkfile(path, b->params->size, buffer, b->params->size);
+        if (err) {
+            return err;
+        }
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        lfs_size_t n = i % b->params->entries;
+        bool forward = (i / b->params->entries) % 2 == 0;
+        char oldpath[64];
+        char newpath[64];
+        sprintf(oldpath, "ren/%c%"PRIu32, forward ? 'a' : 'b', n);
+        sprintf(newpath, "ren/%c%"PRIu32, forward ? 'b' : 'a', n);
+        bench_start(b);
+        err = lfs_rename(&lfs, oldpath, newpath);
+        bench_stop(b);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+// rewriting a 4 byte header at the start of one large file, which copies
+// the rest of the file on every close
+static int bench_rewrite(struct bench *b, uint8_t *buffer) {
+    lfs_size_t size = lfs_min(b->params->ops*b->params->size,
+            cfg.block_size*cfg.block_count / 8);
+    int err = bench_mkfile("hdr", size, buffer, b->params->size);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        bench_start(b);
+        lfs_file_t file;
+        err = lfs_file_open(&lfs, &file, "hdr", LFS_O_RDWR);
+        if (err) {
+            return err;
+        }
+
+        lfs_ssize_t res = lfs_file_write(&lfs, &file, &i, 4);
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+
+        err = lfs_file_close(&lfs, &file);
+        if (err) {
+            return err;
+        }
+        bench_stop(b);
+    }
+
+    return 0;
+}
+
+// updates of 4 byte records at random offsets in one large file, with the
+// file in either layout, ctz rewrites everything after the record on every
+// close while indexed only rewrites the record's block and its index path
+static int bench_slots_layout(struct bench *b, uint8_t *buffer,
+        int layout) {
+    // indexed files need a filesystem formatted for them, the config must
+    // outlive us since it is used until the final unmount
+    static struct lfs_config icfg;
+    icfg = cfg;
+    icfg.indexed_files = true;
+    int err = lfs_unmount(&lfs);
+    if (!err) {
+        err = lfs_format(&lfs, &icfg);
+    }
+    if (!err) {
+        err = lfs_mount(&lfs, &icfg);
+    }
+    if (err) {
+        return err;
+    }
+
+    const struct lfs_file_config fcfg = {.layout = layout};
+    lfs_size_t size = lfs_min(b->params->ops*b->params->size,
+            cfg.block_size*cfg.block_count / 8);
+    lfs_file_t file;
+    err = lfs_file_opencfg(&lfs, &file, "slots",
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC, &fcfg);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < size; i += b->params->size) {
+        lfs_ssize_t res = lfs_file_write(&lfs, &file, buffer,
+                lfs_min(b->params->size, size - i));
+        if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+    }
+
+    err = lfs_file_close(&lfs, &file);
+    if (err) {
+        return err;
+    }
+
+    uint32_t prng = 42;
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        lfs_soff_t off = 4*(bench_prng(&prng) % (size / 4));
+        bench_start(b);
+        err = lfs_file_open(&lfs, &file, "slots", LFS_O_RDWR);
+        if (err) {
+            return err;
+        }
+
+        lfs_soff_t pos = lfs_file_seek(&lfs, &file, off, LFS_SEEK_SET);
+        lfs_ssize_t res = lfs_file_write(&lfs, &file, &i, 4);
+        if (pos < 0 || res < 0) {
+            lfs_file_close(&lfs, &file);
+            return (pos < 0) ? pos : res;
+        }
+
+        err = lfs_file_close(&lfs, &file);
+        if (err) {
+            return err;
+        }
+        bench_stop(b);
+    }
+
+    return 0;
+}
+
+static int bench_slots(struct bench *b, uint8_t *buffer) {
+    return bench_slots_layout(b, buffer, LFS_LAYOUT_CTZ);
+}
+
+static int bench_idxslots(struct bench *b, uint8_t *buffer) {
+    return bench_slots_layout(b, buffer, LFS_LAYOUT_INDEXED);
+}
+
+// remounts of a filesystem with a directory per entry, each op is a mount
+// and the first file open after it as on a cold boot, with or without the
+// mount checkpoint that lets mounts skip reading every directory
+static int bench_boot_checkpoint(struct bench *b, uint8_t *buffer,
+        bool checkpoint) {
+    // the config must outlive us since it is used until the final unmount
+    static struct lfs_config ccfg;
+    ccfg = cfg;
+    ccfg.mount_checkpoint = checkpoint;
+    int err = lfs_unmount(&lfs);
+    if (!err) {
+        err = lfs_format(&lfs, &ccfg);
+    }
+    if (!err) {
+        err = lfs_mount(&lfs, &ccfg);
+    }
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->entries; i++) {
+        char path[64];
+        sprintf(path, "d%"PRIu32, i);
+        err = lfs_mkdir(&lfs, path);
+        if (err) {
+            return err;
+        }
+    }
+
+    err = bench_mkfile("boot", b->params->size, buffer, b->params->size);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t i = 0; i < b->params->ops; i++) {
+        err = lfs_unmount(&lfs);
+        if (err) {
+            return err;
+        }
+
+        bench_start(b);
+        err = lfs_mount(&lfs, &ccfg);
+        if (err) {
+            return err;
+        }
+
+        lfs_file_t file;
+        err = lfs_file_open(&lfs, &file, "boot", LFS_O_RDONLY);
+        if (err) {
+            return err;
+        }
+
+        lfs_ssize_t res = lfs_file_read(&lfs, &file, buffer,
+                b->params->size);
+        err = lfs_file_close(&lfs, &file);
+        bench_stop(b);
+        if (res < 0) {
+            return res;
+        }
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_boot(struct bench *b, uint8_t *buffer) {
+    return bench_boot_checkpoint(b, buffer, false);
+}
+
+static int bench_ckptboot(struct bench *b, uint8_t *buffer) {
+    return bench_boot_checkpoint(b, buffer, true);
+}
+
+// allocating until the filesystem is full, ignores the op count
+static int bench_fill(struct bench *b, uint8_t *buffer) {
+    lfs_file_t file;
+    int err = lfs_file_open(&lfs, &file, "fill",
+            LFS_O_WRONLY | LFS_O_CREAT);
+    if (err) {
+        return err;
+    }
+
+    while (true) {
+        bench_start(b);
+        lfs_ssize_t res = lfs_file_write(&lfs, &file,
+                buffer, b->params->size);
+        if (res == LFS_ERR_NOSPC) {
+            break;
+        } else if (res < 0) {
+            lfs_file_close(&lfs, &file);
+            return res;
+        }
+
+        err = lfs_file_sync(&lfs, &file);
+        if (err == LFS_ERR_NOSPC) {
+            break;
+        } else if (err) {
+            lfs_file_close(&lfs, &file);
+            return err;
+        }
+        bench_stop(b);
+    }
+
+    // the failing op isn't counted, and neither is whatever the close
+    // does with the leftover data
+    lfs_file_close(&lfs, &file);
+    return 0;
+}
+
+static const struct bench_workload {
+    const char *name;
+    int (*run)(struct bench *b, uint8_t *buffer);
+} bench_workloads[] = {
+    {"seqwrite",   bench_seqwrite},
+    {"seqread",    bench_seqread},
+    {"idxseqread", bench_idxseqread},
+    {"append",     bench_append},
+    {"smallfiles", bench_smallfiles},
+    {"deeppaths",  bench_deeppaths},
+    {"dirlist",    bench_dirlist},
+    {"seqsplit",   bench_seqsplit},
+    {"randsplit",  bench_randsplit},
+    {"randread",   bench_randread},
+    {"rename",     bench_rename},
+    {"rewrite",    bench_rewrite},
+    {"slots",      bench_slots},
+    {"idxslots",   bench_idxslots},
+    {"boot",       bench_boot},
+    {"ckptboot",   bench_ckptboot},
+    {"fill",       bench_fill},
+};
+
+
+/// Reporting ///
+static void bench_report(FILE *f, bool json, bool first,
+        struct bench *b) {
+    double ops = b->ops ? b->ops : 1;
+    double wall = bench_sum(b->wall, b->ops) / 1e9;
+    double modeled = bench_sum(b->modeled, b->ops) / 1e9;
+    uint64_t p50 = bench_percentile(b->wall, b->ops, 50);
+    uint64_t p99 = bench_percentile(b->wall, b->ops, 99);
+    uint64_t mp50 = bench_percentile(b->modeled, b->ops, 50);
+    uint64_t mp99 = bench_percentile(b->modeled, b->ops, 99);
+
+    if (json) {
+        fprintf(f, "%s\n  {\"workload\": \"%s\", \"ops\": %"PRIu32", "
+                "\"ops_per_s\": %.1f, \"modeled_ops_per_s\": %.1f, "
+                "\"read_per_op\": %.1f, \"prog_per_op\": %.1f, "
+                "\"erase_per_op\": %.1f, "
+                "\"p50_ns\": %"PRIu64", \"p99_ns\": %"PRIu64", "
+                "\"modeled_p50_ns\": %"PRIu64", "
+                "\"modeled_p99_ns\": %"PRIu64"}",
+                first ? "" : ",", b->name, b->ops,
+                wall > 0 ? b->ops / wall : 0.0,
+                modeled > 0 ? b->ops / modeled : 0.0,
+                b->read / ops, b->prog / ops, b->erase / ops,
+                p50, p99, mp50, mp99);
+    } else {
+        fprintf(f, "%s,%"PRIu32",%.1f,%.1f,%.1f,%.1f,%.1f,"
+                "%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+                b->name, b->ops,
+                wall > 0 ? b->ops / wall : 0.0,
+                modeled > 0 ? b->ops / modeled : 0.0,
+                b->read / ops, b->prog / ops, b->erase / ops,
+                p50, p99, mp50, mp99);
+    }
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-j] [-o file] [-n ops] [-s size] "
+            "[-d depth] [-e entries] [-t trace] [workload...]\n", prog);
+    fprintf(stderr, "workloads:");
+    for (unsigned i = 0; i < sizeof(bench_workloads) /
+            sizeof(bench_workloads[0]); i++) {
+        fprintf(stderr, " %s", bench_workloads[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    struct bench_params params = {
+        .ops = 1000,
+        .size = 256,
+        .depth = 8,
+        .entries = 100,
+    };
+    bool json = false;
+    const char *out = NULL;
+    const char *trace = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "jo:n:s:d:e:t:h")) != -1) {
+        switch (opt) {
+            case 'j': json = true; break;
+            case 'o': out = optarg; break;
+            case 'n': params.ops = strtoul(optarg, NULL, 0); break;
+            case 's': params.size = strtoul(optarg, NULL, 0); break;
+            case 'd': params.depth = strtoul(optarg, NULL, 0); break;
+            case 'e': params.entries = strtoul(optarg, NULL, 0); break;
+            case 't': trace = optarg; break;
+            default: bench_usage(argv[0]); return 1;
+        }
+    }
+
+    if (params.ops == 0 || params.size == 0 || params.entries == 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    FILE *f = stdout;
+    if (out) {
+        f = fopen(out, "w");
+        if (!f) {
+            perror(out);
+            return 1;
+        }
+    }
+
+    if (trace) {
+#ifdef LFS_YES_TRACE_EVENTS
+        bench_trace = fopen(trace, "wb");
+        if (!bench_trace) {
+            perror(trace);
+            return 1;
+        }
+#else
+        fprintf(stderr, "-t needs LFS_YES_TRACE_EVENTS\n");
+        return 1;
+#endif
+    }
+
+    uint8_t *buffer = malloc(params.size);
+    uint64_t *wall = malloc(sizeof(uint64_t) *
+            lfs_max(params.ops, LFS_BLOCK_SIZE*LFS_BLOCK_COUNT/params.size));
+    uint64_t *modeled = malloc(sizeof(uint64_t) *
+            lfs_max(params.ops, LFS_BLOCK_SIZE*LFS_BLOCK_COUNT/params.size));
+    if (!buffer || !wall || !modeled) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (lfs_size_t i = 0; i < params.size; i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+
+    if (json) {
+        fprintf(f, "[");
+    } else {
+        fprintf(f, "workload,ops,ops_per_s,modeled_ops_per_s,"
+                "read_per_op,prog_per_op,erase_per_op,"
+                "p50_ns,p99_ns,modeled_p50_ns,modeled_p99_ns\n");
+    }
+
+    int res = 0;
+    bool first = true;
+    for (unsigned i = 0; i < sizeof(bench_workloads) /
+            sizeof(bench_workloads[0]); i++) {
+        const struct bench_workload *w = &bench_workloads[i];
+        bool selected = (optind == argc);
+        for (int j = optind; j < argc; j++) {
+            selected = selected || strcmp(argv[j], w->name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        struct bench b = {
+            .name = w->name,
+            .params = &params,
+            .wall = wall,
+            .modeled = modeled,
+        };
+
+        int err = lfs_rambd_createcfg(&cfg, &bdcfg);
+        if (!err) {
+            err = bench_mount();
+        }
+
+        if (!err) {
+            err = w->run(&b, buffer);
+            int err2 = lfs_unmount(&lfs);
+            err = err ? err : err2;
+        }
+#ifdef LFS_YES_TRACE_EVENTS
+        bench_trace_drain();
+        bench_trace_base += lfs_rambd_clock(&cfg);
+#endif
+        lfs_rambd_destroy(&cfg);
+
+        if (err) {
+            fprintf(stderr, "%s failed with %d\n", w->name, err);
+            res = 1;
+            continue;
+        }
+
+        bench_report(f, json, first, &b);
+        first = false;
+    }
+
+    if (json) {
+        fprintf(f, "\n]\n");
+    }
+
+    if (out) {
+        fclose(f);
+    }
+
+#ifdef LFS_YES_TRACE_EVENTS
+    if (bench_trace) {
+        fclose(bench_trace);
+    }
+#endif
+
+    free(buffer);
+    free(wall);
+    free(modeled);
+    return res;
+}
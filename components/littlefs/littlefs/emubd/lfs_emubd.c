@@ -160,6 +160,17 @@ int lfs_emubd_read(const struct lfs_config *cfg, lfs_block_t block,
     assert(size % cfg->read_size == 0);
     assert(block < cfg->block_count);
 
+    // Reads past the end of a block continue into the next block
+    if (off + size > cfg->block_size) {
+        lfs_size_t diff = cfg->block_size - off;
+        int err = lfs_emubd_read(cfg, block, off, data, diff);
+        if (err) {
+            return err;
+        }
+
+        return lfs_emubd_read(cfg, block+1, 0, data+diff, size-diff);
+    }
+
     // Zero out buffer for debugging
     memset(data, 0, size);
 
@@ -0,0 +1,222 @@
+/*
+ * Block device emulated on a single memory-mapped image
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "emubd/lfs_mmapbd.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+
+// Emulated block device utils
+static int lfs_mmapbd_load(lfs_mmapbd_t *bd, const char *name,
+        void *buffer, size_t size) {
+    snprintf(bd->child, LFS_NAME_MAX, "%s", name);
+    FILE *f = fopen(bd->path, "rb");
+    if (!f) {
+        return (errno == ENOENT) ? 0 : -errno;
+    }
+
+    size_t res = fread(buffer, size, 1, f);
+    if (res < 1) {
+        int err = -errno;
+        fclose(f);
+        return err;
+    }
+
+    if (fclose(f)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int lfs_mmapbd_store(lfs_mmapbd_t *bd, const char *name,
+        const void *buffer, size_t size) {
+    snprintf(bd->child, LFS_NAME_MAX, "%s", name);
+    FILE *f = fopen(bd->path, "wb");
+    if (!f) {
+        return -errno;
+    }
+
+    size_t res = fwrite(buffer, size, 1, f);
+    if (res < 1) {
+        int err = -errno;
+        fclose(f);
+        return err;
+    }
+
+    if (fclose(f)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+
+// Block device emulated on a memory-mapped image
+int lfs_mmapbd_create(const struct lfs_config *cfg, const char *path) {
+    LFS_TRACE("lfs_mmapbd_create(%p {.context=%p, "
+                ".read=%p, .prog=%p, .erase=%p, .sync=%p, "
+                ".read_size=%"PRIu32", .prog_size=%"PRIu32", "
+                ".block_size=%"PRIu32", .block_count=%"PRIu32"}, \"%s\")",
+            (void*)cfg, cfg->context,
+            (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
+            (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
+            cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
+            path);
+    lfs_mmapbd_t *bd = cfg->context;
+    size_t datasize = (size_t)cfg->block_size * cfg->block_count;
+
+    // Allocate buffer for creating children files
+    size_t pathlen = strlen(path);
+    bd->path = malloc(pathlen + 1 + LFS_NAME_MAX + 1);
+    if (!bd->path) {
+        int err = -ENOMEM;
+        LFS_TRACE("lfs_mmapbd_create -> %"PRId32, err);
+        return err;
+    }
+
+    strcpy(bd->path, path);
+    bd->path[pathlen] = '/';
+    bd->child = &bd->path[pathlen+1];
+    memset(bd->child, '\0', LFS_NAME_MAX+1);
+
+    // Create directory if it doesn't exist
+    int err = mkdir(path, 0777);
+    if (err && errno != EEXIST) {
+        err = -errno;
+        goto cleanup;
+    }
+
+    // Map the image, blocks followed by wear counters
+    bd->size = datasize + cfg->block_count*sizeof(uint32_t);
+    snprintf(bd->child, LFS_NAME_MAX, "image");
+    bd->fd = open(bd->path, O_RDWR | O_CREAT, 0666);
+    if (bd->fd < 0) {
+        err = -errno;
+        goto cleanup;
+    }
+
+    // grow the image with a write past its end rather than ftruncate,
+    // which needs feature macros that an earlier include can lock out
+    struct stat st;
+    if (fstat(bd->fd, &st)) {
+        err = -errno;
+        goto cleanup_fd;
+    }
+
+    if ((size_t)st.st_size < bd->size) {
+        if (lseek(bd->fd, bd->size-1, SEEK_SET) < 0 ||
+                write(bd->fd, "", 1) != 1) {
+            err = -errno;
+            goto cleanup_fd;
+        }
+    }
+
+    bd->map = mmap(NULL, bd->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            bd->fd, 0);
+    if (bd->map == MAP_FAILED) {
+        err = -errno;
+        goto cleanup_fd;
+    }
+
+    bd->ramcfg.erase_value = LFS_MMAPBD_ERASE_VALUE;
+    bd->ramcfg.buffer = bd->map;
+    bd->ramcfg.wear = (uint32_t*)((uint8_t*)bd->map + datasize);
+    err = lfs_rambd_createcfg(cfg, &bd->ramcfg);
+    if (err) {
+        goto cleanup_map;
+    }
+
+    // Load stats and history to continue incrementing
+    err = lfs_mmapbd_load(bd, ".stats",
+            &bd->stats, sizeof(bd->stats));
+    if (err) {
+        goto cleanup_map;
+    }
+
+    err = lfs_mmapbd_load(bd, ".history",
+            &bd->history, sizeof(bd->history));
+    if (err) {
+        goto cleanup_map;
+    }
+
+    err = lfs_mmapbd_load(bd, ".time", &bd->time, sizeof(bd->time));
+    if (err) {
+        goto cleanup_map;
+    }
+
+    LFS_TRACE("lfs_mmapbd_create -> %"PRId32, 0);
+    return 0;
+
+cleanup_map:
+    munmap(bd->map, bd->size);
+cleanup_fd:
+    close(bd->fd);
+cleanup:
+    free(bd->path);
+    LFS_TRACE("lfs_mmapbd_create -> %"PRId32, err);
+    return err;
+}
+
+void lfs_mmapbd_destroy(const struct lfs_config *cfg) {
+    LFS_TRACE("lfs_mmapbd_destroy(%p)", (void*)cfg);
+    lfs_mmapbd_t *bd = cfg->context;
+
+    // Write out info/stats for later lookup, same format as emubd
+    const uint32_t config[4] = {
+        lfs_tole32(cfg->read_size),
+        lfs_tole32(cfg->prog_size),
+        lfs_tole32(cfg->block_size),
+        lfs_tole32(cfg->block_count),
+    };
+    lfs_mmapbd_store(bd, ".config", config, sizeof(config));
+    lfs_mmapbd_store(bd, ".stats", &bd->stats, sizeof(bd->stats));
+    lfs_mmapbd_store(bd, ".history",
+            &bd->history, sizeof(bd->history));
+    lfs_mmapbd_store(bd, ".time", &bd->time, sizeof(bd->time));
+
+    lfs_rambd_destroy(cfg);
+    munmap(bd->map, bd->size);
+    close(bd->fd);
+    free(bd->path);
+    LFS_TRACE("lfs_mmapbd_destroy -> %s", "void");
+}
+
+int lfs_mmapbd_read(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size) {
+    return lfs_rambd_read(cfg, block, off, buffer, size);
+}
+
+int lfs_mmapbd_prog(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+    return lfs_rambd_prog(cfg, block, off, buffer, size);
+}
+
+int lfs_mmapbd_erase(const struct lfs_config *cfg, lfs_block_t block) {
+    return lfs_rambd_erase(cfg, block);
+}
+
+int lfs_mmapbd_sync(const struct lfs_config *cfg) {
+    LFS_TRACE("lfs_mmapbd_sync(%p)", (void*)cfg);
+    // the mapping is shared, so the image is already up to date for any
+    // later runs, only a real power loss would need an msync
+    (void)cfg;
+    LFS_TRACE("lfs_mmapbd_sync -> %d", 0);
+    return 0;
+}
+
+uint64_t lfs_mmapbd_clock(const struct lfs_config *cfg) {
+    return lfs_rambd_clock(cfg);
+}
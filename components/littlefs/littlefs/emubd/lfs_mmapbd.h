@@ -0,0 +1,98 @@
+/*
+ * Block device emulated on a single memory-mapped image
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_MMAPBD_H
+#define LFS_MMAPBD_H
+
+#include "lfs.h"
+#include "lfs_util.h"
+#include "emubd/lfs_rambd.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+// Config options
+#ifndef LFS_MMAPBD_ERASE_VALUE
+#define LFS_MMAPBD_ERASE_VALUE -1
+#endif
+
+
+// The mmap bd state, this shares its layout with lfs_rambd_t which does
+// the actual work on the mapped image
+typedef struct lfs_mmapbd {
+    uint8_t *buffer;
+    uint32_t *wear;
+
+    struct {
+        uint64_t read_count;
+        uint64_t prog_count;
+        uint64_t erase_count;
+    } stats;
+
+    struct {
+        lfs_block_t blocks[4];
+    } history;
+
+    struct {
+        uint64_t read_time;
+        uint64_t prog_time;
+        uint64_t erase_time;
+    } time;
+
+    const struct lfs_rambd_config *cfg;
+    const struct lfs_rambd_timing *timing;
+
+    struct lfs_rambd_config ramcfg;
+    char *path;
+    char *child;
+    int fd;
+    void *map;
+    size_t size;
+} lfs_mmapbd_t;
+
+
+// Create a block device using path for the directory to store the image
+//
+// The image holds the blocks followed by their wear counters, and persists
+// across runs like lfs_emubd. Stats and history are written next to it in
+// the same format as lfs_emubd when the block device is destroyed, along
+// with the modeled time, see lfs_rambd_timing.
+int lfs_mmapbd_create(const struct lfs_config *cfg, const char *path);
+
+// Clean up memory associated with mmap block device
+void lfs_mmapbd_destroy(const struct lfs_config *cfg);
+
+// Read a block
+int lfs_mmapbd_read(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size);
+
+// Program a block
+//
+// The block must have previously been erased.
+int lfs_mmapbd_prog(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size);
+
+// Erase a block
+//
+// A block must be erased before being programmed. The
+// state of an erased block is undefined.
+int lfs_mmapbd_erase(const struct lfs_config *cfg, lfs_block_t block);
+
+// Sync the block device
+int lfs_mmapbd_sync(const struct lfs_config *cfg);
+
+// Get the simulated clock, the total modeled time of all operations in ns
+uint64_t lfs_mmapbd_clock(const struct lfs_config *cfg);
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Block device emulated in RAM
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "emubd/lfs_rambd.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+
+
+int lfs_rambd_createcfg(const struct lfs_config *cfg,
+        const struct lfs_rambd_config *bdcfg) {
+    LFS_TRACE("lfs_rambd_createcfg(%p {.context=%p, "
+                ".read=%p, .prog=%p, .erase=%p, .sync=%p, "
+                ".read_size=%"PRIu32", .prog_size=%"PRIu32", "
+                ".block_size=%"PRIu32", .block_count=%"PRIu32"}, "
+                "%p {.erase_value=%"PRId32", .buffer=%p, .wear=%p})",
+            (void*)cfg, cfg->context,
+            (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
+            (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
+            cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
+            (void*)bdcfg, bdcfg->erase_value, bdcfg->buffer,
+            (void*)bdcfg->wear);
+    lfs_rambd_t *bd = cfg->context;
+    bd->cfg = bdcfg;
+
+    static const struct lfs_rambd_timing timing = {
+        .read_setup_ns     = LFS_RAMBD_READ_SETUP_NS,
+        .read_byte_ns      = LFS_RAMBD_READ_BYTE_NS,
+        .prog_page_size    = LFS_RAMBD_PROG_PAGE_SIZE,
+        .prog_page_ns      = LFS_RAMBD_PROG_PAGE_NS,
+        .erase_sector_size = LFS_RAMBD_ERASE_SECTOR_SIZE,
+        .erase_sector_ns   = LFS_RAMBD_ERASE_SECTOR_NS,
+    };
+    bd->timing = bd->cfg->timing ? bd->cfg->timing : &timing;
+
+    // allocate buffers?
+    if (bd->cfg->buffer) {
+        bd->buffer = bd->cfg->buffer;
+    } else {
+        bd->buffer = malloc(cfg->block_size * cfg->block_count);
+        if (!bd->buffer) {
+            int err = -ENOMEM;
+            LFS_TRACE("lfs_rambd_createcfg -> %"PRId32, err);
+            return err;
+        }
+    }
+
+    if (bd->cfg->wear) {
+        bd->wear = bd->cfg->wear;
+    } else {
+        bd->wear = calloc(cfg->block_count, sizeof(uint32_t));
+        if (!bd->wear) {
+            if (!bd->cfg->buffer) {
+                free(bd->buffer);
+            }
+            int err = -ENOMEM;
+            LFS_TRACE("lfs_rambd_createcfg -> %"PRId32, err);
+            return err;
+        }
+    }
+
+    // zero for reproducability, unless we're given existing storage
+    if (!bd->cfg->buffer) {
+        memset(bd->buffer, (bd->cfg->erase_value != -1)
+                ? bd->cfg->erase_value : 0,
+                cfg->block_size * cfg->block_count);
+    }
+
+    memset(&bd->stats, 0, sizeof(bd->stats));
+    memset(&bd->history, 0, sizeof(bd->history));
+    memset(&bd->time, 0, sizeof(bd->time));
+
+    LFS_TRACE("lfs_rambd_createcfg -> %"PRId32, 0);
+    return 0;
+}
+
+int lfs_rambd_create(const struct lfs_config *cfg) {
+    LFS_TRACE("lfs_rambd_create(%p {.context=%p, "
+                ".read=%p, .prog=%p, .erase=%p, .sync=%p, "
+                ".read_size=%"PRIu32", .prog_size=%"PRIu32", "
+                ".block_size=%"PRIu32", .block_count=%"PRIu32"})",
+            (void*)cfg, cfg->context,
+            (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
+            (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
+            cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count);
+    static const struct lfs_rambd_config defaults = {
+        .erase_value = LFS_RAMBD_ERASE_VALUE,
+    };
+    int err = lfs_rambd_createcfg(cfg, &defaults);
+    LFS_TRACE("lfs_rambd_create -> %"PRId32, err);
+    return err;
+}
+
+void lfs_rambd_destroy(const struct lfs_config *cfg) {
+    LFS_TRACE("lfs_rambd_destroy(%p)", (void*)cfg);
+    // clean up memory
+    lfs_rambd_t *bd = cfg->context;
+    if (!bd->cfg->buffer) {
+        free(bd->buffer);
+    }
+
+    if (!bd->cfg->wear) {
+        free(bd->wear);
+    }
+    LFS_TRACE("lfs_rambd_destroy -> %s", "void");
+}
+
+int lfs_rambd_read(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size) {
+    LFS_TRACE("lfs_rambd_read(%p, 0x%"PRIx32", %"PRIu32", %p, %"PRIu32")",
+            (void*)cfg, block, off, buffer, size);
+    lfs_rambd_t *bd = cfg->context;
+
+    // check if read is valid
+    assert(off  % cfg->read_size == 0);
+    assert(size % cfg->read_size == 0);
+    assert(block < cfg->block_count);
+
+    // read data
+    memcpy(buffer, &bd->buffer[block*cfg->block_size + off], size);
+
+    bd->stats.read_count += size;
+    bd->time.read_time += bd->timing->read_setup_ns
+            + (uint64_t)size*bd->timing->read_byte_ns;
+    LFS_TRACE("lfs_rambd_read -> %d", 0);
+    return 0;
+}
+
+int lfs_rambd_prog(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+    LFS_TRACE("lfs_rambd_prog(%p, 0x%"PRIx32", %"PRIu32", %p, %"PRIu32")",
+            (void*)cfg, block, off, buffer, size);
+    lfs_rambd_t *bd = cfg->context;
+
+    // check if write is valid
+    assert(off  % cfg->prog_size == 0);
+    assert(size % cfg->prog_size == 0);
+    assert(block < cfg->block_count);
+
+    // check that data was erased? only needed for testing
+    if (bd->cfg->erase_value != -1) {
+        for (lfs_off_t i = 0; i < size; i++) {
+            assert(bd->buffer[block*cfg->block_size + off + i] ==
+                    bd->cfg->erase_value);
+        }
+    }
+
+    // program data
+    memcpy(&bd->buffer[block*cfg->block_size + off], buffer, size);
+
+    // update history and stats
+    if (block != bd->history.blocks[0]) {
+        memmove(&bd->history.blocks[1], &bd->history.blocks[0],
+                sizeof(bd->history) - sizeof(bd->history.blocks[0]));
+        bd->history.blocks[0] = block;
+    }
+
+    bd->stats.prog_count += size;
+    lfs_size_t page = bd->timing->prog_page_size;
+    bd->time.prog_time += (uint64_t)bd->timing->prog_page_ns
+            * ((off+size + page-1)/page - off/page);
+    LFS_TRACE("lfs_rambd_prog -> %d", 0);
+    return 0;
+}
+
+int lfs_rambd_erase(const struct lfs_config *cfg, lfs_block_t block) {
+    LFS_TRACE("lfs_rambd_erase(%p, 0x%"PRIx32")", (void*)cfg, block);
+    lfs_rambd_t *bd = cfg->context;
+
+    // check if erase is valid
+    assert(block < cfg->block_count);
+
+    // erase, only needed for testing
+    if (bd->cfg->erase_value != -1) {
+        memset(&bd->buffer[block*cfg->block_size],
+                bd->cfg->erase_value, cfg->block_size);
+    }
+
+    bd->wear[block] += 1;
+    bd->stats.erase_count += cfg->block_size;
+    lfs_size_t sector = bd->timing->erase_sector_size;
+    bd->time.erase_time += (uint64_t)bd->timing->erase_sector_ns
+            * ((cfg->block_size + sector-1)/sector);
+    LFS_TRACE("lfs_rambd_erase -> %d", 0);
+    return 0;
+}
+
+int lfs_rambd_sync(const struct lfs_config *cfg) {
+    LFS_TRACE("lfs_rambd_sync(%p)", (void*)cfg);
+    // sync does nothing because we aren't backed by anything real
+    (void)cfg;
+    LFS_TRACE("lfs_rambd_sync -> %d", 0);
+    return 0;
+}
+
+uint64_t lfs_rambd_clock(const struct lfs_config *cfg) {
+    const lfs_rambd_t *bd = cfg->context;
+    return bd->time.read_time + bd->time.prog_time + bd->time.erase_time;
+}
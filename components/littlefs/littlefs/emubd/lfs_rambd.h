@@ -0,0 +1,153 @@
+/*
+ * Block device emulated in RAM
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_RAMBD_H
+#define LFS_RAMBD_H
+
+#include "lfs.h"
+#include "lfs_util.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+// Config options
+#ifndef LFS_RAMBD_ERASE_VALUE
+#define LFS_RAMBD_ERASE_VALUE 0xff
+#endif
+
+// Default timing profile, roughly an ESP32 SPI NOR flash in DIO mode at
+// 40MHz with typical W25Q-series page program and sector erase times
+#ifndef LFS_RAMBD_READ_SETUP_NS
+#define LFS_RAMBD_READ_SETUP_NS 2000
+#endif
+
+#ifndef LFS_RAMBD_READ_BYTE_NS
+#define LFS_RAMBD_READ_BYTE_NS 100
+#endif
+
+#ifndef LFS_RAMBD_PROG_PAGE_SIZE
+#define LFS_RAMBD_PROG_PAGE_SIZE 256
+#endif
+
+#ifndef LFS_RAMBD_PROG_PAGE_NS
+#define LFS_RAMBD_PROG_PAGE_NS 700000
+#endif
+
+#ifndef LFS_RAMBD_ERASE_SECTOR_SIZE
+#define LFS_RAMBD_ERASE_SECTOR_SIZE 4096
+#endif
+
+#ifndef LFS_RAMBD_ERASE_SECTOR_NS
+#define LFS_RAMBD_ERASE_SECTOR_NS 45000000
+#endif
+
+
+// Timing profile used to model how long operations take on real flash
+struct lfs_rambd_timing {
+    // Fixed cost of each read in ns, plus cost per byte read in ns
+    uint32_t read_setup_ns;
+    uint32_t read_byte_ns;
+
+    // Cost of programming each page touched by a prog in ns
+    uint32_t prog_page_size;
+    uint32_t prog_page_ns;
+
+    // Cost of erasing each sector of a block in ns
+    uint32_t erase_sector_size;
+    uint32_t erase_sector_ns;
+};
+
+
+// Optional configuration for the ram bd
+struct lfs_rambd_config {
+    // 8-bit erase value to simulate erasing with. -1 indicates no erase
+    // occurs, which is still a valid block device, and the cheapest.
+    int32_t erase_value;
+
+    // Optional statically allocated buffer of block_size*block_count bytes
+    // for the block data. By default one is allocated with malloc.
+    void *buffer;
+
+    // Optional statically allocated buffer of block_count wear counters.
+    // By default one is allocated with malloc.
+    uint32_t *wear;
+
+    // Optional timing profile, defaults to the LFS_RAMBD_*_NS options
+    const struct lfs_rambd_timing *timing;
+};
+
+// The ram bd state
+typedef struct lfs_rambd {
+    uint8_t *buffer;
+    uint32_t *wear;
+
+    struct {
+        uint64_t read_count;
+        uint64_t prog_count;
+        uint64_t erase_count;
+    } stats;
+
+    struct {
+        lfs_block_t blocks[4];
+    } history;
+
+    // modeled time spent in each operation, in ns
+    struct {
+        uint64_t read_time;
+        uint64_t prog_time;
+        uint64_t erase_time;
+    } time;
+
+    const struct lfs_rambd_config *cfg;
+    const struct lfs_rambd_timing *timing;
+} lfs_rambd_t;
+
+
+// Create a RAM block device using the default configuration
+int lfs_rambd_create(const struct lfs_config *cfg);
+
+// Create a RAM block device using the given configuration, which must
+// outlive the block device
+int lfs_rambd_createcfg(const struct lfs_config *cfg,
+        const struct lfs_rambd_config *bdcfg);
+
+// Clean up memory associated with the RAM block device
+void lfs_rambd_destroy(const struct lfs_config *cfg);
+
+// Read a block
+int lfs_rambd_read(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size);
+
+// Program a block
+//
+// The block must have previously been erased.
+int lfs_rambd_prog(const struct lfs_config *cfg, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size);
+
+// Erase a block
+//
+// A block must be erased before being programmed. The
+// state of an erased block is undefined.
+int lfs_rambd_erase(const struct lfs_config *cfg, lfs_block_t block);
+
+// Sync the block device
+int lfs_rambd_sync(const struct lfs_config *cfg);
+
+// Get the simulated clock, the total modeled time of all operations in ns
+//
+// Sampling this before and after an operation gives the time the operation
+// would take on the modeled flash.
+uint64_t lfs_rambd_clock(const struct lfs_config *cfg);
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
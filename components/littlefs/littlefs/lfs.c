@@ -6,10 +6,42 @@
  */
 #include "lfs.h"
 #include "lfs_util.h"
+#include "lfs_trace.h"
 
 #define LFS_BLOCK_NULL ((lfs_block_t)-1)
 #define LFS_BLOCK_INLINE ((lfs_block_t)-2)
 
+// oldest on-disk version whose superblock carries feature flags, and the
+// optional features this driver understands
+#define LFS_DISK_VERSION_FEATURES 0x00020001
+#define LFS_FEATURES (LFS_FEATURE_NAMEHASH | LFS_FEATURE_INDEXED \
+        | LFS_FEATURE_CHECKPOINT)
+
+// size of the stack buffer used to copy the rest of a file after a write in
+// the middle of it, larger copies faster but costs stack
+#ifndef LFS_COPY_SIZE
+#define LFS_COPY_SIZE 64
+#endif
+
+// statistics, these compile to nothing without LFS_YES_STATS
+#ifdef LFS_YES_STATS
+#define LFS_STATS_ADD(lfs, field, n) ((lfs)->stats.field += (n))
+#define LFS_STATS_CLOCK(t) uint64_t t = lfs_stats_clock()
+#define LFS_STATS_TIME(lfs, field, t) \
+    ((lfs)->stats.field += lfs_stats_clock() - (t))
+#else
+#define LFS_STATS_ADD(lfs, field, n) ((void)(lfs))
+#define LFS_STATS_CLOCK(t) ((void)0)
+#define LFS_STATS_TIME(lfs, field, t) ((void)(lfs))
+#endif
+
+// trace an API call returning, both as text and as a binary event
+#define LFS_TRACE_EXIT(lfs, id, fmt, ret) \
+    do { \
+        LFS_TRACE(fmt, ret); \
+        LFS_TRACE_EVENT(lfs, (id) | LFS_TRACE_RET, (uint32_t)(ret), 0, 0); \
+    } while (0)
+
 /// Caching block device operations ///
 static inline void lfs_cache_drop(lfs_t *lfs, lfs_cache_t *rcache) {
     // do not zero, cheaper if cache is readonly or only going to be
@@ -24,6 +56,24 @@ static inline void lfs_cache_zero(lfs_t *lfs, lfs_cache_t *pcache) {
     pcache->block = LFS_BLOCK_NULL;
 }
 
+static int lfs_bd_fill(lfs_t *lfs, lfs_cache_t *rcache,
+        lfs_block_t block, lfs_off_t off, lfs_size_t size) {
+    rcache->block = block;
+    rcache->off = off;
+    rcache->size = size;
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_BD_READ,
+            rcache->block, rcache->off, rcache->size);
+    LFS_STATS_CLOCK(t);
+    int err = lfs->cfg->read(lfs->cfg, rcache->block,
+            rcache->off, rcache->buffer, rcache->size);
+    LFS_ASSERT(err <= 0);
+    LFS_STATS_TIME(lfs, read_time, t);
+    LFS_STATS_ADD(lfs, rcache_misses, 1);
+    LFS_STATS_ADD(lfs, read_count, 1);
+    LFS_STATS_ADD(lfs, read_bytes, rcache->size);
+    return err;
+}
+
 static int lfs_bd_read(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
         lfs_block_t block, lfs_off_t off,
@@ -43,6 +93,7 @@ static int lfs_bd_read(lfs_t *lfs,
                 // is already in pcache?
                 diff = lfs_min(diff, pcache->size - (off-pcache->off));
                 memcpy(data, &pcache->buffer[off-pcache->off], diff);
+                LFS_STATS_ADD(lfs, pcache_hits, 1);
 
                 data += diff;
                 off += diff;
@@ -60,6 +111,7 @@ static int lfs_bd_read(lfs_t *lfs,
                 // is already in rcache?
                 diff = lfs_min(diff, rcache->size - (off-rcache->off));
                 memcpy(data, &rcache->buffer[off-rcache->off], diff);
+                LFS_STATS_ADD(lfs, rcache_hits, 1);
 
                 data += diff;
                 off += diff;
@@ -73,17 +125,14 @@ static int lfs_bd_read(lfs_t *lfs,
 
         // load to cache, first condition can no longer fail
         LFS_ASSERT(block < lfs->cfg->block_count);
-        rcache->block = block;
-        rcache->off = lfs_aligndown(off, lfs->cfg->read_size);
-        rcache->size = lfs_min(
+        lfs_off_t start = lfs_aligndown(off, lfs->cfg->read_size);
+        int err = lfs_bd_fill(lfs, rcache, block, start,
                 lfs_min(
-                    lfs_alignup(off+hint, lfs->cfg->read_size),
-                    lfs->cfg->block_size)
-                - rcache->off,
-                lfs->cfg->cache_size);
-        int err = lfs->cfg->read(lfs->cfg, rcache->block,
-                rcache->off, rcache->buffer, rcache->size);
-        LFS_ASSERT(err <= 0);
+                    lfs_min(
+                        lfs_alignup(off+hint, lfs->cfg->read_size),
+                        lfs->cfg->block_size)
+                    - start,
+                    lfs->cfg->cache_size));
         if (err) {
             return err;
         }
@@ -92,6 +141,58 @@ static int lfs_bd_read(lfs_t *lfs,
     return 0;
 }
 
+static int lfs_bd_readback(lfs_t *lfs,
+        lfs_cache_t *rcache, lfs_size_t hint,
+        lfs_block_t block, lfs_off_t off,
+        void *buffer, lfs_size_t size) {
+    // when walking a block backwards, load the cache with the window that
+    // ends with what we read, reaching back up to hint bytes before it,
+    // so the next steps back are hits
+    if (off+size <= lfs->cfg->block_size &&
+            !(block == rcache->block &&
+                off >= rcache->off &&
+                off+size <= rcache->off + rcache->size)) {
+        LFS_ASSERT(block < lfs->cfg->block_count);
+        lfs_off_t end = lfs_min(
+                lfs_alignup(off+size, lfs->cfg->read_size),
+                lfs->cfg->block_size);
+        lfs_off_t start = lfs_aligndown(off - lfs_min(hint, off),
+                lfs->cfg->read_size);
+        if (end - start > lfs->cfg->cache_size) {
+            start = end - lfs->cfg->cache_size;
+        }
+
+        int err = lfs_bd_fill(lfs, rcache, block, start, end - start);
+        if (err) {
+            return err;
+        }
+    }
+
+    return lfs_bd_read(lfs, NULL, rcache, size, block, off, buffer, size);
+}
+
+static int lfs_bd_readlinear(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off,
+        void *buffer, lfs_size_t size) {
+    // read straight into the buffer, the data must already be on disk
+    LFS_ASSERT(lfs->cfg->linear_reads);
+    LFS_ASSERT(off % lfs->cfg->read_size == 0);
+    LFS_ASSERT(size % lfs->cfg->read_size == 0);
+    if (block + (off+size-1) / lfs->cfg->block_size
+            >= lfs->cfg->block_count) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_BD_READ, block, off, size);
+    LFS_STATS_CLOCK(t);
+    int err = lfs->cfg->read(lfs->cfg, block, off, buffer, size);
+    LFS_ASSERT(err <= 0);
+    LFS_STATS_TIME(lfs, read_time, t);
+    LFS_STATS_ADD(lfs, read_count, 1);
+    LFS_STATS_ADD(lfs, read_bytes, size);
+    return err;
+}
+
 enum {
     LFS_CMP_EQ = 0,
     LFS_CMP_LT = 1,
@@ -126,9 +227,15 @@ static int lfs_bd_flush(lfs_t *lfs,
     if (pcache->block != LFS_BLOCK_NULL && pcache->block != LFS_BLOCK_INLINE) {
         LFS_ASSERT(pcache->block < lfs->cfg->block_count);
         lfs_size_t diff = lfs_alignup(pcache->size, lfs->cfg->prog_size);
+        LFS_TRACE_EVENT(lfs, LFS_TRACE_BD_PROG,
+                pcache->block, pcache->off, diff);
+        LFS_STATS_CLOCK(t);
         int err = lfs->cfg->prog(lfs->cfg, pcache->block,
                 pcache->off, pcache->buffer, diff);
         LFS_ASSERT(err <= 0);
+        LFS_STATS_TIME(lfs, prog_time, t);
+        LFS_STATS_ADD(lfs, prog_count, 1);
+        LFS_STATS_ADD(lfs, prog_bytes, diff);
         if (err) {
             return err;
         }
@@ -163,6 +270,7 @@ static int lfs_bd_sync(lfs_t *lfs,
         return err;
     }
 
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_BD_SYNC, 0, 0, 0);
     err = lfs->cfg->sync(lfs->cfg);
     LFS_ASSERT(err <= 0);
     return err;
@@ -184,6 +292,7 @@ static int lfs_bd_prog(lfs_t *lfs,
             lfs_size_t diff = lfs_min(size,
                     lfs->cfg->cache_size - (off-pcache->off));
             memcpy(&pcache->buffer[off-pcache->off], data, diff);
+            LFS_STATS_ADD(lfs, pcache_hits, 1);
 
             data += diff;
             off += diff;
@@ -209,6 +318,7 @@ static int lfs_bd_prog(lfs_t *lfs,
         pcache->block = block;
         pcache->off = lfs_aligndown(off, lfs->cfg->prog_size);
         pcache->size = 0;
+        LFS_STATS_ADD(lfs, pcache_misses, 1);
     }
 
     return 0;
@@ -216,8 +326,18 @@ static int lfs_bd_prog(lfs_t *lfs,
 
 static int lfs_bd_erase(lfs_t *lfs, lfs_block_t block) {
     LFS_ASSERT(block < lfs->cfg->block_count);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_BD_ERASE, block, 0, 0);
+    if (block == lfs->tindex.block) {
+        // the tag index only describes what was in the block
+        lfs->tindex.block = LFS_BLOCK_NULL;
+    }
+
+    LFS_STATS_CLOCK(t);
     int err = lfs->cfg->erase(lfs->cfg, block);
     LFS_ASSERT(err <= 0);
+    LFS_STATS_TIME(lfs, erase_time, t);
+    LFS_STATS_ADD(lfs, erase_count, 1);
+    LFS_STATS_ADD(lfs, erase_bytes, lfs->cfg->block_size);
     return err;
 }
 
@@ -316,6 +436,45 @@ struct lfs_diskoff {
     (struct lfs_mattr[]){__VA_ARGS__}, \
     sizeof((struct lfs_mattr[]){__VA_ARGS__}) / sizeof(struct lfs_mattr)
 
+// metadata updates held back by a batch, these live on the mlist so
+// commits keep their ids and pairs up to date like any open file
+#define LFS_TYPE_PENDING 0xff
+
+// a metadata pair that relocation is about to commit to, tracked so
+// commits keep it up to date, but it has no id to fix up
+#define LFS_TYPE_PRED 0xfe
+
+struct lfs_mpending {
+    struct lfs_mpending *next;
+    uint16_t id;
+    uint8_t type;
+    lfs_mdir_t m;
+
+    uint16_t stype;
+    lfs_size_t size;
+    uint8_t buffer[];
+};
+
+static inline lfs_tag_t lfs_mpending_tag(const struct lfs_mpending *p) {
+    return LFS_MKTAG(p->stype, p->id, p->size);
+}
+
+static struct lfs_mpending *lfs_mpending_find(lfs_t *lfs,
+        const lfs_block_t pair[2], uint16_t id) {
+    if (lfs->batch.count == 0) {
+        return NULL;
+    }
+
+    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
+        if (d->type == LFS_TYPE_PENDING && d->id == id &&
+                lfs_pair_cmp(d->m.pair, pair) == 0) {
+            return (struct lfs_mpending*)d;
+        }
+    }
+
+    return NULL;
+}
+
 // operations on global state
 static inline void lfs_gstate_xor(struct lfs_gstate *a,
         const struct lfs_gstate *b) {
@@ -393,6 +552,7 @@ static inline void lfs_superblock_fromle32(lfs_superblock_t *superblock) {
     superblock->name_max    = lfs_fromle32(superblock->name_max);
     superblock->file_max    = lfs_fromle32(superblock->file_max);
     superblock->attr_max    = lfs_fromle32(superblock->attr_max);
+    superblock->features    = lfs_fromle32(superblock->features);
 }
 
 static inline void lfs_superblock_tole32(lfs_superblock_t *superblock) {
@@ -402,6 +562,42 @@ static inline void lfs_superblock_tole32(lfs_superblock_t *superblock) {
     superblock->name_max    = lfs_tole32(superblock->name_max);
     superblock->file_max    = lfs_tole32(superblock->file_max);
     superblock->attr_max    = lfs_tole32(superblock->attr_max);
+    superblock->features    = lfs_tole32(superblock->features);
+}
+
+static inline lfs_size_t lfs_superblock_size(lfs_t *lfs) {
+    // without optional features the superblock keeps its 2.0 layout, so
+    // older drivers can still mount it
+    return lfs->features
+            ? sizeof(lfs_superblock_t)
+            : sizeof(lfs_superblock_t) - sizeof(uint32_t);
+}
+
+// name hash operations
+static inline bool lfs_namehash_isenabled(lfs_t *lfs) {
+    return lfs->features & LFS_FEATURE_NAMEHASH;
+}
+
+static inline uint32_t lfs_namehash(const void *name, lfs_size_t size) {
+    return lfs_crc(0xffffffff, name, size);
+}
+
+// indexed file operations
+static inline bool lfs_idx_isenabled(lfs_t *lfs) {
+    return lfs->features & LFS_FEATURE_INDEXED;
+}
+
+// mount checkpoint operations, the checkpoint holds the global state as
+// found on disk and is only current while no commit could have changed it
+enum {
+    LFS_CHECKPOINT_OFF   = 0, // not written by this filesystem
+    LFS_CHECKPOINT_VALID = 1, // on disk and current
+    LFS_CHECKPOINT_DIRTY = 2, // dropped, changed since the last gc
+    LFS_CHECKPOINT_IDLE  = 3, // dropped, unchanged since the last gc
+};
+
+static inline bool lfs_checkpoint_isenabled(lfs_t *lfs) {
+    return lfs->features & LFS_FEATURE_CHECKPOINT;
 }
 
 
@@ -419,10 +615,12 @@ static void lfs_fs_prepmove(lfs_t *lfs,
 static int lfs_fs_pred(lfs_t *lfs, const lfs_block_t dir[2],
         lfs_mdir_t *pdir);
 static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t dir[2],
-        lfs_mdir_t *parent);
+        lfs_mdir_t *parent, lfs_mdir_t *pred);
 static int lfs_fs_relocate(lfs_t *lfs,
         const lfs_block_t oldpair[2], lfs_block_t newpair[2]);
 static int lfs_fs_forceconsistency(lfs_t *lfs);
+static int lfs_fs_uncheckpoint(lfs_t *lfs);
+static int lfs_fs_checkpoint(lfs_t *lfs);
 static int lfs_deinit(lfs_t *lfs);
 #ifdef LFS_MIGRATE
 static int lfs1_traverse(lfs_t *lfs,
@@ -442,6 +640,22 @@ static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
     return 0;
 }
 
+static int lfs_alloc_scan(lfs_t *lfs) {
+    lfs->free.off = (lfs->free.off + lfs->free.size)
+            % lfs->cfg->block_count;
+    lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size, lfs->free.ack);
+    lfs->free.i = 0;
+
+    // find mask of free blocks from tree
+    memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_ALLOC_SCAN, lfs->free.off, 0, 0);
+    LFS_STATS_CLOCK(t);
+    int err = lfs_fs_traverse(lfs, lfs_alloc_lookahead, lfs);
+    LFS_STATS_TIME(lfs, alloc_time, t);
+    LFS_STATS_ADD(lfs, alloc_scans, 1);
+    return err;
+}
+
 static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
     while (true) {
         while (lfs->free.i != lfs->free.size) {
@@ -473,14 +687,7 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
             return LFS_ERR_NOSPC;
         }
 
-        lfs->free.off = (lfs->free.off + lfs->free.size)
-                % lfs->cfg->block_count;
-        lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size, lfs->free.ack);
-        lfs->free.i = 0;
-
-        // find mask of free blocks from tree
-        memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
-        int err = lfs_fs_traverse(lfs, lfs_alloc_lookahead, lfs);
+        int err = lfs_alloc_scan(lfs);
         if (err) {
             return err;
         }
@@ -491,6 +698,191 @@ static void lfs_alloc_ack(lfs_t *lfs) {
     lfs->free.ack = lfs->cfg->block_count;
 }
 
+static int lfs_alloc_run(lfs_t *lfs, lfs_size_t count,
+        lfs_block_t *block, lfs_size_t *size) {
+    // take the first run of count free blocks, or the longest run there is
+    // if we get all the way around without finding one, this only runs
+    // between operations where no blocks are in flight, so we can ack
+    lfs_alloc_ack(lfs);
+    lfs_block_t start = 0;
+    lfs_size_t len = 0;
+    *size = 0;
+    while (*size < count) {
+        if (lfs->free.i == lfs->free.size) {
+            if (lfs->free.ack == 0) {
+                break;
+            }
+
+            int err = lfs_alloc_scan(lfs);
+            if (err) {
+                return err;
+            }
+            continue;
+        }
+
+        lfs_block_t off = lfs->free.i;
+        lfs_block_t nblock = (lfs->free.off + off) % lfs->cfg->block_count;
+        lfs->free.i += 1;
+        lfs->free.ack -= 1;
+
+        // runs can't wrap around the end of the device
+        if (nblock == 0 ||
+                (lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
+            len = 0;
+            continue;
+        }
+
+        if (len == 0) {
+            start = nblock;
+        }
+
+        len += 1;
+        if (len > *size) {
+            *block = start;
+            *size = len;
+        }
+    }
+
+    // the run may still be ahead of us in the lookahead buffer
+    for (lfs_size_t i = 0; i < *size; i++) {
+        lfs_alloc_lookahead(lfs, *block + i);
+    }
+
+    lfs_alloc_ack(lfs);
+    return 0;
+}
+
+static int lfs_alloc_last(lfs_t *lfs, lfs_block_t *block) {
+    // take the last free block in the lookahead buffer, leaving the blocks
+    // right after the scan for files to grow into
+    for (lfs_block_t off = lfs->free.size; off > lfs->free.i; off--) {
+        if (!(lfs->free.buffer[(off-1) / 32] & (1U << ((off-1) % 32)))) {
+            // mark it so the scan skips it
+            lfs->free.buffer[(off-1) / 32] |= 1U << ((off-1) % 32);
+            *block = (lfs->free.off + off-1) % lfs->cfg->block_count;
+            return 0;
+        }
+    }
+
+    return lfs_alloc(lfs, block);
+}
+
+static int lfs_alloc_file(lfs_t *lfs, struct lfs_reserve *reserve,
+        lfs_block_t prev, lfs_block_t *block) {
+    if (reserve->count > 0) {
+        // take the next block of the reservation
+        *block = reserve->block;
+        reserve->block += 1;
+        reserve->count -= 1;
+        return 0;
+    }
+
+    // prefer the block after the file's previous block, so the file stays
+    // contiguous and can be read in runs, but only if the lookahead buffer
+    // knows it is free and the scan hasn't passed it
+    if (prev != LFS_BLOCK_NULL && prev+1 < lfs->cfg->block_count) {
+        lfs_block_t off = ((prev+1 - lfs->free.off)
+                + lfs->cfg->block_count) % lfs->cfg->block_count;
+        if (off >= lfs->free.i && off < lfs->free.size &&
+                !(lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
+            // mark it so the scan skips it
+            lfs->free.buffer[off / 32] |= 1U << (off % 32);
+            *block = prev+1;
+            return 0;
+        }
+    }
+
+    return lfs_alloc(lfs, block);
+}
+
+
+/// Metadata tag index ///
+static inline struct lfs_tentry *lfs_tindex_entry(lfs_t *lfs,
+        uint16_t id, lfs_tag_t tag) {
+    return &lfs->tindex.entries[
+            2*id + (lfs_tag_type1(tag) == LFS_TYPE_STRUCT)];
+}
+
+static bool lfs_tindex_reset(lfs_t *lfs) {
+    lfs->tindex.block = LFS_BLOCK_NULL;
+    lfs->tindex.count = lfs->tindex.size;
+    if (!lfs->tindex.size) {
+        return false;
+    }
+
+    memset(lfs->tindex.entries, 0,
+            2*lfs->tindex.size*sizeof(struct lfs_tentry));
+    return true;
+}
+
+static void lfs_tindex_append(lfs_t *lfs,
+        lfs_tag_t tag, lfs_off_t off, uint16_t count) {
+    // only the first tindex.count ids are indexed, pairs with more ids
+    // than fit, or deletes that pull unindexed ids down, leave the rest
+    // to the log
+    struct lfs_tindex *tindex = &lfs->tindex;
+    uint16_t id = lfs_tag_id(tag);
+    if (id >= tindex->count) {
+        return;
+    }
+
+    if (lfs_tag_type1(tag) == LFS_TYPE_NAME ||
+            lfs_tag_type1(tag) == LFS_TYPE_STRUCT) {
+        // newer tags replace older ones of the same kind
+        *lfs_tindex_entry(lfs, id, tag) = (struct lfs_tentry){tag, off};
+    } else if (lfs_tag_type1(tag) == LFS_TYPE_SPLICE) {
+        if (lfs_tag_splice(tag) > 0) {
+            // make room for the created id, tags before the create
+            // belong to the ids after it
+            memmove(&tindex->entries[2*(id+1)], &tindex->entries[2*id],
+                    2*(tindex->count-1 - id)*sizeof(struct lfs_tentry));
+            memset(&tindex->entries[2*id], 0, 2*sizeof(struct lfs_tentry));
+        } else {
+            // forget the deleted id
+            memmove(&tindex->entries[2*id], &tindex->entries[2*(id+1)],
+                    2*(tindex->count-1 - id)*sizeof(struct lfs_tentry));
+            if (count > tindex->count) {
+                tindex->count -= 1;
+            } else {
+                memset(&tindex->entries[2*(tindex->count-1)], 0,
+                        2*sizeof(struct lfs_tentry));
+            }
+        }
+    }
+}
+
+static lfs_stag_t lfs_tindex_get(lfs_t *lfs, const lfs_mdir_t *dir,
+        lfs_tag_t gmask, lfs_tag_t gtag, lfs_off_t *off) {
+    // only lookups of one id's name or struct in the indexed state of
+    // the dir can be answered, LFS_ERR_INVAL means search the log
+    if (lfs->tindex.block != dir->pair[0] ||
+            lfs->tindex.off != dir->off ||
+            (gmask & LFS_MKTAG(0x700, 0x3ff, 0x3ff))
+                != LFS_MKTAG(0x700, 0x3ff, 0) ||
+            (lfs_tag_type1(gtag) != LFS_TYPE_NAME &&
+                lfs_tag_type1(gtag) != LFS_TYPE_STRUCT) ||
+            lfs_tag_id(gtag) >= lfs->tindex.count) {
+        return LFS_ERR_INVAL;
+    }
+
+    const struct lfs_tentry *entry = lfs_tindex_entry(lfs,
+            lfs_tag_id(gtag), gtag);
+    if (!entry->off) {
+        // nothing of this kind since the id was created
+        return LFS_ERR_NOENT;
+    }
+
+    lfs_tag_t tag = (entry->tag & ~LFS_MKTAG(0, 0x3ff, 0)) |
+            (gtag & LFS_MKTAG(0, 0x3ff, 0));
+    if ((gmask & tag) != (gmask & gtag)) {
+        // an older tag of the same kind may still match
+        return LFS_ERR_INVAL;
+    }
+
+    *off = entry->off;
+    return tag;
+}
+
 
 /// Metadata pair and directory operations ///
 static lfs_stag_t lfs_dir_getslice(lfs_t *lfs, const lfs_mdir_t *dir,
@@ -500,18 +892,54 @@ static lfs_stag_t lfs_dir_getslice(lfs_t *lfs, const lfs_mdir_t *dir,
     lfs_tag_t ntag = dir->etag;
     lfs_stag_t gdiff = 0;
 
+    // held back updates are newer than anything on disk
+    const struct lfs_mpending *p = lfs_mpending_find(lfs,
+            dir->pair, lfs_tag_id(gtag));
+    if (p && (gmask & lfs_mpending_tag(p)) == (gmask & gtag)) {
+        lfs_size_t diff = (goff < p->size)
+                ? lfs_min(p->size - goff, gsize) : 0;
+        if (diff) {
+            memcpy(gbuffer, &p->buffer[goff], diff);
+        }
+        memset((uint8_t*)gbuffer + diff, 0, gsize - diff);
+        return lfs_mpending_tag(p);
+    }
+
     if (lfs_gstate_hasmovehere(&lfs->gstate, dir->pair) &&
             lfs_tag_id(gtag) <= lfs_tag_id(lfs->gstate.tag)) {
         // synthetic moves
         gdiff -= LFS_MKTAG(0, 1, 0);
     }
 
+    // the tag index from fetching the dir can point us straight at the tag
+    lfs_off_t ioff;
+    lfs_stag_t itag = lfs_tindex_get(lfs, dir, gmask, gtag - gdiff, &ioff);
+    if (itag != LFS_ERR_INVAL) {
+        if (itag < 0 || lfs_tag_isdelete(itag)) {
+            return LFS_ERR_NOENT;
+        }
+
+        lfs_size_t diff = lfs_min(lfs_tag_size(itag), gsize);
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, diff,
+                dir->pair[0], ioff+sizeof(lfs_tag_t)+goff, gbuffer, diff);
+        if (err) {
+            return err;
+        }
+
+        memset((uint8_t*)gbuffer + diff, 0, gsize - diff);
+
+        return itag + gdiff;
+    }
+
     // iterate over dir block backwards (for faster lookups)
     while (off >= sizeof(lfs_tag_t) + lfs_tag_dsize(ntag)) {
         off -= lfs_tag_dsize(ntag);
         lfs_tag_t tag = ntag;
-        int err = lfs_bd_read(lfs,
-                NULL, &lfs->rcache, sizeof(ntag),
+        // the further back we've come the further back we're likely to
+        // go, so load twice that, a lookup that ends early stays cheap
+        int err = lfs_bd_readback(lfs,
+                &lfs->rcache, 2*(dir->off - off),
                 dir->pair[0], off, &ntag, sizeof(ntag));
         if (err) {
             return err;
@@ -751,9 +1179,40 @@ static int lfs_dir_traverse(lfs_t *lfs,
     }
 }
 
+static int lfs_dir_namehashcmp(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off, lfs_tag_t tag, uint32_t hash) {
+    // name hashes are stored in the tag immediately following the name
+    lfs_tag_t htag;
+    off += lfs_tag_dsize(tag);
+    int err = lfs_bd_read(lfs,
+            NULL, &lfs->rcache, lfs->cfg->block_size,
+            block, off, &htag, sizeof(htag));
+    if (err) {
+        return err;
+    }
+    htag = lfs_frombe32(htag) ^ tag;
+
+    if (htag != LFS_MKTAG(LFS_TYPE_NAMEHASH, lfs_tag_id(tag), 4)) {
+        // no hash, need to compare the name
+        return LFS_CMP_EQ;
+    }
+
+    uint32_t dhash;
+    err = lfs_bd_read(lfs,
+            NULL, &lfs->rcache, lfs->cfg->block_size,
+            block, off+sizeof(htag), &dhash, sizeof(dhash));
+    if (err) {
+        return err;
+    }
+    dhash = lfs_fromle32(dhash);
+
+    // we only care about equality here, any mismatch reports greater
+    return (dhash == hash) ? LFS_CMP_EQ : LFS_CMP_GT;
+}
+
 static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
         lfs_mdir_t *dir, const lfs_block_t pair[2],
-        lfs_tag_t fmask, lfs_tag_t ftag, uint16_t *id,
+        lfs_tag_t fmask, lfs_tag_t ftag, uint16_t *id, const uint32_t *fhash,
         int (*cb)(void *data, lfs_tag_t tag, const void *buffer), void *data) {
     // we can find tag very efficiently during a fetch, since we're already
     // scanning the entire directory
@@ -792,6 +1251,10 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
         bool tempsplit = false;
         lfs_stag_t tempbesttag = besttag;
 
+        // index the tags as we go, but only up to the last valid commit
+        bool indexed = lfs_tindex_reset(lfs);
+        bool idirty = false;
+
         dir->rev = lfs_tole32(dir->rev);
         uint32_t crc = lfs_crc(LFS_BLOCK_NULL, &dir->rev, sizeof(dir->rev));
         dir->rev = lfs_fromle32(dir->rev);
@@ -860,6 +1323,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 dir->tail[0] = temptail[0];
                 dir->tail[1] = temptail[1];
                 dir->split = tempsplit;
+                idirty = false;
 
                 // reset crc
                 crc = LFS_BLOCK_NULL;
@@ -883,6 +1347,11 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 crc = lfs_crc(crc, &dat, 1);
             }
 
+            if (indexed) {
+                lfs_tindex_append(lfs, tag, off, tempcount);
+                idirty = true;
+            }
+
             // directory modification tags?
             if (lfs_tag_type1(tag) == LFS_TYPE_NAME) {
                 // increase count of files if necessary
@@ -916,6 +1385,24 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
 
             // found a match for our fetcher?
             if ((fmask & tag) == (fmask & ftag)) {
+                // if we already know where we would be ordered, names
+                // with a mismatched hash can't match and can be skipped
+                if (fhash && !id && lfs_tag_id(tempbesttag) != 0x3ff) {
+                    int res = lfs_dir_namehashcmp(lfs,
+                            dir->pair[0], off, tag, *fhash);
+                    if (res < 0) {
+                        if (res == LFS_ERR_CORRUPT) {
+                            dir->erased = false;
+                            break;
+                        }
+                        return res;
+                    }
+
+                    if (res == LFS_CMP_GT) {
+                        continue;
+                    }
+                }
+
                 int res = cb(data, tag, &(struct lfs_diskoff){
                         dir->pair[0], off+sizeof(tag)});
                 if (res < 0) {
@@ -939,6 +1426,11 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
 
         // consider what we have good enough
         if (dir->off > 0) {
+            if (indexed && !idirty) {
+                lfs->tindex.block = dir->pair[0];
+                lfs->tindex.off = dir->off;
+            }
+
             // synthetic move
             if (lfs_gstate_hasmovehere(&lfs->gstate, dir->pair)) {
                 if (lfs_tag_id(lfs->gstate.tag) == lfs_tag_id(besttag)) {
@@ -977,7 +1469,7 @@ static int lfs_dir_fetch(lfs_t *lfs,
         lfs_mdir_t *dir, const lfs_block_t pair[2]) {
     // note, mask=-1, tag=0 can never match a tag since this
     // pattern has the invalid bit set
-    return lfs_dir_fetchmatch(lfs, dir, pair, -1, 0, NULL, NULL, NULL);
+    return lfs_dir_fetchmatch(lfs, dir, pair, -1, 0, NULL, NULL, NULL, NULL);
 }
 
 static int lfs_dir_getgstate(lfs_t *lfs, const lfs_mdir_t *dir,
@@ -1023,7 +1515,8 @@ static int lfs_dir_getinfo(lfs_t *lfs, lfs_mdir_t *dir,
     }
     lfs_ctz_fromle32(&ctz);
 
-    if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT) {
+    if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT ||
+            lfs_tag_type3(tag) == LFS_TYPE_IDXSTRUCT) {
         info->size = ctz.size;
     } else if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
         info->size = lfs_tag_size(tag);
@@ -1135,6 +1628,12 @@ nextname:
             lfs_pair_fromle32(dir->tail);
         }
 
+        // hash name so we can skip names that can't match
+        uint32_t hash = 0;
+        if (lfs_namehash_isenabled(lfs)) {
+            hash = lfs_namehash(name, namelen);
+        }
+
         // find entry matching name
         while (true) {
             tag = lfs_dir_fetchmatch(lfs, dir, dir->tail,
@@ -1142,6 +1641,7 @@ nextname:
                     LFS_MKTAG(LFS_TYPE_NAME, 0, namelen),
                      // are we last name?
                     (strchr(name, '/') == NULL) ? id : NULL,
+                    lfs_namehash_isenabled(lfs) ? &hash : NULL,
                     lfs_dir_find_match, &(struct lfs_dir_find_match){
                         lfs, name, namelen});
             if (tag < 0) {
@@ -1382,6 +1882,8 @@ static int lfs_dir_split(lfs_t *lfs,
     if (err) {
         return err;
     }
+    LFS_STATS_ADD(lfs, splits, 1);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_SPLIT, tail.pair[0], tail.pair[1], 0);
 
     tail.split = dir->split;
     tail.tail[0] = dir->tail[0];
@@ -1423,6 +1925,46 @@ static int lfs_dir_commit_commit(void *p, lfs_tag_t tag, const void *buffer) {
     return lfs_dir_commitattr(commit->lfs, commit->commit, tag, buffer);
 }
 
+static int lfs_dir_compactsize(lfs_t *lfs,
+        const struct lfs_mattr *attrs, int attrcount,
+        lfs_mdir_t *source, uint16_t begin, uint16_t end, lfs_size_t *size) {
+    *size = 0;
+    return lfs_dir_traverse(lfs,
+            source, 0, LFS_BLOCK_NULL, attrs, attrcount, false,
+            LFS_MKTAG(0x400, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_NAME, 0, 0),
+            begin, end, -begin,
+            lfs_dir_commit_size, size);
+}
+
+static lfs_size_t lfs_dir_compactmax(lfs_t *lfs) {
+    // space is complicated, we need room for tail, crc, gstate,
+    // cleanup delete, and we cap at split_size (half a block by default)
+    // to give room for metadata updates.
+    lfs_size_t split_size = lfs->cfg->split_size
+            ? lfs->cfg->split_size
+            : lfs->cfg->block_size/2;
+    return lfs_min(lfs->cfg->block_size - 36,
+            lfs_alignup(split_size, lfs->cfg->prog_size));
+}
+
+static bool lfs_dir_isappend(const lfs_mdir_t *dir,
+        const struct lfs_mattr *attrs, int attrcount, uint16_t end) {
+    // are we creating an entry at the very end of the directory?
+    if (dir->split) {
+        return false;
+    }
+
+    for (int i = 0; i < attrcount; i++) {
+        if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_CREATE &&
+                lfs_tag_id(attrs[i].tag) == end-1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static int lfs_dir_compact(lfs_t *lfs,
         lfs_mdir_t *dir, const struct lfs_mattr *attrs, int attrcount,
         lfs_mdir_t *source, uint16_t begin, uint16_t end) {
@@ -1430,35 +1972,52 @@ static int lfs_dir_compact(lfs_t *lfs,
     const lfs_block_t oldpair[2] = {dir->pair[1], dir->pair[0]};
     bool relocated = false;
     bool exhausted = false;
+    LFS_STATS_ADD(lfs, compacts, 1);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_COMPACT, dir->pair[0], dir->pair[1], 0);
 
     // should we split?
     while (end - begin > 1) {
         // find size
-        lfs_size_t size = 0;
-        int err = lfs_dir_traverse(lfs,
-                source, 0, LFS_BLOCK_NULL, attrs, attrcount, false,
-                LFS_MKTAG(0x400, 0x3ff, 0),
-                LFS_MKTAG(LFS_TYPE_NAME, 0, 0),
-                begin, end, -begin,
-                lfs_dir_commit_size, &size);
+        lfs_size_t size;
+        int err = lfs_dir_compactsize(lfs,
+                attrs, attrcount, source, begin, end, &size);
         if (err) {
             return err;
         }
 
-        // space is complicated, we need room for tail, crc, gstate,
-        // cleanup delete, and we cap at half a block to give room
-        // for metadata updates.
-        if (end - begin < 0xff &&
-                size <= lfs_min(lfs->cfg->block_size - 36,
-                    lfs_alignup(lfs->cfg->block_size/2,
-                        lfs->cfg->prog_size))) {
+        if (end - begin < 0xff && size <= lfs_dir_compactmax(lfs)) {
             break;
         }
 
-        // can't fit, need to split, we should really be finding the
-        // largest size that fits with a small binary search, but right now
-        // it's not worth the code size
-        uint16_t split = (end - begin) / 2;
+        // can't fit, need to split. Splitting evenly by size leaves room for
+        // inserts on both sides, but if we're appending to the end of the
+        // directory, the entries we leave behind are unlikely to see new
+        // neighbors, so we pack them as tightly as we can
+        lfs_size_t target = lfs_dir_compactmax(lfs);
+        if (!lfs_dir_isappend(dir, attrs, attrcount, end)) {
+            target = lfs_min(target, size/2);
+        }
+
+        // find the largest number of entries that fits our target
+        // with a small binary search
+        uint16_t split = 1;
+        uint16_t nofit = lfs_min(end - begin, 0xff);
+        while (nofit - split > 1) {
+            uint16_t mid = split + (nofit - split)/2;
+            lfs_size_t midsize;
+            err = lfs_dir_compactsize(lfs,
+                    attrs, attrcount, source, begin, begin+mid, &midsize);
+            if (err) {
+                return err;
+            }
+
+            if (midsize <= target) {
+                split = mid;
+            } else {
+                nofit = mid;
+            }
+        }
+
         err = lfs_dir_split(lfs, dir, attrs, attrcount,
                 source, begin+split, end);
         if (err) {
@@ -1616,6 +2175,7 @@ static int lfs_dir_compact(lfs_t *lfs,
             dir->count = end - begin;
             dir->off = commit.off;
             dir->etag = commit.ptag;
+            dir->erased = true;
             // note we able to have already handled move here
             if (lfs_gstate_hasmovehere(&lfs->gpending, dir->pair)) {
                 lfs_gstate_xormove(&lfs->gpending,
@@ -1630,6 +2190,8 @@ relocate:
         lfs_cache_drop(lfs, &lfs->pcache);
         if (!exhausted) {
             LFS_DEBUG("Bad block at %"PRIx32, dir->pair[1]);
+            LFS_STATS_ADD(lfs, bad_blocks, 1);
+            LFS_TRACE_EVENT(lfs, LFS_TRACE_BAD_BLOCK, dir->pair[1], 0, 0);
         }
 
         // can't relocate superblock, filesystem is now frozen
@@ -1654,6 +2216,8 @@ relocate:
         // update references if we relocated
         LFS_DEBUG("Relocating %"PRIx32" %"PRIx32" -> %"PRIx32" %"PRIx32,
                 oldpair[0], oldpair[1], dir->pair[0], dir->pair[1]);
+        LFS_STATS_ADD(lfs, relocations, 1);
+        LFS_TRACE_EVENT(lfs, LFS_TRACE_RELOCATE, oldpair[1], dir->pair[1], 0);
         int err = lfs_fs_relocate(lfs, oldpair, dir->pair);
         if (err) {
             return err;
@@ -1799,8 +2363,10 @@ compact:
         // fall back to compaction
         lfs_cache_drop(lfs, &lfs->pcache);
 
+        LFS_STATS_CLOCK(t);
         int err = lfs_dir_compact(lfs, dir, attrs, attrcount,
                 dir, 0, dir->count);
+        LFS_STATS_TIME(lfs, compact_time, t);
         if (err) {
             return err;
         }
@@ -1814,6 +2380,10 @@ compact:
     for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
         if (lfs_pair_cmp(d->m.pair, copy.pair) == 0) {
             d->m = *dir;
+            if (d->type == LFS_TYPE_PRED) {
+                continue;
+            }
+
             if (d->id == lfs_tag_id(deletetag)) {
                 d->m.pair[0] = LFS_BLOCK_NULL;
                 d->m.pair[1] = LFS_BLOCK_NULL;
@@ -1844,104 +2414,242 @@ compact:
 }
 
 
-/// Top level directory operations ///
-int lfs_mkdir(lfs_t *lfs, const char *path) {
-    LFS_TRACE("lfs_mkdir(%p, \"%s\")", (void*)lfs, path);
-    // deorphan if we haven't yet, needed at most once after poweron
-    int err = lfs_fs_forceconsistency(lfs);
-    if (err) {
-        LFS_TRACE("lfs_mkdir -> %d", err);
-        return err;
-    }
-
-    lfs_mdir_t cwd;
-    uint16_t id;
-    err = lfs_dir_find(lfs, &cwd, &path, &id);
-    if (!(err == LFS_ERR_NOENT && id != 0x3ff)) {
-        LFS_TRACE("lfs_mkdir -> %d", (err < 0) ? err : LFS_ERR_EXIST);
-        return (err < 0) ? err : LFS_ERR_EXIST;
+/// Batched metadata updates ///
+static void lfs_batch_drop(lfs_t *lfs, struct lfs_mpending *p) {
+    for (struct lfs_mlist **d = &lfs->mlist; *d; d = &(*d)->next) {
+        if (*d == (struct lfs_mlist*)p) {
+            *d = (*d)->next;
+            break;
+        }
     }
 
-    // check that name fits
-    lfs_size_t nlen = strlen(path);
-    if (nlen > lfs->name_max) {
-        LFS_TRACE("lfs_mkdir -> %d", LFS_ERR_NAMETOOLONG);
-        return LFS_ERR_NAMETOOLONG;
-    }
+    lfs->batch.count -= 1;
+    lfs_free(p);
+}
 
-    // build up new directory
-    lfs_alloc_ack(lfs);
-    lfs_mdir_t dir;
-    err = lfs_dir_alloc(lfs, &dir);
-    if (err) {
-        LFS_TRACE("lfs_mkdir -> %d", err);
-        return err;
-    }
+static int lfs_batch_stage(lfs_t *lfs, const lfs_mdir_t *dir, uint16_t id,
+        uint16_t stype, const void *buffer, lfs_size_t size) {
+    struct lfs_mpending *p = lfs_mpending_find(lfs, dir->pair, id);
+    if (!p || p->size < size) {
+        struct lfs_mpending *np = lfs_malloc(sizeof(*np) + size);
+        if (!np) {
+            return LFS_ERR_NOMEM;
+        }
 
-    // find end of list
-    lfs_mdir_t pred = cwd;
-    while (pred.split) {
-        err = lfs_dir_fetch(lfs, &pred, pred.tail);
-        if (err) {
-            LFS_TRACE("lfs_mkdir -> %d", err);
-            return err;
+        if (p) {
+            lfs_batch_drop(lfs, p);
         }
-    }
 
-    // setup dir
-    lfs_pair_tole32(pred.tail);
-    err = lfs_dir_commit(lfs, &dir, LFS_MKATTRS(
-            {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), pred.tail}));
-    lfs_pair_fromle32(pred.tail);
-    if (err) {
-        LFS_TRACE("lfs_mkdir -> %d", err);
-        return err;
+        p = np;
+        p->next = (struct lfs_mpending*)lfs->mlist;
+        lfs->mlist = (struct lfs_mlist*)p;
+        lfs->batch.count += 1;
     }
 
-    // current block end of list?
-    if (cwd.split) {
-        // update tails, this creates a desync
+    p->id = id;
+    p->type = LFS_TYPE_PENDING;
+    p->m = *dir;
+    p->stype = stype;
+    p->size = size;
+    memcpy(p->buffer, buffer, size);
+    return 0;
+}
+
+static int lfs_batch_flush(lfs_t *lfs) {
+    while (lfs->batch.count > 0) {
+        struct lfs_mpending *p = NULL;
+        for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
+            if (d->type == LFS_TYPE_PENDING) {
+                p = (struct lfs_mpending*)d;
+                break;
+            }
+        }
+        LFS_ASSERT(p);
+
+        if (lfs_pair_isnull(p->m.pair)) {
+            // entry was removed out from under us
+            lfs_batch_drop(lfs, p);
+            continue;
+        }
+
+        // pull every update to this metadata pair off the mlist, the
+        // commit doesn't need to fix them up
+        lfs_mdir_t dir = p->m;
+        struct lfs_mpending *group = NULL;
+        lfs_size_t count = 0;
+        for (struct lfs_mlist **d = &lfs->mlist; *d;) {
+            if ((*d)->type == LFS_TYPE_PENDING &&
+                    lfs_pair_cmp((*d)->m.pair, dir.pair) == 0) {
+                struct lfs_mpending *q = (struct lfs_mpending*)*d;
+                *d = (*d)->next;
+                q->next = group;
+                group = q;
+                count += 1;
+            } else {
+                d = &(*d)->next;
+            }
+        }
+
+        struct lfs_mattr *attrs = lfs_malloc(count*sizeof(struct lfs_mattr));
+        int err = LFS_ERR_NOMEM;
+        if (attrs) {
+            lfs_size_t i = 0;
+            for (struct lfs_mpending *q = group; q; q = q->next) {
+                attrs[i].tag = lfs_mpending_tag(q);
+                attrs[i].buffer = q->buffer;
+                i += 1;
+            }
+
+            // one commit for the whole pair
+            err = lfs_dir_commit(lfs, &dir, attrs, count);
+            lfs_free(attrs);
+        }
+
+        if (err) {
+            // put everything back so we can try again later
+            while (group) {
+                struct lfs_mpending *q = group;
+                group = q->next;
+                q->next = (struct lfs_mpending*)lfs->mlist;
+                lfs->mlist = (struct lfs_mlist*)q;
+            }
+            return err;
+        }
+
+        while (group) {
+            struct lfs_mpending *q = group;
+            group = q->next;
+            lfs->batch.count -= 1;
+            lfs_free(q);
+        }
+    }
+
+    return 0;
+}
+
+static void lfs_batch_clear(lfs_t *lfs) {
+    for (struct lfs_mlist **d = &lfs->mlist; *d;) {
+        if ((*d)->type == LFS_TYPE_PENDING) {
+            struct lfs_mlist *p = *d;
+            *d = (*d)->next;
+            lfs_free(p);
+        } else {
+            d = &(*d)->next;
+        }
+    }
+
+    lfs->batch.depth = 0;
+    lfs->batch.count = 0;
+}
+
+
+/// Top level directory operations ///
+int lfs_mkdir(lfs_t *lfs, const char *path) {
+    LFS_TRACE("lfs_mkdir(%p, \"%s\")", (void*)lfs, path);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_MKDIR, 0, 0, 0);
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR, "lfs_mkdir -> %d", err);
+        return err;
+    }
+
+    lfs_mdir_t cwd;
+    uint16_t id;
+    err = lfs_dir_find(lfs, &cwd, &path, &id);
+    if (!(err == LFS_ERR_NOENT && id != 0x3ff)) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR,
+                "lfs_mkdir -> %d", (err < 0) ? err : LFS_ERR_EXIST);
+        return (err < 0) ? err : LFS_ERR_EXIST;
+    }
+
+    // check that name fits
+    lfs_size_t nlen = strlen(path);
+    if (nlen > lfs->name_max) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR,
+                "lfs_mkdir -> %d", LFS_ERR_NAMETOOLONG);
+        return LFS_ERR_NAMETOOLONG;
+    }
+
+    // build up new directory
+    lfs_alloc_ack(lfs);
+    lfs_mdir_t dir;
+    err = lfs_dir_alloc(lfs, &dir);
+    if (err) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR, "lfs_mkdir -> %d", err);
+        return err;
+    }
+
+    // find end of list
+    lfs_mdir_t pred = cwd;
+    while (pred.split) {
+        err = lfs_dir_fetch(lfs, &pred, pred.tail);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR, "lfs_mkdir -> %d", err);
+            return err;
+        }
+    }
+
+    // setup dir
+    lfs_pair_tole32(pred.tail);
+    err = lfs_dir_commit(lfs, &dir, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), pred.tail}));
+    lfs_pair_fromle32(pred.tail);
+    if (err) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR, "lfs_mkdir -> %d", err);
+        return err;
+    }
+
+    // current block end of list?
+    if (cwd.split) {
+        // update tails, this creates a desync
         lfs_fs_preporphans(lfs, +1);
         lfs_pair_tole32(dir.pair);
         err = lfs_dir_commit(lfs, &pred, LFS_MKATTRS(
                 {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), dir.pair}));
         lfs_pair_fromle32(dir.pair);
         if (err) {
-            LFS_TRACE("lfs_mkdir -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR, "lfs_mkdir -> %d", err);
             return err;
         }
         lfs_fs_preporphans(lfs, -1);
     }
 
     // now insert into our parent block
+    uint32_t hash = lfs_tole32(lfs_namehash(path, nlen));
     lfs_pair_tole32(dir.pair);
     err = lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
             {LFS_MKTAG(LFS_TYPE_CREATE, id, 0), NULL},
             {LFS_MKTAG(LFS_TYPE_DIR, id, nlen), path},
+            {lfs_namehash_isenabled(lfs)
+                ? LFS_MKTAG(LFS_TYPE_NAMEHASH, id, 4)
+                : LFS_MKTAG(LFS_FROM_NOOP, 0, 0), &hash},
             {LFS_MKTAG(LFS_TYPE_DIRSTRUCT, id, 8), dir.pair},
             {!cwd.split
                 ? LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8)
                 : LFS_MKTAG(LFS_FROM_NOOP, 0, 0), dir.pair}));
     lfs_pair_fromle32(dir.pair);
     if (err) {
-        LFS_TRACE("lfs_mkdir -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR, "lfs_mkdir -> %d", err);
         return err;
     }
 
-    LFS_TRACE("lfs_mkdir -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_MKDIR, "lfs_mkdir -> %d", 0);
     return 0;
 }
 
 int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
     LFS_TRACE("lfs_dir_open(%p, %p, \"%s\")", (void*)lfs, (void*)dir, path);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_DIR_OPEN, (uint32_t)(uintptr_t)dir, 0, 0);
     lfs_stag_t tag = lfs_dir_find(lfs, &dir->m, &path, NULL);
     if (tag < 0) {
-        LFS_TRACE("lfs_dir_open -> %d", tag);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_OPEN, "lfs_dir_open -> %d", tag);
         return tag;
     }
 
     if (lfs_tag_type3(tag) != LFS_TYPE_DIR) {
-        LFS_TRACE("lfs_dir_open -> %d", LFS_ERR_NOTDIR);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_OPEN,
+                "lfs_dir_open -> %d", LFS_ERR_NOTDIR);
         return LFS_ERR_NOTDIR;
     }
 
@@ -1955,7 +2663,7 @@ int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
         lfs_stag_t res = lfs_dir_get(lfs, &dir->m, LFS_MKTAG(0x700, 0x3ff, 0),
                 LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), pair);
         if (res < 0) {
-            LFS_TRACE("lfs_dir_open -> %d", res);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_OPEN, "lfs_dir_open -> %d", res);
             return res;
         }
         lfs_pair_fromle32(pair);
@@ -1964,7 +2672,7 @@ int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
     // fetch first pair
     int err = lfs_dir_fetch(lfs, &dir->m, pair);
     if (err) {
-        LFS_TRACE("lfs_dir_open -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_OPEN, "lfs_dir_open -> %d", err);
         return err;
     }
 
@@ -1979,12 +2687,13 @@ int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
     dir->next = (lfs_dir_t*)lfs->mlist;
     lfs->mlist = (struct lfs_mlist*)dir;
 
-    LFS_TRACE("lfs_dir_open -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_OPEN, "lfs_dir_open -> %d", 0);
     return 0;
 }
 
 int lfs_dir_close(lfs_t *lfs, lfs_dir_t *dir) {
     LFS_TRACE("lfs_dir_close(%p, %p)", (void*)lfs, (void*)dir);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_DIR_CLOSE, (uint32_t)(uintptr_t)dir, 0, 0);
     // remove from list of mdirs
     for (struct lfs_mlist **p = &lfs->mlist; *p; p = &(*p)->next) {
         if (*p == (struct lfs_mlist*)dir) {
@@ -1993,13 +2702,14 @@ int lfs_dir_close(lfs_t *lfs, lfs_dir_t *dir) {
         }
     }
 
-    LFS_TRACE("lfs_dir_close -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_CLOSE, "lfs_dir_close -> %d", 0);
     return 0;
 }
 
 int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
     LFS_TRACE("lfs_dir_read(%p, %p, %p)",
             (void*)lfs, (void*)dir, (void*)info);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_DIR_READ, (uint32_t)(uintptr_t)dir, 0, 0);
     memset(info, 0, sizeof(*info));
 
     // special offset for '.' and '..'
@@ -2007,26 +2717,28 @@ int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
         info->type = LFS_TYPE_DIR;
         strcpy(info->name, ".");
         dir->pos += 1;
-        LFS_TRACE("lfs_dir_read -> %d", true);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_READ, "lfs_dir_read -> %d", true);
         return true;
     } else if (dir->pos == 1) {
         info->type = LFS_TYPE_DIR;
         strcpy(info->name, "..");
         dir->pos += 1;
-        LFS_TRACE("lfs_dir_read -> %d", true);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_READ, "lfs_dir_read -> %d", true);
         return true;
     }
 
     while (true) {
         if (dir->id == dir->m.count) {
             if (!dir->m.split) {
-                LFS_TRACE("lfs_dir_read -> %d", false);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_READ,
+                        "lfs_dir_read -> %d", false);
                 return false;
             }
 
             int err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
             if (err) {
-                LFS_TRACE("lfs_dir_read -> %d", err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_READ,
+                        "lfs_dir_read -> %d", err);
                 return err;
             }
 
@@ -2035,7 +2747,7 @@ int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
 
         int err = lfs_dir_getinfo(lfs, &dir->m, dir->id, info);
         if (err && err != LFS_ERR_NOENT) {
-            LFS_TRACE("lfs_dir_read -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_READ, "lfs_dir_read -> %d", err);
             return err;
         }
 
@@ -2046,17 +2758,18 @@ int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
     }
 
     dir->pos += 1;
-    LFS_TRACE("lfs_dir_read -> %d", true);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_READ, "lfs_dir_read -> %d", true);
     return true;
 }
 
 int lfs_dir_seek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
     LFS_TRACE("lfs_dir_seek(%p, %p, %"PRIu32")",
             (void*)lfs, (void*)dir, off);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_DIR_SEEK, (uint32_t)(uintptr_t)dir, off, 0);
     // simply walk from head dir
     int err = lfs_dir_rewind(lfs, dir);
     if (err) {
-        LFS_TRACE("lfs_dir_seek -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_SEEK, "lfs_dir_seek -> %d", err);
         return err;
     }
 
@@ -2071,35 +2784,42 @@ int lfs_dir_seek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
 
         if (dir->id == dir->m.count) {
             if (!dir->m.split) {
-                LFS_TRACE("lfs_dir_seek -> %d", LFS_ERR_INVAL);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_SEEK,
+                        "lfs_dir_seek -> %d", LFS_ERR_INVAL);
                 return LFS_ERR_INVAL;
             }
 
             err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
             if (err) {
-                LFS_TRACE("lfs_dir_seek -> %d", err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_SEEK,
+                        "lfs_dir_seek -> %d", err);
                 return err;
             }
+
+            dir->id = 0;
         }
     }
 
-    LFS_TRACE("lfs_dir_seek -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_SEEK, "lfs_dir_seek -> %d", 0);
     return 0;
 }
 
 lfs_soff_t lfs_dir_tell(lfs_t *lfs, lfs_dir_t *dir) {
     LFS_TRACE("lfs_dir_tell(%p, %p)", (void*)lfs, (void*)dir);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_DIR_TELL, (uint32_t)(uintptr_t)dir, 0, 0);
     (void)lfs;
-    LFS_TRACE("lfs_dir_tell -> %"PRId32, dir->pos);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_TELL,
+            "lfs_dir_tell -> %"PRId32, dir->pos);
     return dir->pos;
 }
 
 int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir) {
     LFS_TRACE("lfs_dir_rewind(%p, %p)", (void*)lfs, (void*)dir);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_DIR_REWIND, (uint32_t)(uintptr_t)dir, 0, 0);
     // reload the head dir
     int err = lfs_dir_fetch(lfs, &dir->m, dir->head);
     if (err) {
-        LFS_TRACE("lfs_dir_rewind -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_REWIND, "lfs_dir_rewind -> %d", err);
         return err;
     }
 
@@ -2107,7 +2827,7 @@ int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir) {
     dir->m.pair[1] = dir->head[1];
     dir->id = 0;
     dir->pos = 0;
-    LFS_TRACE("lfs_dir_rewind -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_DIR_REWIND, "lfs_dir_rewind -> %d", 0);
     return 0;
 }
 
@@ -2163,12 +2883,14 @@ static int lfs_ctz_find(lfs_t *lfs,
 
 static int lfs_ctz_extend(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache,
+        struct lfs_reserve *reserve,
         lfs_block_t head, lfs_size_t size,
         lfs_block_t *block, lfs_off_t *off) {
     while (true) {
         // go ahead and grab a block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        int err = lfs_alloc_file(lfs, reserve,
+                (size > 0) ? head : LFS_BLOCK_NULL, &nblock);
         if (err) {
             return err;
         }
@@ -2256,6 +2978,8 @@ static int lfs_ctz_extend(lfs_t *lfs,
 
 relocate:
         LFS_DEBUG("Bad block at %"PRIx32, nblock);
+        LFS_STATS_ADD(lfs, bad_blocks, 1);
+        LFS_TRACE_EVENT(lfs, LFS_TRACE_BAD_BLOCK, nblock, 0, 0);
 
         // just clear cache and try a new block
         lfs_cache_drop(lfs, pcache);
@@ -2306,20 +3030,330 @@ static int lfs_ctz_traverse(lfs_t *lfs,
 }
 
 
+/// File index tree operations ///
+// Indexed files keep a tree of index blocks, each an array of little-endian
+// pointers to the next level, with the data blocks as leaves. The data is
+// stored at plain offsets, so block n holds bytes n*block_size onwards. The
+// tree is as shallow as the file allows, a file of a single block has no
+// index blocks and its head is the data block itself. Holes are null
+// pointers, and a subtree that is all holes is left out as a single null
+// pointer.
+static inline lfs_size_t lfs_idx_count(lfs_t *lfs, lfs_size_t size) {
+    return (size + lfs->cfg->block_size-1) / lfs->cfg->block_size;
+}
+
+static lfs_size_t lfs_idx_depth(lfs_t *lfs, lfs_size_t count) {
+    lfs_size_t depth = 0;
+    for (lfs_size_t span = 1; span < count; span *= lfs->cfg->block_size/4) {
+        depth += 1;
+    }
+
+    return depth;
+}
+
+static int lfs_idx_lookup(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache,
+        lfs_block_t head, lfs_size_t depth,
+        lfs_off_t index, lfs_size_t level, lfs_block_t *block) {
+    const lfs_size_t n = lfs->cfg->block_size/4;
+    lfs_off_t span = 1;
+    for (lfs_size_t d = 1; d < depth; d++) {
+        span *= n;
+    }
+
+    // walk down the path to the block until we reach the requested level
+    for (lfs_size_t d = depth; d > level; d--) {
+        if (head == LFS_BLOCK_NULL) {
+            // everything below a hole is a hole
+            break;
+        }
+
+        int err = lfs_bd_read(lfs, pcache, rcache, sizeof(head),
+                head, 4*((index / span) % n), &head, sizeof(head));
+        head = lfs_fromle32(head);
+        if (err) {
+            return err;
+        }
+
+        span /= n;
+    }
+
+    *block = head;
+    return 0;
+}
+
+static int lfs_idx_find(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache,
+        lfs_block_t head, lfs_size_t size,
+        lfs_size_t pos, lfs_block_t *block, lfs_off_t *off) {
+    if (size == 0) {
+        *block = LFS_BLOCK_NULL;
+        *off = 0;
+        return 0;
+    }
+
+    lfs_size_t depth = lfs_idx_depth(lfs, lfs_idx_count(lfs, size));
+    *off = pos % lfs->cfg->block_size;
+    return lfs_idx_lookup(lfs, pcache, rcache, head, depth,
+            pos / lfs->cfg->block_size, 0, block);
+}
+
+static int lfs_idx_traverse(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache,
+        lfs_block_t head, lfs_size_t size,
+        int (*cb)(void*, lfs_block_t), void *data) {
+    const lfs_size_t n = lfs->cfg->block_size/4;
+    lfs_size_t count = lfs_idx_count(lfs, size);
+    lfs_size_t depth = lfs_idx_depth(lfs, count);
+
+    for (lfs_off_t index = 0; index < count; index++) {
+        lfs_off_t span = 1;
+        for (lfs_size_t d = 0; d < depth; d++) {
+            span *= n;
+        }
+
+        // report each index block when we reach its first data block
+        for (lfs_size_t level = depth+1; level-- > 0; span /= n) {
+            if (index % span != 0) {
+                continue;
+            }
+
+            lfs_block_t block;
+            int err = lfs_idx_lookup(lfs, pcache, rcache, head, depth,
+                    index, level, &block);
+            if (err) {
+                return err;
+            }
+
+            if (block == LFS_BLOCK_NULL) {
+                // holes have no block
+                continue;
+            }
+
+            err = cb(data, block);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int lfs_idx_commit(lfs_t *lfs, lfs_block_t node, lfs_size_t count,
+        lfs_off_t i, lfs_block_t child, lfs_size_t ncount,
+        lfs_block_t *block) {
+    while (true) {
+        // go ahead and grab a block, out of the way of the data blocks
+        lfs_block_t nblock;
+        int err = lfs_alloc_last(lfs, &nblock);
+        if (err) {
+            return err;
+        }
+        LFS_ASSERT(nblock >= 2 && nblock <= lfs->cfg->block_count);
+
+        err = lfs_bd_erase(lfs, nblock);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
+            return err;
+        }
+
+        // copy the old entries, replacing the one that changed, anything
+        // past the old entries is a hole
+        for (lfs_off_t j = 0; j < ncount; j++) {
+            lfs_block_t entry = (j == i) ? child : LFS_BLOCK_NULL;
+            if (j != i && j < count && node != LFS_BLOCK_NULL) {
+                err = lfs_bd_read(lfs, NULL, &lfs->rcache, 4*(count-j),
+                        node, 4*j, &entry, sizeof(entry));
+                entry = lfs_fromle32(entry);
+                if (err) {
+                    return err;
+                }
+            }
+
+            entry = lfs_tole32(entry);
+            err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                    nblock, 4*j, &entry, sizeof(entry));
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+        }
+
+        err = lfs_bd_flush(lfs, &lfs->pcache, &lfs->rcache, true);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
+            return err;
+        }
+
+        *block = nblock;
+        return 0;
+
+relocate:
+        LFS_DEBUG("Bad block at %"PRIx32, nblock);
+        LFS_STATS_ADD(lfs, bad_blocks, 1);
+        LFS_TRACE_EVENT(lfs, LFS_TRACE_BAD_BLOCK, nblock, 0, 0);
+
+        // just clear cache and try a new block
+        lfs_cache_drop(lfs, &lfs->pcache);
+    }
+}
+
+static int lfs_idx_set(lfs_t *lfs, lfs_block_t *head, lfs_size_t size,
+        lfs_off_t index, lfs_block_t block) {
+    const lfs_size_t n = lfs->cfg->block_size/4;
+    lfs_size_t count = lfs_idx_count(lfs, size);
+    lfs_size_t depth = lfs_idx_depth(lfs, count);
+    // blocks are only ever added at the end
+    LFS_ASSERT(index <= count);
+
+    if (count > 0 && lfs_idx_depth(lfs, lfs_max(count, index+1)) > depth) {
+        // tree is full, push a new root above the old one
+        int err = lfs_idx_commit(lfs, LFS_BLOCK_NULL, 0, 0, *head, 1, head);
+        if (err) {
+            return err;
+        }
+
+        depth += 1;
+    }
+
+    // copy-on-write the path from the data block up to the root
+    lfs_off_t span = 1;
+    for (lfs_size_t level = 1; level <= depth; level++) {
+        lfs_off_t base = index - index % (span*n);
+        lfs_block_t node = LFS_BLOCK_NULL;
+        lfs_size_t ncount = 0;
+        if (base < count) {
+            int err = lfs_idx_lookup(lfs, NULL, &lfs->rcache, *head, depth,
+                    index, level, &node);
+            if (err) {
+                return err;
+            }
+
+            ncount = lfs_min(n, (count - base + span-1) / span);
+        }
+
+        lfs_off_t i = (index / span) % n;
+        int err = lfs_idx_commit(lfs, node, ncount,
+                i, block, lfs_max(ncount, i+1), &block);
+        if (err) {
+            return err;
+        }
+
+        span *= n;
+    }
+
+    *head = block;
+    return 0;
+}
+
+static int lfs_idx_grow(lfs_t *lfs, lfs_block_t *head,
+        lfs_size_t size, lfs_size_t nsize) {
+    const lfs_size_t n = lfs->cfg->block_size/4;
+    lfs_size_t count = lfs_idx_count(lfs, size);
+    lfs_size_t ncount = lfs_idx_count(lfs, nsize);
+    if (count == 0) {
+        // nothing but holes, no need for an index
+        *head = LFS_BLOCK_NULL;
+        return 0;
+    }
+
+    // extend the file with holes, only the nodes on the path to the last
+    // block gain entries, so each level costs at most one copy-on-write
+    lfs_size_t depth = lfs_idx_depth(lfs, count);
+    lfs_block_t block;
+    int err = lfs_idx_lookup(lfs, NULL, &lfs->rcache, *head, depth,
+            count-1, 0, &block);
+    if (err) {
+        return err;
+    }
+
+    bool changed = false;
+    lfs_off_t span = 1;
+    for (lfs_size_t level = 1; level <= lfs_idx_depth(lfs, ncount); level++) {
+        lfs_off_t base = (count-1) - (count-1) % (span*n);
+        lfs_block_t node = LFS_BLOCK_NULL;
+        lfs_size_t ocount = 0;
+        if (level <= depth) {
+            err = lfs_idx_lookup(lfs, NULL, &lfs->rcache, *head, depth,
+                    count-1, level, &node);
+            if (err) {
+                return err;
+            }
+
+            ocount = lfs_min(n, (count - base + span-1) / span);
+        }
+
+        lfs_size_t nentries = lfs_min(n, (ncount - base + span-1) / span);
+        if (node == LFS_BLOCK_NULL && block == LFS_BLOCK_NULL) {
+            // still all holes, leave it out
+        } else if (!changed && nentries == ocount) {
+            // node is already full, keep it as is
+            block = node;
+        } else {
+            err = lfs_idx_commit(lfs, node, ocount,
+                    ((count-1) / span) % n, block, nentries, &block);
+            if (err) {
+                return err;
+            }
+
+            changed = true;
+        }
+
+        span *= n;
+    }
+
+    *head = block;
+    return 0;
+}
+
+static int lfs_idx_shrink(lfs_t *lfs, lfs_block_t *head,
+        lfs_size_t size, lfs_size_t nsize) {
+    if (nsize == 0) {
+        *head = LFS_BLOCK_NULL;
+        return 0;
+    }
+
+    // the first blocks of the file stay where they are, we only need to
+    // drop the levels of the tree we no longer need
+    lfs_size_t depth = lfs_idx_depth(lfs, lfs_idx_count(lfs, size));
+    return lfs_idx_lookup(lfs, NULL, &lfs->rcache, *head, depth,
+            0, lfs_idx_depth(lfs, lfs_idx_count(lfs, nsize)), head);
+}
+
+
 /// Top level file operations ///
 int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags,
         const struct lfs_file_config *cfg) {
     LFS_TRACE("lfs_file_opencfg(%p, %p, \"%s\", %x, %p {"
-                 ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32"})",
+                 ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32", "
+                 ".layout=%d})",
             (void*)lfs, (void*)file, path, flags,
-            (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count);
+            (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count,
+            cfg->layout);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_OPENCFG,
+            (uint32_t)(uintptr_t)file, flags, 0);
+
+    // indexed files need a filesystem that knows about them
+    if (cfg->layout == LFS_LAYOUT_INDEXED && !lfs_idx_isenabled(lfs)) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_OPENCFG,
+                "lfs_file_opencfg -> %d", LFS_ERR_INVAL);
+        return LFS_ERR_INVAL;
+    }
 
     // deorphan if we haven't yet, needed at most once after poweron
     if ((flags & 3) != LFS_O_RDONLY) {
         int err = lfs_fs_forceconsistency(lfs);
         if (err) {
-            LFS_TRACE("lfs_file_opencfg -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_OPENCFG,
+                    "lfs_file_opencfg -> %d", err);
             return err;
         }
     }
@@ -2331,14 +3365,22 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
     file->pos = 0;
     file->off = 0;
     file->cache.buffer = NULL;
+    file->reserve.count = 0;
 
-    // allocate entry for file if it doesn't exist
-    lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path, &file->id);
+    // allocate entry for file if it doesn't exist, we only need to know
+    // where the entry would go if we're allowed to create it
+    file->id = 0x3ff;
+    lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path,
+            (flags & LFS_O_CREAT) ? &file->id : NULL);
     if (tag < 0 && !(tag == LFS_ERR_NOENT && file->id != 0x3ff)) {
         err = tag;
         goto cleanup;
     }
 
+    if (tag >= 0) {
+        file->id = lfs_tag_id(tag);
+    }
+
     // get id, add to list of mdirs to catch update changes
     file->type = LFS_TYPE_REG;
     file->next = (lfs_file_t*)lfs->mlist;
@@ -2358,9 +3400,14 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
         }
 
         // get next slot and create entry to remember name
+        lfs_alloc_ack(lfs);
+        uint32_t hash = lfs_tole32(lfs_namehash(path, nlen));
         err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
                 {LFS_MKTAG(LFS_TYPE_CREATE, file->id, 0), NULL},
                 {LFS_MKTAG(LFS_TYPE_REG, file->id, nlen), path},
+                {lfs_namehash_isenabled(lfs)
+                    ? LFS_MKTAG(LFS_TYPE_NAMEHASH, file->id, 4)
+                    : LFS_MKTAG(LFS_FROM_NOOP, 0, 0), &hash},
                 {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0), NULL}));
         if (err) {
             err = LFS_ERR_NAMETOOLONG;
@@ -2427,6 +3474,13 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
     // zero to avoid information leak
     lfs_cache_zero(lfs, &file->cache);
 
+    // files pick their layout when they get their first blocks
+    if (lfs_tag_type3(tag) == LFS_TYPE_IDXSTRUCT ||
+            (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT &&
+                file->cfg->layout == LFS_LAYOUT_INDEXED)) {
+        file->flags |= LFS_F_INDEXED;
+    }
+
     if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
         // load inline files
         file->ctz.head = LFS_BLOCK_INLINE;
@@ -2450,14 +3504,14 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
         }
     }
 
-    LFS_TRACE("lfs_file_opencfg -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_OPENCFG, "lfs_file_opencfg -> %d", 0);
     return 0;
 
 cleanup:
     // clean up lingering resources
     file->flags |= LFS_F_ERRED;
     lfs_file_close(lfs, file);
-    LFS_TRACE("lfs_file_opencfg -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_OPENCFG, "lfs_file_opencfg -> %d", err);
     return err;
 }
 
@@ -2465,14 +3519,17 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags) {
     LFS_TRACE("lfs_file_open(%p, %p, \"%s\", %x)",
             (void*)lfs, (void*)file, path, flags);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_OPEN,
+            (uint32_t)(uintptr_t)file, flags, 0);
     static const struct lfs_file_config defaults = {0};
     int err = lfs_file_opencfg(lfs, file, path, flags, &defaults);
-    LFS_TRACE("lfs_file_open -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_OPEN, "lfs_file_open -> %d", err);
     return err;
 }
 
 int lfs_file_close(lfs_t *lfs, lfs_file_t *file) {
     LFS_TRACE("lfs_file_close(%p, %p)", (void*)lfs, (void*)file);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_CLOSE, (uint32_t)(uintptr_t)file, 0, 0);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
 
     int err = lfs_file_sync(lfs, file);
@@ -2491,17 +3548,18 @@ int lfs_file_close(lfs_t *lfs, lfs_file_t *file) {
     }
 
     file->flags &= ~LFS_F_OPENED;
-    LFS_TRACE("lfs_file_close -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_CLOSE, "lfs_file_close -> %d", err);
     return err;
 }
 
-static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
+static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file,
+        lfs_block_t prev) {
     LFS_ASSERT(file->flags & LFS_F_OPENED);
 
     while (true) {
-        // just relocate what exists into new block
+        // just relocate what exists into new block, near prev if we can
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        int err = lfs_alloc_file(lfs, &file->reserve, prev, &nblock);
         if (err) {
             return err;
         }
@@ -2527,6 +3585,9 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
                 if (err) {
                     return err;
                 }
+            } else if (file->block == LFS_BLOCK_NULL) {
+                // copying from a hole in an indexed file
+                data = 0;
             } else {
                 err = lfs_bd_read(lfs,
                         &file->cache, &lfs->rcache, file->off-i,
@@ -2560,21 +3621,146 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
 
 relocate:
         LFS_DEBUG("Bad block at %"PRIx32, nblock);
+        LFS_STATS_ADD(lfs, bad_blocks, 1);
+        LFS_TRACE_EVENT(lfs, LFS_TRACE_BAD_BLOCK, nblock, 0, 0);
 
         // just clear cache and try a new block
         lfs_cache_drop(lfs, &lfs->pcache);
     }
 }
 
-static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file) {
-    file->off = file->pos;
-    lfs_alloc_ack(lfs);
-    int err = lfs_file_relocate(lfs, file);
-    if (err) {
-        return err;
+static int lfs_file_idxbegin(lfs_t *lfs, lfs_file_t *file,
+        lfs_block_t prev) {
+    // the part of the old block before our position is copied over by
+    // relocating it into a new block, past the end there is nothing to copy
+    file->block = LFS_BLOCK_NULL;
+    file->off = 0;
+    if (file->pos - file->pos % lfs->cfg->block_size < file->ctz.size) {
+        int err = lfs_idx_find(lfs, NULL, &lfs->rcache,
+                file->ctz.head, file->ctz.size,
+                file->pos, &file->block, &file->off);
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs_cache_drop(lfs, &file->cache);
+    return lfs_file_relocate(lfs, file, prev);
+}
+
+static int lfs_file_idxcommit(lfs_t *lfs, lfs_file_t *file) {
+    lfs_off_t base = file->pos - file->off;
+
+    if (file->pos < file->ctz.size) {
+        // copy over the rest of the old block
+        lfs_block_t oblock;
+        lfs_off_t ooff;
+        int err = lfs_idx_find(lfs, NULL, &lfs->rcache,
+                file->ctz.head, file->ctz.size,
+                base, &oblock, &ooff);
+        if (err) {
+            return err;
+        }
+
+        lfs_off_t end = lfs_min(lfs->cfg->block_size, file->ctz.size - base);
+        while (file->off < end) {
+            uint8_t data[LFS_COPY_SIZE];
+            lfs_size_t diff = lfs_min(end - file->off, sizeof(data));
+            if (oblock == LFS_BLOCK_NULL) {
+                memset(data, 0, diff);
+            } else {
+                err = lfs_bd_read(lfs, NULL, &lfs->rcache, end - file->off,
+                        oblock, file->off, data, diff);
+                if (err) {
+                    return err;
+                }
+            }
+
+            while (true) {
+                err = lfs_bd_prog(lfs, &file->cache, &lfs->rcache, true,
+                        file->block, file->off, data, diff);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate;
+                    }
+                    return err;
+                }
+
+                break;
+relocate:
+                err = lfs_file_relocate(lfs, file, file->block);
+                if (err) {
+                    return err;
+                }
+            }
+
+            file->off += diff;
+        }
+    }
+
+    // write out what we have
+    while (true) {
+        int err = lfs_bd_flush(lfs, &file->cache, &lfs->rcache, true);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate_flush;
+            }
+            return err;
+        }
+
+        break;
+
+relocate_flush:
+        LFS_DEBUG("Bad block at %"PRIx32, file->block);
+        LFS_STATS_ADD(lfs, bad_blocks, 1);
+        LFS_TRACE_EVENT(lfs, LFS_TRACE_BAD_BLOCK, file->block, 0, 0);
+        err = lfs_file_relocate(lfs, file, file->block);
+        if (err) {
+            return err;
+        }
+    }
+
+    // point the index at the new block, this only rewrites its path
+    lfs_block_t head = file->ctz.head;
+    int err = lfs_idx_set(lfs, &head, file->ctz.size,
+            base / lfs->cfg->block_size, file->block);
+    if (err) {
+        return err;
+    }
+
+    file->ctz.head = head;
+    file->ctz.size = lfs_max(file->ctz.size, base + file->off);
+    file->flags &= ~LFS_F_WRITING;
+    file->flags |= LFS_F_DIRTY;
+    return 0;
+}
+
+static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file) {
+    lfs_off_t pos = file->pos;
+    if (file->flags & LFS_F_INDEXED) {
+        // indexed files can't copy the rest of the block from the inline
+        // data later, so take all of it now
+        file->pos = lfs_max(file->pos, file->ctz.size);
+    }
+
+    file->off = file->pos;
+    lfs_alloc_ack(lfs);
+    int err = lfs_file_relocate(lfs, file, LFS_BLOCK_NULL);
+    if (err) {
+        return err;
     }
 
     file->flags &= ~LFS_F_INLINE;
+
+    if (file->pos != pos) {
+        err = lfs_file_idxcommit(lfs, file);
+        if (err) {
+            return err;
+        }
+
+        file->pos = pos;
+    }
+
     return 0;
 }
 
@@ -2588,6 +3774,15 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
         file->flags &= ~LFS_F_READING;
     }
 
+    if ((file->flags & LFS_F_WRITING) && (file->flags & LFS_F_INDEXED) &&
+            !(file->flags & LFS_F_INLINE)) {
+        // only the current block needs to be written out
+        int err = lfs_file_idxcommit(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+
     if (file->flags & LFS_F_WRITING) {
         lfs_off_t pos = file->pos;
 
@@ -2603,15 +3798,26 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
             lfs_cache_drop(lfs, &lfs->rcache);
 
             while (file->pos < file->ctz.size) {
-                // copy over a byte at a time, leave it up to caching
-                // to make this efficient
-                uint8_t data;
-                lfs_ssize_t res = lfs_file_read(lfs, &orig, &data, 1);
+                // copy over a chunk at a time, leave it up to caching
+                // to make this efficient, lfs_file_write takes care of
+                // the skip-list when a chunk crosses into a new block
+                uint8_t data[LFS_COPY_SIZE];
+                lfs_size_t diff = lfs_min(file->ctz.size - file->pos,
+                        sizeof(data));
+                if (file->cache.block == file->block &&
+                        file->off < file->cache.off + lfs->cfg->cache_size) {
+                    // end the chunk where our cache fills up and is
+                    // written out, which drops the rcache we read from
+                    diff = lfs_min(diff, file->cache.off +
+                            lfs->cfg->cache_size - file->off);
+                }
+
+                lfs_ssize_t res = lfs_file_read(lfs, &orig, data, diff);
                 if (res < 0) {
                     return res;
                 }
 
-                res = lfs_file_write(lfs, file, &data, 1);
+                res = lfs_file_write(lfs, file, data, res);
                 if (res < 0) {
                     return res;
                 }
@@ -2637,7 +3843,9 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
 
 relocate:
                 LFS_DEBUG("Bad block at %"PRIx32, file->block);
-                err = lfs_file_relocate(lfs, file);
+                LFS_STATS_ADD(lfs, bad_blocks, 1);
+                LFS_TRACE_EVENT(lfs, LFS_TRACE_BAD_BLOCK, file->block, 0, 0);
+                err = lfs_file_relocate(lfs, file, file->block);
                 if (err) {
                     return err;
                 }
@@ -2660,13 +3868,15 @@ relocate:
 
 int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
     LFS_TRACE("lfs_file_sync(%p, %p)", (void*)lfs, (void*)file);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_SYNC, (uint32_t)(uintptr_t)file, 0, 0);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
 
     while (true) {
         int err = lfs_file_flush(lfs, file);
         if (err) {
             file->flags |= LFS_F_ERRED;
-            LFS_TRACE("lfs_file_sync -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SYNC,
+                    "lfs_file_sync -> %d", err);
             return err;
         }
 
@@ -2684,8 +3894,10 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
                 buffer = file->cache.buffer;
                 size = file->ctz.size;
             } else {
-                // update the ctz reference
-                type = LFS_TYPE_CTZSTRUCT;
+                // update the ctz or index reference
+                type = (file->flags & LFS_F_INDEXED)
+                        ? LFS_TYPE_IDXSTRUCT
+                        : LFS_TYPE_CTZSTRUCT;
                 // copy ctz so alloc will work during a relocate
                 ctz = file->ctz;
                 lfs_ctz_tole32(&ctz);
@@ -2693,6 +3905,23 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
                 size = sizeof(ctz);
             }
 
+            // hold back the update if we're batching, committing it
+            // instead would escape an abort, so if it can't be held back
+            // (no memory, custom attributes) we leave the file dirty
+            if (lfs->batch.depth > 0) {
+                err = LFS_ERR_INVAL;
+                if (file->cfg->attr_count == 0) {
+                    err = lfs_batch_stage(lfs, &file->m, file->id,
+                            type, buffer, size);
+                }
+                if (!err) {
+                    file->flags &= ~LFS_F_DIRTY;
+                }
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SYNC,
+                        "lfs_file_sync -> %d", err);
+                return err;
+            }
+
             // commit file data and attributes
             err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
                     {LFS_MKTAG(type, file->id, size), buffer},
@@ -2703,14 +3932,22 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
                     goto relocate;
                 }
                 file->flags |= LFS_F_ERRED;
-                LFS_TRACE("lfs_file_sync -> %d", err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SYNC,
+                        "lfs_file_sync -> %d", err);
                 return err;
             }
 
+            // any held back update is now out of date
+            struct lfs_mpending *p = lfs_mpending_find(lfs,
+                    file->m.pair, file->id);
+            if (p) {
+                lfs_batch_drop(lfs, p);
+            }
+
             file->flags &= ~LFS_F_DIRTY;
         }
 
-        LFS_TRACE("lfs_file_sync -> %d", 0);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SYNC, "lfs_file_sync -> %d", 0);
         return 0;
 
 relocate:
@@ -2718,16 +3955,59 @@ relocate:
         err = lfs_file_outline(lfs, file);
         if (err) {
             file->flags |= LFS_F_ERRED;
-            LFS_TRACE("lfs_file_sync -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SYNC,
+                    "lfs_file_sync -> %d", err);
+            return err;
+        }
+    }
+}
+
+static lfs_ssize_t lfs_file_readrun(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    // find how far the blocks after the current one follow it on disk
+    lfs_size_t run = lfs->cfg->block_size - file->off;
+    lfs_block_t count = 1;
+    while (run < size) {
+        lfs_block_t nblock;
+        lfs_off_t noff;
+        int err = lfs_idx_find(lfs, NULL, &file->cache,
+                file->ctz.head, file->ctz.size,
+                file->pos + run, &nblock, &noff);
+        if (err) {
             return err;
         }
+
+        if (nblock != file->block + count) {
+            break;
+        }
+
+        run += lfs_min(size - run, lfs->cfg->block_size);
+        count += 1;
+    }
+
+    // not worth it for one block, the rest is read through the cache
+    run = lfs_aligndown(run, lfs->cfg->read_size);
+    if (count == 1 || run <= lfs->cfg->block_size - file->off) {
+        return 0;
+    }
+
+    int err = lfs_bd_readlinear(lfs, file->block, file->off, buffer, run);
+    if (err) {
+        return err;
     }
+
+    lfs_off_t end = file->off + run;
+    file->block += (end-1) / lfs->cfg->block_size;
+    file->off = end - lfs->cfg->block_size*((end-1) / lfs->cfg->block_size);
+    return run;
 }
 
 lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
     LFS_TRACE("lfs_file_read(%p, %p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, buffer, size);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_READ,
+            (uint32_t)(uintptr_t)file, size, file->pos);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
     LFS_ASSERT((file->flags & 3) != LFS_O_WRONLY);
 
@@ -2738,14 +4018,15 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         // flush out any writes
         int err = lfs_file_flush(lfs, file);
         if (err) {
-            LFS_TRACE("lfs_file_read -> %"PRId32, err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_READ,
+                    "lfs_file_read -> %"PRId32, err);
             return err;
         }
     }
 
     if (file->pos >= file->ctz.size) {
         // eof if past end
-        LFS_TRACE("lfs_file_read -> %"PRId32, 0);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_READ, "lfs_file_read -> %"PRId32, 0);
         return 0;
     }
 
@@ -2757,11 +4038,14 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         if (!(file->flags & LFS_F_READING) ||
                 file->off == lfs->cfg->block_size) {
             if (!(file->flags & LFS_F_INLINE)) {
-                int err = lfs_ctz_find(lfs, NULL, &file->cache,
+                int err = ((file->flags & LFS_F_INDEXED)
+                            ? lfs_idx_find
+                            : lfs_ctz_find)(lfs, NULL, &file->cache,
                         file->ctz.head, file->ctz.size,
                         file->pos, &file->block, &file->off);
                 if (err) {
-                    LFS_TRACE("lfs_file_read -> %"PRId32, err);
+                    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_READ,
+                            "lfs_file_read -> %"PRId32, err);
                     return err;
                 }
             } else {
@@ -2772,8 +4056,28 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
             file->flags |= LFS_F_READING;
         }
 
-        // read as much as we can in current block
+        // read as much as we can in current block, or in the blocks after
+        // it if they follow it on disk
         lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
+        if (lfs->cfg->linear_reads && (file->flags & LFS_F_INDEXED) &&
+                !(file->flags & LFS_F_INLINE) &&
+                file->block != LFS_BLOCK_NULL &&
+                file->off % lfs->cfg->read_size == 0 && nsize > diff) {
+            lfs_ssize_t res = lfs_file_readrun(lfs, file, data, nsize);
+            if (res < 0) {
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_READ,
+                        "lfs_file_read -> %"PRId32, res);
+                return res;
+            }
+
+            if (res > 0) {
+                file->pos += res;
+                data += res;
+                nsize -= res;
+                continue;
+            }
+        }
+
         if (file->flags & LFS_F_INLINE) {
             int err = lfs_dir_getread(lfs, &file->m,
                     NULL, &file->cache, lfs->cfg->block_size,
@@ -2781,15 +4085,20 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
                     LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
                     file->off, data, diff);
             if (err) {
-                LFS_TRACE("lfs_file_read -> %"PRId32, err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_READ,
+                        "lfs_file_read -> %"PRId32, err);
                 return err;
             }
+        } else if (file->block == LFS_BLOCK_NULL) {
+            // holes in indexed files read as zeros
+            memset(data, 0, diff);
         } else {
             int err = lfs_bd_read(lfs,
                     NULL, &file->cache, lfs->cfg->block_size,
                     file->block, file->off, data, diff);
             if (err) {
-                LFS_TRACE("lfs_file_read -> %"PRId32, err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_READ,
+                        "lfs_file_read -> %"PRId32, err);
                 return err;
             }
         }
@@ -2800,14 +4109,72 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         nsize -= diff;
     }
 
-    LFS_TRACE("lfs_file_read -> %"PRId32, size);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_READ, "lfs_file_read -> %"PRId32, size);
     return size;
 }
 
+static int lfs_file_zerofill(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
+    static const uint8_t zeros[LFS_COPY_SIZE];
+
+    if ((file->flags & LFS_F_INDEXED) && (file->flags & LFS_F_INLINE) &&
+            file->ctz.size == 0 && size > lfs_min(0x3fe, lfs_min(
+                lfs->cfg->cache_size, lfs->cfg->block_size/8))) {
+        // an empty file that won't stay inline has nothing to move out,
+        // so it can start with a hole
+        lfs_cache_drop(lfs, &file->cache);
+        file->ctz.head = LFS_BLOCK_NULL;
+        file->flags &= ~LFS_F_INLINE;
+    }
+
+    while (file->pos < size) {
+        if ((file->flags & LFS_F_INDEXED) && !(file->flags & LFS_F_INLINE) &&
+                file->pos % lfs->cfg->block_size == 0) {
+            if (file->flags & LFS_F_WRITING) {
+                int err = lfs_file_idxcommit(lfs, file);
+                if (err) {
+                    file->flags |= LFS_F_ERRED;
+                    return err;
+                }
+            }
+
+            // blocks of zeros are left as holes in the index, which are
+            // never programmed and read as zeros, grow over all of them
+            // at once so only the last path of the index is rewritten
+            lfs_alloc_ack(lfs);
+            lfs_block_t head = file->ctz.head;
+            int err = lfs_idx_grow(lfs, &head, file->ctz.size, size);
+            if (err) {
+                file->flags |= LFS_F_ERRED;
+                return err;
+            }
+
+            file->ctz.head = head;
+            file->pos = size;
+            file->ctz.size = size;
+            file->flags |= LFS_F_DIRTY;
+            continue;
+        }
+
+        // write zeros up to the next block so we can catch where holes
+        // start, a write is the same to ctz files
+        lfs_ssize_t res = lfs_file_write(lfs, file, zeros,
+                lfs_min(lfs_min(sizeof(zeros), size - file->pos),
+                    lfs->cfg->block_size
+                        - file->pos % lfs->cfg->block_size));
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    return 0;
+}
+
 lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size) {
     LFS_TRACE("lfs_file_write(%p, %p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, buffer, size);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_WRITE,
+            (uint32_t)(uintptr_t)file, size, file->pos);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
     LFS_ASSERT((file->flags & 3) != LFS_O_RDONLY);
 
@@ -2818,7 +4185,8 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         // drop any reads
         int err = lfs_file_flush(lfs, file);
         if (err) {
-            LFS_TRACE("lfs_file_write -> %"PRId32, err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                    "lfs_file_write -> %"PRId32, err);
             return err;
         }
     }
@@ -2829,7 +4197,8 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
 
     if (file->pos + size > lfs->file_max) {
         // Larger than file limit?
-        LFS_TRACE("lfs_file_write -> %"PRId32, LFS_ERR_FBIG);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                "lfs_file_write -> %"PRId32, LFS_ERR_FBIG);
         return LFS_ERR_FBIG;
     }
 
@@ -2838,12 +4207,11 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         lfs_off_t pos = file->pos;
         file->pos = file->ctz.size;
 
-        while (file->pos < pos) {
-            lfs_ssize_t res = lfs_file_write(lfs, file, &(uint8_t){0}, 1);
-            if (res < 0) {
-                LFS_TRACE("lfs_file_write -> %"PRId32, res);
-                return res;
-            }
+        int err = lfs_file_zerofill(lfs, file, pos);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                    "lfs_file_write -> %"PRId32, err);
+            return err;
         }
     }
 
@@ -2855,7 +4223,8 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         int err = lfs_file_outline(lfs, file);
         if (err) {
             file->flags |= LFS_F_ERRED;
-            LFS_TRACE("lfs_file_write -> %"PRId32, err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                    "lfs_file_write -> %"PRId32, err);
             return err;
         }
     }
@@ -2864,7 +4233,32 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         // check if we need a new block
         if (!(file->flags & LFS_F_WRITING) ||
                 file->off == lfs->cfg->block_size) {
-            if (!(file->flags & LFS_F_INLINE)) {
+            if ((file->flags & LFS_F_INDEXED) &&
+                    !(file->flags & LFS_F_INLINE)) {
+                lfs_block_t prev = LFS_BLOCK_NULL;
+                if (file->flags & LFS_F_WRITING) {
+                    // finished a block, write it out before moving on
+                    int err = lfs_file_idxcommit(lfs, file);
+                    if (err) {
+                        file->flags |= LFS_F_ERRED;
+                        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                                "lfs_file_write -> %"PRId32, err);
+                        return err;
+                    }
+
+                    prev = file->block;
+                }
+
+                // start a copy of the block we're writing to
+                lfs_alloc_ack(lfs);
+                int err = lfs_file_idxbegin(lfs, file, prev);
+                if (err) {
+                    file->flags |= LFS_F_ERRED;
+                    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                            "lfs_file_write -> %"PRId32, err);
+                    return err;
+                }
+            } else if (!(file->flags & LFS_F_INLINE)) {
                 if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
                     // find out which block we're extending from
                     int err = lfs_ctz_find(lfs, NULL, &file->cache,
@@ -2872,7 +4266,8 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
                             file->pos-1, &file->block, &file->off);
                     if (err) {
                         file->flags |= LFS_F_ERRED;
-                        LFS_TRACE("lfs_file_write -> %"PRId32, err);
+                        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                                "lfs_file_write -> %"PRId32, err);
                         return err;
                     }
 
@@ -2883,11 +4278,12 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
                 // extend file with new blocks
                 lfs_alloc_ack(lfs);
                 int err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
-                        file->block, file->pos,
+                        &file->reserve, file->block, file->pos,
                         &file->block, &file->off);
                 if (err) {
                     file->flags |= LFS_F_ERRED;
-                    LFS_TRACE("lfs_file_write -> %"PRId32, err);
+                    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                            "lfs_file_write -> %"PRId32, err);
                     return err;
                 }
             } else {
@@ -2908,16 +4304,18 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
                     goto relocate;
                 }
                 file->flags |= LFS_F_ERRED;
-                LFS_TRACE("lfs_file_write -> %"PRId32, err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                        "lfs_file_write -> %"PRId32, err);
                 return err;
             }
 
             break;
 relocate:
-            err = lfs_file_relocate(lfs, file);
+            err = lfs_file_relocate(lfs, file, file->block);
             if (err) {
                 file->flags |= LFS_F_ERRED;
-                LFS_TRACE("lfs_file_write -> %"PRId32, err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+                        "lfs_file_write -> %"PRId32, err);
                 return err;
             }
         }
@@ -2931,7 +4329,8 @@ relocate:
     }
 
     file->flags &= ~LFS_F_ERRED;
-    LFS_TRACE("lfs_file_write -> %"PRId32, size);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_WRITE,
+            "lfs_file_write -> %"PRId32, size);
     return size;
 }
 
@@ -2939,12 +4338,15 @@ lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
         lfs_soff_t off, int whence) {
     LFS_TRACE("lfs_file_seek(%p, %p, %"PRId32", %d)",
             (void*)lfs, (void*)file, off, whence);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_SEEK,
+            (uint32_t)(uintptr_t)file, off, whence);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
 
     // write out everything beforehand, may be noop if rdonly
     int err = lfs_file_flush(lfs, file);
     if (err) {
-        LFS_TRACE("lfs_file_seek -> %"PRId32, err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SEEK,
+                "lfs_file_seek -> %"PRId32, err);
         return err;
     }
 
@@ -2960,24 +4362,28 @@ lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
 
     if (npos > lfs->file_max) {
         // file position out of range
-        LFS_TRACE("lfs_file_seek -> %"PRId32, LFS_ERR_INVAL);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SEEK,
+                "lfs_file_seek -> %"PRId32, LFS_ERR_INVAL);
         return LFS_ERR_INVAL;
     }
 
     // update pos
     file->pos = npos;
-    LFS_TRACE("lfs_file_seek -> %"PRId32, npos);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SEEK, "lfs_file_seek -> %"PRId32, npos);
     return npos;
 }
 
 int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
     LFS_TRACE("lfs_file_truncate(%p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, size);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_TRUNCATE,
+            (uint32_t)(uintptr_t)file, size, 0);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
     LFS_ASSERT((file->flags & 3) != LFS_O_RDONLY);
 
     if (size > LFS_FILE_MAX) {
-        LFS_TRACE("lfs_file_truncate -> %d", LFS_ERR_INVAL);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE,
+                "lfs_file_truncate -> %d", LFS_ERR_INVAL);
         return LFS_ERR_INVAL;
     }
 
@@ -2987,116 +4393,271 @@ int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
         // need to flush since directly changing metadata
         int err = lfs_file_flush(lfs, file);
         if (err) {
-            LFS_TRACE("lfs_file_truncate -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE,
+                    "lfs_file_truncate -> %d", err);
             return err;
         }
 
-        // lookup new head in ctz skip list
-        err = lfs_ctz_find(lfs, NULL, &file->cache,
-                file->ctz.head, file->ctz.size,
-                size, &file->block, &file->off);
-        if (err) {
-            LFS_TRACE("lfs_file_truncate -> %d", err);
-            return err;
-        }
+        if ((file->flags & LFS_F_INDEXED) && !(file->flags & LFS_F_INLINE)) {
+            // drop the levels of the index we no longer need
+            err = lfs_idx_shrink(lfs, &file->ctz.head, file->ctz.size, size);
+            if (err) {
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE,
+                        "lfs_file_truncate -> %d", err);
+                return err;
+            }
 
-        file->ctz.head = file->block;
-        file->ctz.size = size;
-        file->flags |= LFS_F_DIRTY | LFS_F_READING;
+            file->ctz.size = size;
+            file->flags |= LFS_F_DIRTY;
+        } else {
+            // lookup new head in ctz skip list
+            err = lfs_ctz_find(lfs, NULL, &file->cache,
+                    file->ctz.head, file->ctz.size,
+                    size, &file->block, &file->off);
+            if (err) {
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE,
+                        "lfs_file_truncate -> %d", err);
+                return err;
+            }
+
+            file->ctz.head = file->block;
+            file->ctz.size = size;
+            file->flags |= LFS_F_DIRTY | LFS_F_READING;
+        }
     } else if (size > oldsize) {
         // flush+seek if not already at end
         if (file->pos != oldsize) {
             int err = lfs_file_seek(lfs, file, 0, LFS_SEEK_END);
             if (err < 0) {
-                LFS_TRACE("lfs_file_truncate -> %d", err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE,
+                        "lfs_file_truncate -> %d", err);
                 return err;
             }
         }
 
         // fill with zeros
-        while (file->pos < size) {
-            lfs_ssize_t res = lfs_file_write(lfs, file, &(uint8_t){0}, 1);
-            if (res < 0) {
-                LFS_TRACE("lfs_file_truncate -> %d", res);
-                return res;
-            }
+        int err = lfs_file_zerofill(lfs, file, size);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE,
+                    "lfs_file_truncate -> %d", err);
+            return err;
         }
     }
 
     // restore pos
     int err = lfs_file_seek(lfs, file, pos, LFS_SEEK_SET);
     if (err < 0) {
-      LFS_TRACE("lfs_file_truncate -> %d", err);
+      LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE,
+              "lfs_file_truncate -> %d", err);
       return err;
     }
 
-    LFS_TRACE("lfs_file_truncate -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TRUNCATE, "lfs_file_truncate -> %d", 0);
     return 0;
 }
 
 lfs_soff_t lfs_file_tell(lfs_t *lfs, lfs_file_t *file) {
     LFS_TRACE("lfs_file_tell(%p, %p)", (void*)lfs, (void*)file);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_TELL, (uint32_t)(uintptr_t)file, 0, 0);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
     (void)lfs;
-    LFS_TRACE("lfs_file_tell -> %"PRId32, file->pos);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_TELL,
+            "lfs_file_tell -> %"PRId32, file->pos);
     return file->pos;
 }
 
 int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file) {
     LFS_TRACE("lfs_file_rewind(%p, %p)", (void*)lfs, (void*)file);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_REWIND,
+            (uint32_t)(uintptr_t)file, 0, 0);
     lfs_soff_t res = lfs_file_seek(lfs, file, 0, LFS_SEEK_SET);
     if (res < 0) {
-        LFS_TRACE("lfs_file_rewind -> %d", res);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_REWIND,
+                "lfs_file_rewind -> %d", res);
         return res;
     }
 
-    LFS_TRACE("lfs_file_rewind -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_REWIND, "lfs_file_rewind -> %d", 0);
     return 0;
 }
 
 lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file) {
     LFS_TRACE("lfs_file_size(%p, %p)", (void*)lfs, (void*)file);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_SIZE, (uint32_t)(uintptr_t)file, 0, 0);
     LFS_ASSERT(file->flags & LFS_F_OPENED);
     (void)lfs;
     if (file->flags & LFS_F_WRITING) {
-        LFS_TRACE("lfs_file_size -> %"PRId32,
-                lfs_max(file->pos, file->ctz.size));
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SIZE,
+                "lfs_file_size -> %"PRId32, lfs_max(file->pos, file->ctz.size));
         return lfs_max(file->pos, file->ctz.size);
     } else {
-        LFS_TRACE("lfs_file_size -> %"PRId32, file->ctz.size);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_SIZE,
+                "lfs_file_size -> %"PRId32, file->ctz.size);
         return file->ctz.size;
     }
 }
 
+lfs_ssize_t lfs_file_map(lfs_t *lfs, lfs_file_t *file, lfs_off_t off,
+        lfs_block_t *block, lfs_off_t *boff) {
+    LFS_TRACE("lfs_file_map(%p, %p, %"PRIu32", %p, %p)",
+            (void*)lfs, (void*)file, off, (void*)block, (void*)boff);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_MAP,
+            (uint32_t)(uintptr_t)file, off, 0);
+    LFS_ASSERT(file->flags & LFS_F_OPENED);
+
+    if (file->flags & LFS_F_WRITING) {
+        // the data must be on disk
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_MAP,
+                    "lfs_file_map -> %"PRId32, err);
+            return err;
+        }
+    }
+
+    if (file->flags & LFS_F_INLINE) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_MAP,
+                "lfs_file_map -> %"PRId32, LFS_ERR_INVAL);
+        return LFS_ERR_INVAL;
+    }
+
+    if (off >= file->ctz.size) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_MAP, "lfs_file_map -> %"PRId32, 0);
+        return 0;
+    }
+
+    int err = ((file->flags & LFS_F_INDEXED)
+                ? lfs_idx_find
+                : lfs_ctz_find)(lfs, NULL, &file->cache,
+            file->ctz.head, file->ctz.size,
+            off, block, boff);
+    if (err) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_MAP,
+                "lfs_file_map -> %"PRId32, err);
+        return err;
+    }
+
+    if (*block == LFS_BLOCK_NULL) {
+        // holes have no block either
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_MAP,
+                "lfs_file_map -> %"PRId32, LFS_ERR_INVAL);
+        return LFS_ERR_INVAL;
+    }
+
+    lfs_size_t size = lfs_min(lfs->cfg->block_size - *boff,
+            file->ctz.size - off);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_MAP, "lfs_file_map -> %"PRId32, size);
+    return size;
+}
+
+static lfs_size_t lfs_file_blocks(lfs_t *lfs, lfs_file_t *file,
+        lfs_off_t size) {
+    if (size == 0) {
+        return 0;
+    }
+
+    if (file->flags & LFS_F_INDEXED) {
+        return lfs_idx_count(lfs, size);
+    }
+
+    size -= 1;
+    return lfs_ctz_index(lfs, &size) + 1;
+}
+
+lfs_ssize_t lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
+    LFS_TRACE("lfs_file_reserve(%p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, size);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FILE_RESERVE,
+            (uint32_t)(uintptr_t)file, size, 0);
+    LFS_ASSERT(file->flags & LFS_F_OPENED);
+    LFS_ASSERT((file->flags & 3) != LFS_O_RDONLY);
+
+    // give back what we're holding so it can be found again
+    file->reserve.count = 0;
+
+    if (size > lfs->file_max) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_RESERVE,
+                "lfs_file_reserve -> %"PRId32, LFS_ERR_FBIG);
+        return LFS_ERR_FBIG;
+    }
+
+    // inline files move everything into new blocks, otherwise we keep
+    // what's on disk except an incomplete last block, which is copied
+    // into a new block unless we're already writing it
+    lfs_off_t fsize = (file->flags & LFS_F_WRITING)
+            ? lfs_max(file->pos, file->ctz.size)
+            : file->ctz.size;
+    lfs_size_t have = 0;
+    if (!(file->flags & LFS_F_INLINE)) {
+        have = lfs_file_blocks(lfs, file, fsize);
+        if (have > 0 && !(file->flags & LFS_F_WRITING) &&
+                lfs_file_blocks(lfs, file, fsize+1) == have) {
+            have -= 1;
+        }
+    }
+
+    lfs_size_t need = lfs_file_blocks(lfs, file, size);
+    if (need <= have) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_RESERVE,
+                "lfs_file_reserve -> %"PRId32, 0);
+        return 0;
+    }
+
+    lfs_block_t block = LFS_BLOCK_NULL;
+    lfs_size_t count;
+    int err = lfs_alloc_run(lfs, lfs_min(need - have, lfs->cfg->block_count),
+            &block, &count);
+    if (err) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_RESERVE,
+                "lfs_file_reserve -> %"PRId32, err);
+        return err;
+    }
+
+    if (count == 0) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_RESERVE,
+                "lfs_file_reserve -> %"PRId32, LFS_ERR_NOSPC);
+        return LFS_ERR_NOSPC;
+    }
+
+    file->reserve.block = block;
+    file->reserve.count = count;
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FILE_RESERVE,
+            "lfs_file_reserve -> %"PRId32, count);
+    return count;
+}
+
 
 /// General fs operations ///
 int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info) {
     LFS_TRACE("lfs_stat(%p, \"%s\", %p)", (void*)lfs, path, (void*)info);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_STAT, 0, 0, 0);
     lfs_mdir_t cwd;
     lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
     if (tag < 0) {
-        LFS_TRACE("lfs_stat -> %d", tag);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_STAT, "lfs_stat -> %d", tag);
         return tag;
     }
 
     int err = lfs_dir_getinfo(lfs, &cwd, lfs_tag_id(tag), info);
-    LFS_TRACE("lfs_stat -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_STAT, "lfs_stat -> %d", err);
     return err;
 }
 
 int lfs_remove(lfs_t *lfs, const char *path) {
     LFS_TRACE("lfs_remove(%p, \"%s\")", (void*)lfs, path);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_REMOVE, 0, 0, 0);
     // deorphan if we haven't yet, needed at most once after poweron
     int err = lfs_fs_forceconsistency(lfs);
     if (err) {
-        LFS_TRACE("lfs_remove -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE, "lfs_remove -> %d", err);
         return err;
     }
 
     lfs_mdir_t cwd;
     lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
     if (tag < 0 || lfs_tag_id(tag) == 0x3ff) {
-        LFS_TRACE("lfs_remove -> %d", (tag < 0) ? tag : LFS_ERR_INVAL);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE,
+                "lfs_remove -> %d", (tag < 0) ? tag : LFS_ERR_INVAL);
         return (tag < 0) ? tag : LFS_ERR_INVAL;
     }
 
@@ -3107,19 +4668,20 @@ int lfs_remove(lfs_t *lfs, const char *path) {
         lfs_stag_t res = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x700, 0x3ff, 0),
                 LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), pair);
         if (res < 0) {
-            LFS_TRACE("lfs_remove -> %d", res);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE, "lfs_remove -> %d", res);
             return res;
         }
         lfs_pair_fromle32(pair);
 
         err = lfs_dir_fetch(lfs, &dir, pair);
         if (err) {
-            LFS_TRACE("lfs_remove -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE, "lfs_remove -> %d", err);
             return err;
         }
 
         if (dir.count > 0 || dir.split) {
-            LFS_TRACE("lfs_remove -> %d", LFS_ERR_NOTEMPTY);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE,
+                    "lfs_remove -> %d", LFS_ERR_NOTEMPTY);
             return LFS_ERR_NOTEMPTY;
         }
 
@@ -3128,10 +4690,11 @@ int lfs_remove(lfs_t *lfs, const char *path) {
     }
 
     // delete the entry
+    lfs_alloc_ack(lfs);
     err = lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
             {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(tag), 0), NULL}));
     if (err) {
-        LFS_TRACE("lfs_remove -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE, "lfs_remove -> %d", err);
         return err;
     }
 
@@ -3141,28 +4704,37 @@ int lfs_remove(lfs_t *lfs, const char *path) {
 
         err = lfs_fs_pred(lfs, dir.pair, &cwd);
         if (err) {
-            LFS_TRACE("lfs_remove -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE, "lfs_remove -> %d", err);
             return err;
         }
 
         err = lfs_dir_drop(lfs, &cwd, &dir);
         if (err) {
-            LFS_TRACE("lfs_remove -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE, "lfs_remove -> %d", err);
             return err;
         }
     }
 
-    LFS_TRACE("lfs_remove -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVE, "lfs_remove -> %d", 0);
     return 0;
 }
 
 int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     LFS_TRACE("lfs_rename(%p, \"%s\", \"%s\")", (void*)lfs, oldpath, newpath);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_RENAME, 0, 0, 0);
+
+    // a move would lose the held back update of what it moves, and
+    // writing the updates out first would leave nothing for an abort
+    if (lfs->batch.count > 0) {
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME,
+                "lfs_rename -> %d", LFS_ERR_INVAL);
+        return LFS_ERR_INVAL;
+    }
 
     // deorphan if we haven't yet, needed at most once after poweron
     int err = lfs_fs_forceconsistency(lfs);
     if (err) {
-        LFS_TRACE("lfs_rename -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", err);
         return err;
     }
 
@@ -3170,7 +4742,8 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     lfs_mdir_t oldcwd;
     lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
     if (oldtag < 0 || lfs_tag_id(oldtag) == 0x3ff) {
-        LFS_TRACE("lfs_rename -> %d", (oldtag < 0) ? oldtag : LFS_ERR_INVAL);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME,
+                "lfs_rename -> %d", (oldtag < 0) ? oldtag : LFS_ERR_INVAL);
         return (oldtag < 0) ? oldtag : LFS_ERR_INVAL;
     }
 
@@ -3180,7 +4753,8 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     lfs_stag_t prevtag = lfs_dir_find(lfs, &newcwd, &newpath, &newid);
     if ((prevtag < 0 || lfs_tag_id(prevtag) == 0x3ff) &&
             !(prevtag == LFS_ERR_NOENT && newid != 0x3ff)) {
-        LFS_TRACE("lfs_rename -> %d", (prevtag < 0) ? prevtag : LFS_ERR_INVAL);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME,
+                "lfs_rename -> %d", (prevtag < 0) ? prevtag : LFS_ERR_INVAL);
         return (prevtag < 0) ? prevtag : LFS_ERR_INVAL;
     }
 
@@ -3189,11 +4763,13 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         // check that name fits
         lfs_size_t nlen = strlen(newpath);
         if (nlen > lfs->name_max) {
-            LFS_TRACE("lfs_rename -> %d", LFS_ERR_NAMETOOLONG);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME,
+                    "lfs_rename -> %d", LFS_ERR_NAMETOOLONG);
             return LFS_ERR_NAMETOOLONG;
         }
     } else if (lfs_tag_type3(prevtag) != lfs_tag_type3(oldtag)) {
-        LFS_TRACE("lfs_rename -> %d", LFS_ERR_ISDIR);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME,
+                "lfs_rename -> %d", LFS_ERR_ISDIR);
         return LFS_ERR_ISDIR;
     } else if (lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
         // must be empty before removal
@@ -3201,7 +4777,7 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         lfs_stag_t res = lfs_dir_get(lfs, &newcwd, LFS_MKTAG(0x700, 0x3ff, 0),
                 LFS_MKTAG(LFS_TYPE_STRUCT, newid, 8), prevpair);
         if (res < 0) {
-            LFS_TRACE("lfs_rename -> %d", res);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", res);
             return res;
         }
         lfs_pair_fromle32(prevpair);
@@ -3209,12 +4785,13 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         // must be empty before removal
         err = lfs_dir_fetch(lfs, &prevdir, prevpair);
         if (err) {
-            LFS_TRACE("lfs_rename -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", err);
             return err;
         }
 
         if (prevdir.count > 0 || prevdir.split) {
-            LFS_TRACE("lfs_rename -> %d", LFS_ERR_NOTEMPTY);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME,
+                    "lfs_rename -> %d", LFS_ERR_NOTEMPTY);
             return LFS_ERR_NOTEMPTY;
         }
 
@@ -3235,6 +4812,8 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     lfs_fs_prepmove(lfs, newoldtagid, oldcwd.pair);
 
     // move over all attributes
+    lfs_alloc_ack(lfs);
+    uint32_t hash = lfs_tole32(lfs_namehash(newpath, strlen(newpath)));
     err = lfs_dir_commit(lfs, &newcwd, LFS_MKATTRS(
             {prevtag != LFS_ERR_NOENT
                 ? LFS_MKTAG(LFS_TYPE_DELETE, newid, 0)
@@ -3242,18 +4821,23 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
             {LFS_MKTAG(LFS_TYPE_CREATE, newid, 0), NULL},
             {LFS_MKTAG(lfs_tag_type3(oldtag), newid, strlen(newpath)),
                 newpath},
+            {lfs_namehash_isenabled(lfs)
+                ? LFS_MKTAG(LFS_TYPE_NAMEHASH, newid, 4)
+                : LFS_MKTAG(LFS_FROM_NOOP, 0, 0), &hash},
             {LFS_MKTAG(LFS_FROM_MOVE, newid, lfs_tag_id(oldtag)), &oldcwd}));
     if (err) {
-        LFS_TRACE("lfs_rename -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", err);
         return err;
     }
 
     // let commit clean up after move (if we're different! otherwise move
-    // logic already fixed it for us)
-    if (lfs_pair_cmp(oldcwd.pair, newcwd.pair) != 0) {
+    // logic already fixed it for us), a relocation may also have committed
+    // to the old pair, which fixes the move and leaves oldcwd outdated
+    if (lfs_pair_cmp(oldcwd.pair, newcwd.pair) != 0 &&
+            lfs_gstate_hasmovehere(&lfs->gpending, oldcwd.pair)) {
         err = lfs_dir_commit(lfs, &oldcwd, NULL, 0);
         if (err) {
-            LFS_TRACE("lfs_rename -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", err);
             return err;
         }
     }
@@ -3264,18 +4848,18 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
 
         err = lfs_fs_pred(lfs, prevdir.pair, &newcwd);
         if (err) {
-            LFS_TRACE("lfs_rename -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", err);
             return err;
         }
 
         err = lfs_dir_drop(lfs, &newcwd, &prevdir);
         if (err) {
-            LFS_TRACE("lfs_rename -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", err);
             return err;
         }
     }
 
-    LFS_TRACE("lfs_rename -> %d", 0);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_RENAME, "lfs_rename -> %d", 0);
     return 0;
 }
 
@@ -3283,10 +4867,11 @@ lfs_ssize_t lfs_getattr(lfs_t *lfs, const char *path,
         uint8_t type, void *buffer, lfs_size_t size) {
     LFS_TRACE("lfs_getattr(%p, \"%s\", %"PRIu8", %p, %"PRIu32")",
             (void*)lfs, path, type, buffer, size);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_GETATTR, type, size, 0);
     lfs_mdir_t cwd;
     lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
     if (tag < 0) {
-        LFS_TRACE("lfs_getattr -> %"PRId32, tag);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_GETATTR, "lfs_getattr -> %"PRId32, tag);
         return tag;
     }
 
@@ -3296,7 +4881,8 @@ lfs_ssize_t lfs_getattr(lfs_t *lfs, const char *path,
         id = 0;
         int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
         if (err) {
-            LFS_TRACE("lfs_getattr -> %"PRId32, err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_GETATTR,
+                    "lfs_getattr -> %"PRId32, err);
             return err;
         }
     }
@@ -3307,21 +4893,27 @@ lfs_ssize_t lfs_getattr(lfs_t *lfs, const char *path,
             buffer);
     if (tag < 0) {
         if (tag == LFS_ERR_NOENT) {
-            LFS_TRACE("lfs_getattr -> %"PRId32, LFS_ERR_NOATTR);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_GETATTR,
+                    "lfs_getattr -> %"PRId32, LFS_ERR_NOATTR);
             return LFS_ERR_NOATTR;
         }
 
-        LFS_TRACE("lfs_getattr -> %"PRId32, tag);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_GETATTR, "lfs_getattr -> %"PRId32, tag);
         return tag;
     }
 
     size = lfs_tag_size(tag);
-    LFS_TRACE("lfs_getattr -> %"PRId32, size);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_GETATTR, "lfs_getattr -> %"PRId32, size);
     return size;
 }
 
 static int lfs_commitattr(lfs_t *lfs, const char *path,
         uint8_t type, const void *buffer, lfs_size_t size) {
+    int err = lfs_fs_uncheckpoint(lfs);
+    if (err) {
+        return err;
+    }
+
     lfs_mdir_t cwd;
     lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
     if (tag < 0) {
@@ -3332,12 +4924,13 @@ static int lfs_commitattr(lfs_t *lfs, const char *path,
     if (id == 0x3ff) {
         // special case for root
         id = 0;
-        int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
+        err = lfs_dir_fetch(lfs, &cwd, lfs->root);
         if (err) {
             return err;
         }
     }
 
+    lfs_alloc_ack(lfs);
     return lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
             {LFS_MKTAG(LFS_TYPE_USERATTR + type, id, size), buffer}));
 }
@@ -3346,20 +4939,23 @@ int lfs_setattr(lfs_t *lfs, const char *path,
         uint8_t type, const void *buffer, lfs_size_t size) {
     LFS_TRACE("lfs_setattr(%p, \"%s\", %"PRIu8", %p, %"PRIu32")",
             (void*)lfs, path, type, buffer, size);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_SETATTR, type, size, 0);
     if (size > lfs->attr_max) {
-        LFS_TRACE("lfs_setattr -> %d", LFS_ERR_NOSPC);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_SETATTR,
+                "lfs_setattr -> %d", LFS_ERR_NOSPC);
         return LFS_ERR_NOSPC;
     }
 
     int err = lfs_commitattr(lfs, path, type, buffer, size);
-    LFS_TRACE("lfs_setattr -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_SETATTR, "lfs_setattr -> %d", err);
     return err;
 }
 
 int lfs_removeattr(lfs_t *lfs, const char *path, uint8_t type) {
     LFS_TRACE("lfs_removeattr(%p, \"%s\", %"PRIu8")", (void*)lfs, path, type);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_REMOVEATTR, type, 0, 0);
     int err = lfs_commitattr(lfs, path, type, NULL, 0x3ff);
-    LFS_TRACE("lfs_removeattr -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_REMOVEATTR, "lfs_removeattr -> %d", err);
     return err;
 }
 
@@ -3379,6 +4975,10 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     LFS_ASSERT(4*lfs_npw2(LFS_BLOCK_NULL / (lfs->cfg->block_size-2*4))
             <= lfs->cfg->block_size);
 
+    // check that the split size and compaction threshold fit in a block
+    LFS_ASSERT(lfs->cfg->split_size <= lfs->cfg->block_size);
+    LFS_ASSERT(lfs->cfg->compact_thresh <= lfs->cfg->block_size);
+
     // block_cycles = 0 is no longer supported.
     //
     // block_cycles is the number of erase cycles before littlefs evicts
@@ -3428,10 +5028,30 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
         }
     }
 
-    // check that the size limits are sane
-    LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
-    lfs->name_max = lfs->cfg->name_max;
-    if (!lfs->name_max) {
+    // setup the tag index, 32-bit aligned
+    LFS_ASSERT((uintptr_t)lfs->cfg->tag_index_buffer % 4 == 0);
+    lfs->tindex.block = LFS_BLOCK_NULL;
+    lfs->tindex.off = 0;
+    lfs->tindex.count = 0;
+    lfs->tindex.size = lfs->cfg->tag_index_size
+            / (2*sizeof(struct lfs_tentry));
+    lfs->tindex.entries = NULL;
+    if (lfs->tindex.size) {
+        if (lfs->cfg->tag_index_buffer) {
+            lfs->tindex.entries = lfs->cfg->tag_index_buffer;
+        } else {
+            lfs->tindex.entries = lfs_malloc(lfs->cfg->tag_index_size);
+            if (!lfs->tindex.entries) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+
+    // check that the size limits are sane
+    LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
+    lfs->name_max = lfs->cfg->name_max;
+    if (!lfs->name_max) {
         lfs->name_max = LFS_NAME_MAX;
     }
 
@@ -3452,9 +5072,16 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->root[1] = LFS_BLOCK_NULL;
     lfs->mlist = NULL;
     lfs->seed = 0;
+    lfs->batch = (struct lfs_batch){0};
+#ifdef LFS_YES_STATS
+    lfs->stats = (struct lfs_stats){0};
+#endif
     lfs->gstate = (struct lfs_gstate){0};
     lfs->gpending = (struct lfs_gstate){0};
     lfs->gdelta = (struct lfs_gstate){0};
+    lfs->checkpoint = LFS_CHECKPOINT_OFF;
+    lfs->disk_version = 0x00020000;
+    lfs->features = 0;
 #ifdef LFS_MIGRATE
     lfs->lfs1 = NULL;
 #endif
@@ -3480,6 +5107,10 @@ static int lfs_deinit(lfs_t *lfs) {
         lfs_free(lfs->free.buffer);
     }
 
+    if (!lfs->cfg->tag_index_buffer) {
+        lfs_free(lfs->tindex.entries);
+    }
+
     return 0;
 }
 
@@ -3492,22 +5123,42 @@ int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
                 ".lookahead_size=%"PRIu32", .read_buffer=%p, "
                 ".prog_buffer=%p, .lookahead_buffer=%p, "
                 ".name_max=%"PRIu32", .file_max=%"PRIu32", "
-                ".attr_max=%"PRIu32"})",
+                ".attr_max=%"PRIu32", .name_hash=%d, .indexed_files=%d, "
+                ".mount_checkpoint=%d, .split_size=%"PRIu32", "
+                ".compact_thresh=%"PRIu32"})",
             (void*)lfs, (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
-            cfg->name_max, cfg->file_max, cfg->attr_max);
+            cfg->name_max, cfg->file_max, cfg->attr_max, cfg->name_hash,
+            cfg->indexed_files, cfg->mount_checkpoint, cfg->split_size,
+            cfg->compact_thresh);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FORMAT,
+            cfg->block_size, cfg->block_count, 0);
     int err = 0;
     {
         err = lfs_init(lfs, cfg);
         if (err) {
-            LFS_TRACE("lfs_format -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FORMAT, "lfs_format -> %d", err);
             return err;
         }
 
+        // only use optional on-disk features if asked to
+        if (lfs->cfg->name_hash) {
+            lfs->features |= LFS_FEATURE_NAMEHASH;
+        }
+        if (lfs->cfg->indexed_files) {
+            lfs->features |= LFS_FEATURE_INDEXED;
+        }
+        if (lfs->cfg->mount_checkpoint) {
+            lfs->features |= LFS_FEATURE_CHECKPOINT;
+        }
+        if (lfs->features) {
+            lfs->disk_version = LFS_DISK_VERSION_FEATURES;
+        }
+
         // create free lookahead
         memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
         lfs->free.off = 0;
@@ -3525,20 +5176,27 @@ int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
 
         // write one superblock
         lfs_superblock_t superblock = {
-            .version     = LFS_DISK_VERSION,
+            .version     = lfs->disk_version,
             .block_size  = lfs->cfg->block_size,
             .block_count = lfs->cfg->block_count,
             .name_max    = lfs->name_max,
             .file_max    = lfs->file_max,
             .attr_max    = lfs->attr_max,
+            .features    = lfs->features,
         };
 
+        // and a checkpoint of the still empty global state
         lfs_superblock_tole32(&superblock);
         err = lfs_dir_commit(lfs, &root, LFS_MKATTRS(
                 {LFS_MKTAG(LFS_TYPE_CREATE, 0, 0), NULL},
                 {LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8), "littlefs"},
-                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
-                    &superblock}));
+                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0,
+                    lfs_superblock_size(lfs)), &superblock},
+                {lfs_checkpoint_isenabled(lfs)
+                    ? LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0,
+                        sizeof(struct lfs_gstate))
+                    : LFS_MKTAG(LFS_FROM_NOOP, 0, 0),
+                    &(struct lfs_gstate){0}}));
         if (err) {
             goto cleanup;
         }
@@ -3560,7 +5218,7 @@ int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
 
 cleanup:
     lfs_deinit(lfs);
-    LFS_TRACE("lfs_format -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FORMAT, "lfs_format -> %d", err);
     return err;
 }
 
@@ -3573,28 +5231,34 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
                 ".lookahead_size=%"PRIu32", .read_buffer=%p, "
                 ".prog_buffer=%p, .lookahead_buffer=%p, "
                 ".name_max=%"PRIu32", .file_max=%"PRIu32", "
-                ".attr_max=%"PRIu32"})",
+                ".attr_max=%"PRIu32", .name_hash=%d, .indexed_files=%d, "
+                ".mount_checkpoint=%d, .split_size=%"PRIu32", "
+                ".compact_thresh=%"PRIu32"})",
             (void*)lfs, (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
-            cfg->name_max, cfg->file_max, cfg->attr_max);
+            cfg->name_max, cfg->file_max, cfg->attr_max, cfg->name_hash,
+            cfg->indexed_files, cfg->mount_checkpoint, cfg->split_size,
+            cfg->compact_thresh);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_MOUNT, cfg->block_size, cfg->block_count, 0);
     int err = lfs_init(lfs, cfg);
     if (err) {
-        LFS_TRACE("lfs_mount -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MOUNT, "lfs_mount -> %d", err);
         return err;
     }
 
     // scan directory blocks for superblock and any global updates
+    uint8_t checkpoint = LFS_CHECKPOINT_OFF;
     lfs_mdir_t dir = {.tail = {0, 1}};
     while (!lfs_pair_isnull(dir.tail)) {
         // fetch next block in tail list
         lfs_stag_t tag = lfs_dir_fetchmatch(lfs, &dir, dir.tail,
                 LFS_MKTAG(0x7ff, 0x3ff, 0),
                 LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8),
-                NULL,
+                NULL, NULL,
                 lfs_dir_find_match, &(struct lfs_dir_find_match){
                     lfs, "littlefs", 8});
         if (tag < 0) {
@@ -3630,6 +5294,17 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
                 goto cleanup;
             }
 
+            // check features, older superblocks read them as zero
+            if (superblock.features & ~LFS_FEATURES) {
+                LFS_ERROR("Unsupported features 0x%"PRIx32,
+                        superblock.features & ~LFS_FEATURES);
+                err = LFS_ERR_INVAL;
+                goto cleanup;
+            }
+
+            lfs->disk_version = superblock.version;
+            lfs->features = superblock.features;
+
             // check superblock configuration
             if (superblock.name_max) {
                 if (superblock.name_max > lfs->name_max) {
@@ -3663,6 +5338,29 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
 
                 lfs->attr_max = superblock.attr_max;
             }
+
+            // has a current checkpoint? then it already holds the global
+            // state of every metadata pair and we can stop here
+            if (lfs_checkpoint_isenabled(lfs)) {
+                struct lfs_gstate gstate;
+                tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                        LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0, sizeof(gstate)),
+                        &gstate);
+                if (tag < 0 && tag != LFS_ERR_NOENT) {
+                    err = tag;
+                    goto cleanup;
+                }
+
+                if (tag != LFS_ERR_NOENT) {
+                    lfs_gstate_fromle32(&gstate);
+                    lfs->gpending = gstate;
+                    checkpoint = LFS_CHECKPOINT_VALID;
+                    break;
+                }
+
+                // write one once we get the chance
+                checkpoint = LFS_CHECKPOINT_IDLE;
+            }
         }
 
         // has gstate?
@@ -3694,19 +5392,33 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->free.i = 0;
     lfs_alloc_ack(lfs);
 
-    LFS_TRACE("lfs_mount -> %d", 0);
+    lfs->checkpoint = checkpoint;
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_MOUNT, "lfs_mount -> %d", 0);
     return 0;
 
 cleanup:
     lfs_unmount(lfs);
-    LFS_TRACE("lfs_mount -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_MOUNT, "lfs_mount -> %d", err);
     return err;
 }
 
 int lfs_unmount(lfs_t *lfs) {
     LFS_TRACE("lfs_unmount(%p)", (void*)lfs);
-    int err = lfs_deinit(lfs);
-    LFS_TRACE("lfs_unmount -> %d", err);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_UNMOUNT, 0, 0, 0);
+    // write out anything a batch is still holding back
+    int err = lfs_batch_flush(lfs);
+    lfs_batch_clear(lfs);
+
+    // and checkpoint whatever changed for the next mount
+    if (!err) {
+        err = lfs_fs_checkpoint(lfs);
+    }
+
+    int res = lfs_deinit(lfs);
+    if (res) {
+        err = res;
+    }
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_UNMOUNT, "lfs_unmount -> %d", err);
     return err;
 }
 
@@ -3716,6 +5428,7 @@ int lfs_fs_traverse(lfs_t *lfs,
         int (*cb)(void *data, lfs_block_t block), void *data) {
     LFS_TRACE("lfs_fs_traverse(%p, %p, %p)",
             (void*)lfs, (void*)(uintptr_t)cb, data);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_TRAVERSE, 0, 0, 0);
     // iterate over metadata pairs
     lfs_mdir_t dir = {.tail = {0, 1}};
 
@@ -3724,7 +5437,8 @@ int lfs_fs_traverse(lfs_t *lfs,
     if (lfs->lfs1) {
         int err = lfs1_traverse(lfs, cb, data);
         if (err) {
-            LFS_TRACE("lfs_fs_traverse -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                    "lfs_fs_traverse -> %d", err);
             return err;
         }
 
@@ -3737,7 +5451,8 @@ int lfs_fs_traverse(lfs_t *lfs,
         for (int i = 0; i < 2; i++) {
             int err = cb(data, dir.tail[i]);
             if (err) {
-                LFS_TRACE("lfs_fs_traverse -> %d", err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                        "lfs_fs_traverse -> %d", err);
                 return err;
             }
         }
@@ -3745,7 +5460,8 @@ int lfs_fs_traverse(lfs_t *lfs,
         // iterate through ids in directory
         int err = lfs_dir_fetch(lfs, &dir, dir.tail);
         if (err) {
-            LFS_TRACE("lfs_fs_traverse -> %d", err);
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                    "lfs_fs_traverse -> %d", err);
             return err;
         }
 
@@ -3757,7 +5473,8 @@ int lfs_fs_traverse(lfs_t *lfs,
                 if (tag == LFS_ERR_NOENT) {
                     continue;
                 }
-                LFS_TRACE("lfs_fs_traverse -> %d", tag);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                        "lfs_fs_traverse -> %d", tag);
                 return tag;
             }
             lfs_ctz_fromle32(&ctz);
@@ -3766,7 +5483,16 @@ int lfs_fs_traverse(lfs_t *lfs,
                 err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
                         ctz.head, ctz.size, cb, data);
                 if (err) {
-                    LFS_TRACE("lfs_fs_traverse -> %d", err);
+                    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                            "lfs_fs_traverse -> %d", err);
+                    return err;
+                }
+            } else if (lfs_tag_type3(tag) == LFS_TYPE_IDXSTRUCT) {
+                err = lfs_idx_traverse(lfs, NULL, &lfs->rcache,
+                        ctz.head, ctz.size, cb, data);
+                if (err) {
+                    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                            "lfs_fs_traverse -> %d", err);
                     return err;
                 }
             }
@@ -3780,25 +5506,64 @@ int lfs_fs_traverse(lfs_t *lfs,
         }
 
         if ((f->flags & LFS_F_DIRTY) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
+            int err = ((f->flags & LFS_F_INDEXED)
+                        ? lfs_idx_traverse
+                        : lfs_ctz_traverse)(lfs, &f->cache, &lfs->rcache,
                     f->ctz.head, f->ctz.size, cb, data);
             if (err) {
-                LFS_TRACE("lfs_fs_traverse -> %d", err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                        "lfs_fs_traverse -> %d", err);
+                return err;
+            }
+        }
+
+        for (lfs_size_t i = 0; i < f->reserve.count; i++) {
+            int err = cb(data, f->reserve.block + i);
+            if (err) {
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                        "lfs_fs_traverse -> %d", err);
                 return err;
             }
         }
 
         if ((f->flags & LFS_F_WRITING) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
-                    f->block, f->pos, cb, data);
+            // indexed files only have the one block in flight
+            int err = (f->flags & LFS_F_INDEXED)
+                    ? cb(data, f->block)
+                    : lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
+                        f->block, f->pos, cb, data);
             if (err) {
-                LFS_TRACE("lfs_fs_traverse -> %d", err);
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                        "lfs_fs_traverse -> %d", err);
                 return err;
             }
         }
     }
 
-    LFS_TRACE("lfs_fs_traverse -> %d", 0);
+    // iterate over any held back updates
+    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
+        const struct lfs_mpending *p = (const struct lfs_mpending*)d;
+        if (d->type != LFS_TYPE_PENDING ||
+                (p->stype != LFS_TYPE_CTZSTRUCT &&
+                 p->stype != LFS_TYPE_IDXSTRUCT)) {
+            continue;
+        }
+
+        struct lfs_ctz ctz;
+        memcpy(&ctz, p->buffer, sizeof(ctz));
+        lfs_ctz_fromle32(&ctz);
+        int err = ((p->stype == LFS_TYPE_IDXSTRUCT)
+                    ? lfs_idx_traverse
+                    : lfs_ctz_traverse)(lfs, NULL, &lfs->rcache,
+                ctz.head, ctz.size, cb, data);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE,
+                    "lfs_fs_traverse -> %d", err);
+            return err;
+        }
+    }
+
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_TRAVERSE, "lfs_fs_traverse -> %d", 0);
     return 0;
 }
 
@@ -3846,23 +5611,173 @@ static int lfs_fs_parent_match(void *data,
 }
 
 static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t pair[2],
-        lfs_mdir_t *parent) {
+        lfs_mdir_t *parent, lfs_mdir_t *pred) {
+    // if asked, find the pred in the same pass, its tail is left null if
+    // there is none
+    if (pred) {
+        pred->tail[0] = LFS_BLOCK_NULL;
+        pred->tail[1] = LFS_BLOCK_NULL;
+    }
+
     // use fetchmatch with callback to find pairs
-    parent->tail[0] = 0;
-    parent->tail[1] = 1;
-    while (!lfs_pair_isnull(parent->tail)) {
-        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, parent, parent->tail,
+    lfs_stag_t found = LFS_ERR_NOENT;
+    lfs_mdir_t dir = {.tail = {0, 1}};
+    while (!lfs_pair_isnull(dir.tail)) {
+        if (pred && lfs_pair_cmp(dir.tail, pair) == 0) {
+            *pred = dir;
+            if (found != LFS_ERR_NOENT) {
+                break;
+            }
+        }
+
+        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, &dir, dir.tail,
                 LFS_MKTAG(0x7ff, 0, 0x3ff),
                 LFS_MKTAG(LFS_TYPE_DIRSTRUCT, 0, 8),
-                NULL,
+                NULL, NULL,
                 lfs_fs_parent_match, &(struct lfs_fs_parent_match){
                     lfs, {pair[0], pair[1]}});
         if (tag && tag != LFS_ERR_NOENT) {
-            return tag;
+            if (tag < 0) {
+                return tag;
+            }
+
+            *parent = dir;
+            found = tag;
+            if (!pred || !lfs_pair_isnull(pred->tail)) {
+                break;
+            }
         }
     }
 
-    return LFS_ERR_NOENT;
+    return found;
+}
+
+static void lfs_fs_dirsift(lfs_block_t (*dirs)[2],
+        lfs_size_t i, lfs_size_t count) {
+    while (2*i+1 < count) {
+        lfs_size_t c = 2*i+1;
+        if (c+1 < count && dirs[c+1][0] > dirs[c][0]) {
+            c += 1;
+        }
+
+        if (dirs[i][0] >= dirs[c][0]) {
+            return;
+        }
+
+        lfs_block_t t[2] = {dirs[i][0], dirs[i][1]};
+        dirs[i][0] = dirs[c][0];
+        dirs[i][1] = dirs[c][1];
+        dirs[c][0] = t[0];
+        dirs[c][1] = t[1];
+        i = c;
+    }
+}
+
+static void lfs_fs_dirsort(lfs_block_t (*dirs)[2], lfs_size_t count) {
+    // heapsort on the first block, no recursion or extra memory
+    for (lfs_size_t i = count/2; i > 0; i--) {
+        lfs_fs_dirsift(dirs, i-1, count);
+    }
+
+    for (lfs_size_t n = count; n > 1; n--) {
+        lfs_block_t t[2] = {dirs[0][0], dirs[0][1]};
+        dirs[0][0] = dirs[n-1][0];
+        dirs[0][1] = dirs[n-1][1];
+        dirs[n-1][0] = t[0];
+        dirs[n-1][1] = t[1];
+        lfs_fs_dirsift(dirs, 0, n-1);
+    }
+}
+
+static const lfs_block_t *lfs_fs_dirfind(lfs_block_t (*dirs)[2],
+        lfs_size_t count, const lfs_block_t pair[2]) {
+    // pairs match if they share either block, and each pair is in the
+    // list under both of its blocks, so look up both of ours
+    for (int i = 0; i < 2; i++) {
+        lfs_size_t lo = 0;
+        lfs_size_t hi = count;
+        while (lo < hi) {
+            lfs_size_t mid = lo + (hi-lo)/2;
+            if (dirs[mid][0] < pair[i]) {
+                lo = mid+1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo < count && dirs[lo][0] == pair[i]) {
+            return dirs[lo];
+        }
+    }
+
+    return NULL;
+}
+
+static int lfs_fs_dirs(lfs_t *lfs, lfs_block_t (**dirs)[2],
+        lfs_size_t *count) {
+    // collect the pair of every directory some parent has an entry for,
+    // once under each block and sorted, so deorphan can look up parents
+    // instead of searching the filesystem for each one
+    *dirs = NULL;
+    *count = 0;
+    lfs_size_t size = 0;
+    int err = 0;
+
+    lfs_mdir_t dir = {.tail = {0, 1}};
+    while (!lfs_pair_isnull(dir.tail)) {
+        err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        if (err) {
+            goto cleanup;
+        }
+
+        for (uint16_t id = 0; id < dir.count; id++) {
+            lfs_block_t pair[2];
+            lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(pair)), pair);
+            if (tag < 0) {
+                if (tag == LFS_ERR_NOENT) {
+                    continue;
+                }
+                err = tag;
+                goto cleanup;
+            }
+
+            if (lfs_tag_type3(tag) != LFS_TYPE_DIRSTRUCT) {
+                continue;
+            }
+
+            if (*count + 2 > size) {
+                size = lfs_max(2*size, 16);
+                lfs_block_t (*ndirs)[2] = lfs_malloc(size*sizeof(*ndirs));
+                if (!ndirs) {
+                    err = LFS_ERR_NOMEM;
+                    goto cleanup;
+                }
+
+                if (*dirs) {
+                    memcpy(ndirs, *dirs, *count*sizeof(*ndirs));
+                    lfs_free(*dirs);
+                }
+                *dirs = ndirs;
+            }
+
+            lfs_pair_fromle32(pair);
+            (*dirs)[*count+0][0] = pair[0];
+            (*dirs)[*count+0][1] = pair[1];
+            (*dirs)[*count+1][0] = pair[1];
+            (*dirs)[*count+1][1] = pair[0];
+            *count += 2;
+        }
+    }
+
+    lfs_fs_dirsort(*dirs, *count);
+    return 0;
+
+cleanup:
+    lfs_free(*dirs);
+    *dirs = NULL;
+    *count = 0;
+    return err;
 }
 
 static int lfs_fs_relocate(lfs_t *lfs,
@@ -3883,9 +5798,10 @@ static int lfs_fs_relocate(lfs_t *lfs,
         }
     }
 
-    // find parent
+    // find parent and pred in one pass
     lfs_mdir_t parent;
-    lfs_stag_t tag = lfs_fs_parent(lfs, oldpair, &parent);
+    struct lfs_mlist pred = {.type = LFS_TYPE_PRED};
+    lfs_stag_t tag = lfs_fs_parent(lfs, oldpair, &parent, &pred.m);
     if (tag < 0 && tag != LFS_ERR_NOENT) {
         return tag;
     }
@@ -3894,29 +5810,50 @@ static int lfs_fs_relocate(lfs_t *lfs,
         // update disk, this creates a desync
         lfs_fs_preporphans(lfs, +1);
 
+        // the commit may change our pred, track it so it stays up to date,
+        // if the commit splits it our copy no longer points at oldpair, and
+        // a pending move can drop the parent without updating tracked
+        // pairs, either way we search again below
+        bool stale = lfs_gstate_hasmovehere(&lfs->gpending, parent.pair);
+        pred.next = lfs->mlist;
+        lfs->mlist = &pred;
+
         lfs_pair_tole32(newpair);
         int err = lfs_dir_commit(lfs, &parent, LFS_MKATTRS({tag, newpair}));
         lfs_pair_fromle32(newpair);
+
+        for (struct lfs_mlist **p = &lfs->mlist; *p; p = &(*p)->next) {
+            if (*p == &pred) {
+                *p = (*p)->next;
+                break;
+            }
+        }
+
         if (err) {
             return err;
         }
 
         // next step, clean up orphans
         lfs_fs_preporphans(lfs, -1);
-    }
 
-    // find pred
-    int err = lfs_fs_pred(lfs, oldpair, &parent);
-    if (err && err != LFS_ERR_NOENT) {
-        return err;
+        if (stale || lfs_pair_isnull(pred.m.pair) ||
+                lfs_pair_cmp(pred.m.tail, oldpair) != 0) {
+            // something got between us, search again
+            err = lfs_fs_pred(lfs, oldpair, &pred.m);
+            if (err && err != LFS_ERR_NOENT) {
+                return err;
+            }
+        }
     }
 
     // if we can't find dir, it must be new
-    if (err != LFS_ERR_NOENT) {
+    if (!lfs_pair_isnull(pred.m.tail) &&
+            lfs_pair_cmp(pred.m.tail, oldpair) == 0) {
         // replace bad pair, either we clean up desync, or no desync occured
         lfs_pair_tole32(newpair);
-        err = lfs_dir_commit(lfs, &parent, LFS_MKATTRS(
-                {LFS_MKTAG(LFS_TYPE_TAIL + parent.split, 0x3ff, 8), newpair}));
+        int err = lfs_dir_commit(lfs, &pred.m, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_TAIL + pred.m.split, 0x3ff, 8),
+                    newpair}));
         lfs_pair_fromle32(newpair);
         if (err) {
             return err;
@@ -3940,6 +5877,91 @@ static void lfs_fs_prepmove(lfs_t *lfs,
     lfs_gstate_xormove(&lfs->gpending, &lfs->gpending, id, pair);
 }
 
+static int lfs_fs_fetchsuper(lfs_t *lfs, lfs_mdir_t *dir) {
+    // the checkpoint lives next to the superblock, which starts out in
+    // {0,1} but moves down the metadata list when that pair is expanded,
+    // even after mount, so lfs->root may be an emptied {0,1}
+    dir->tail[0] = 0;
+    dir->tail[1] = 1;
+    while (!lfs_pair_isnull(dir->tail)) {
+        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, dir, dir->tail,
+                LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8),
+                NULL, NULL,
+                lfs_dir_find_match, &(struct lfs_dir_find_match){
+                    lfs, "littlefs", 8});
+        if (tag < 0) {
+            return tag;
+        }
+
+        if (tag && !lfs_tag_isdelete(tag)) {
+            return 0;
+        }
+    }
+
+    return LFS_ERR_CORRUPT;
+}
+
+static int lfs_fs_uncheckpoint(lfs_t *lfs) {
+    if (lfs->checkpoint == LFS_CHECKPOINT_OFF) {
+        return 0;
+    }
+
+    // any commit may change the global state, if only by relocating, so
+    // a current checkpoint must be gone before we commit anything else
+    if (lfs->checkpoint == LFS_CHECKPOINT_VALID) {
+        lfs_mdir_t dir;
+        int err = lfs_fs_fetchsuper(lfs, &dir);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_commit(lfs, &dir, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0, 0x3ff), NULL}));
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs->checkpoint = LFS_CHECKPOINT_DIRTY;
+    return 0;
+}
+
+static int lfs_fs_checkpoint(lfs_t *lfs) {
+    if (lfs->checkpoint == LFS_CHECKPOINT_OFF ||
+            lfs->checkpoint == LFS_CHECKPOINT_VALID) {
+        return 0;
+    }
+
+    lfs_mdir_t dir;
+    int err = lfs_fs_fetchsuper(lfs, &dir);
+    if (err) {
+        return err;
+    }
+
+    // a move in the superblock's pair would be fixed by our own commit,
+    // leave that to the next mount's scan
+    if (lfs_gstate_hasmovehere(&lfs->gpending, dir.pair)) {
+        return 0;
+    }
+
+    // our commit also writes out any pending gdelta, so the global state
+    // on disk is what we have pending, less the orphan count that only
+    // lives in RAM
+    struct lfs_gstate gstate = lfs->gpending;
+    gstate.tag &= ~LFS_MKTAG(0, 0, 0x3ff);
+    lfs_gstate_tole32(&gstate);
+    lfs_alloc_ack(lfs);
+    err = lfs_dir_commit(lfs, &dir, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_CHECKPOINT, 0, sizeof(gstate)), &gstate}));
+    if (err) {
+        return err;
+    }
+
+    lfs->checkpoint = LFS_CHECKPOINT_VALID;
+    return 0;
+}
+
 
 static int lfs_fs_demove(lfs_t *lfs) {
     if (!lfs_gstate_hasmove(&lfs->gstate)) {
@@ -3973,24 +5995,52 @@ static int lfs_fs_deorphan(lfs_t *lfs) {
         return 0;
     }
 
+    // find every directory with a parent up front, without the memory for
+    // this we fall back to searching for the parent of each directory
+    lfs_block_t (*dirs)[2];
+    lfs_size_t count;
+    int err = lfs_fs_dirs(lfs, &dirs, &count);
+    if (err && err != LFS_ERR_NOMEM) {
+        return err;
+    }
+    bool mapped = !err;
+
     // Fix any orphans
     lfs_mdir_t pdir = {.split = true};
     lfs_mdir_t dir = {.tail = {0, 1}};
 
     // iterate over all directory directory entries
     while (!lfs_pair_isnull(dir.tail)) {
-        int err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        err = lfs_dir_fetch(lfs, &dir, dir.tail);
         if (err) {
-            return err;
+            goto cleanup;
         }
 
         // check head blocks for orphans
         if (!pdir.split) {
-            // check if we have a parent
-            lfs_mdir_t parent;
-            lfs_stag_t tag = lfs_fs_parent(lfs, pdir.tail, &parent);
+            // check if we have a parent, and what it thinks our pair is
+            lfs_block_t pair[2];
+            lfs_stag_t tag = LFS_ERR_NOENT;
+            if (mapped) {
+                const lfs_block_t *d = lfs_fs_dirfind(dirs, count, pdir.tail);
+                if (d) {
+                    pair[0] = d[0];
+                    pair[1] = d[1];
+                    tag = 0;
+                }
+            } else {
+                lfs_mdir_t parent;
+                tag = lfs_fs_parent(lfs, pdir.tail, &parent, NULL);
+                if (tag >= 0) {
+                    tag = lfs_dir_get(lfs, &parent,
+                            LFS_MKTAG(0x7ff, 0x3ff, 0), tag, pair);
+                    lfs_pair_fromle32(pair);
+                }
+            }
+
             if (tag < 0 && tag != LFS_ERR_NOENT) {
-                return tag;
+                err = tag;
+                goto cleanup;
             }
 
             if (tag == LFS_ERR_NOENT) {
@@ -4000,20 +6050,12 @@ static int lfs_fs_deorphan(lfs_t *lfs) {
 
                 err = lfs_dir_drop(lfs, &pdir, &dir);
                 if (err) {
-                    return err;
+                    goto cleanup;
                 }
 
                 break;
             }
 
-            lfs_block_t pair[2];
-            lfs_stag_t res = lfs_dir_get(lfs, &parent,
-                    LFS_MKTAG(0x7ff, 0x3ff, 0), tag, pair);
-            if (res < 0) {
-                return res;
-            }
-            lfs_pair_fromle32(pair);
-
             if (!lfs_pair_sync(pair, pdir.tail)) {
                 // we have desynced
                 LFS_DEBUG("Fixing half-orphan %"PRIx32" %"PRIx32,
@@ -4024,7 +6066,7 @@ static int lfs_fs_deorphan(lfs_t *lfs) {
                         {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), pair}));
                 lfs_pair_fromle32(pair);
                 if (err) {
-                    return err;
+                    goto cleanup;
                 }
 
                 break;
@@ -4037,11 +6079,21 @@ static int lfs_fs_deorphan(lfs_t *lfs) {
     // mark orphans as fixed
     lfs_fs_preporphans(lfs, -lfs_gstate_getorphans(&lfs->gstate));
     lfs->gstate = lfs->gpending;
-    return 0;
+    err = 0;
+
+cleanup:
+    lfs_free(dirs);
+    return err;
 }
 
 static int lfs_fs_forceconsistency(lfs_t *lfs) {
-    int err = lfs_fs_demove(lfs);
+    // we're about to change the filesystem
+    int err = lfs_fs_uncheckpoint(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_fs_demove(lfs);
     if (err) {
         return err;
     }
@@ -4063,17 +6115,184 @@ static int lfs_fs_size_count(void *p, lfs_block_t block) {
 
 lfs_ssize_t lfs_fs_size(lfs_t *lfs) {
     LFS_TRACE("lfs_fs_size(%p)", (void*)lfs);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_SIZE, 0, 0, 0);
     lfs_size_t size = 0;
     int err = lfs_fs_traverse(lfs, lfs_fs_size_count, &size);
     if (err) {
-        LFS_TRACE("lfs_fs_size -> %"PRId32, err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_SIZE, "lfs_fs_size -> %"PRId32, err);
         return err;
     }
 
-    LFS_TRACE("lfs_fs_size -> %"PRId32, err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_SIZE, "lfs_fs_size -> %"PRId32, err);
     return size;
 }
 
+int lfs_fs_gc(lfs_t *lfs) {
+    LFS_TRACE("lfs_fs_gc(%p)", (void*)lfs);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_GC, 0, 0, 0);
+    // deorphan if we haven't yet, needed at most once after poweron, but
+    // don't drop our checkpoint if there's nothing to fix
+    int err = 0;
+    if (lfs_gstate_hasmove(&lfs->gstate) ||
+            lfs_gstate_hasorphans(&lfs->gstate)) {
+        err = lfs_fs_forceconsistency(lfs);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_GC, "lfs_fs_gc -> %d", err);
+            return err;
+        }
+    }
+
+    // compaction can't get a metadata block below our compaction limit,
+    // so don't bother unless we've grown past it
+    lfs_size_t thresh = lfs->cfg->compact_thresh
+            ? lfs->cfg->compact_thresh
+            : lfs->cfg->block_size - lfs->cfg->block_size/8;
+    thresh = lfs_max(thresh,
+            lfs_alignup(lfs_dir_compactmax(lfs) + 36, lfs->cfg->prog_size));
+
+    // we can't gain anything if a compaction doesn't leave room for at
+    // least one more commit, so skip straight to the checkpoint
+    lfs_mdir_t dir = {.tail = {0, 1}};
+    if (thresh >= lfs->cfg->block_size - lfs->cfg->prog_size) {
+        dir.tail[0] = LFS_BLOCK_NULL;
+        dir.tail[1] = LFS_BLOCK_NULL;
+    }
+
+    // iterate over metadata pairs
+    while (!lfs_pair_isnull(dir.tail)) {
+        err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_GC, "lfs_fs_gc -> %d", err);
+            return err;
+        }
+
+        // compact early if we're close to full or can't be appended to,
+        // so the compaction doesn't land on a later commit
+        if (!dir.erased || dir.off > thresh) {
+            // dropping our checkpoint may have changed this pair
+            if (lfs->checkpoint == LFS_CHECKPOINT_VALID) {
+                err = lfs_fs_uncheckpoint(lfs);
+                if (!err) {
+                    err = lfs_dir_fetch(lfs, &dir, dir.pair);
+                }
+                if (err) {
+                    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_GC,
+                            "lfs_fs_gc -> %d", err);
+                    return err;
+                }
+            }
+
+            dir.erased = false;
+            err = lfs_dir_commit(lfs, &dir, NULL, 0);
+            if (err) {
+                LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_GC, "lfs_fs_gc -> %d", err);
+                return err;
+            }
+        }
+    }
+
+    // fill the lookahead if the next allocation would have to scan for
+    // free blocks, so the scan doesn't land on a later write either
+    if (lfs->free.i == lfs->free.size && lfs->free.ack > 0) {
+        err = lfs_alloc_scan(lfs);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_GC, "lfs_fs_gc -> %d", err);
+            return err;
+        }
+    }
+
+    // checkpoint once nothing has changed between two calls, so a busy
+    // filesystem doesn't rewrite its checkpoint every time, files open for
+    // writing and batched updates also commit without dropping it, so wait
+    // until they're gone
+    bool idle = (lfs->batch.depth == 0 && lfs->batch.count == 0);
+    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
+        if (d->type == LFS_TYPE_REG &&
+                (((lfs_file_t*)d)->flags & 3) != LFS_O_RDONLY) {
+            idle = false;
+        }
+    }
+
+    if (lfs->checkpoint == LFS_CHECKPOINT_DIRTY) {
+        lfs->checkpoint = LFS_CHECKPOINT_IDLE;
+    } else if (idle) {
+        err = lfs_fs_checkpoint(lfs);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_GC, "lfs_fs_gc -> %d", err);
+            return err;
+        }
+    }
+
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_GC, "lfs_fs_gc -> %d", 0);
+    return 0;
+}
+
+int lfs_fs_batch_begin(lfs_t *lfs) {
+    LFS_TRACE("lfs_fs_batch_begin(%p)", (void*)lfs);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_BATCH_BEGIN, 0, 0, 0);
+    lfs->batch.depth += 1;
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_BATCH_BEGIN,
+            "lfs_fs_batch_begin -> %d", 0);
+    return 0;
+}
+
+int lfs_fs_batch_end(lfs_t *lfs) {
+    LFS_TRACE("lfs_fs_batch_end(%p)", (void*)lfs);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_BATCH_END, 0, 0, 0);
+    LFS_ASSERT(lfs->batch.depth > 0);
+    if (lfs->batch.depth == 1) {
+        int err = lfs_batch_flush(lfs);
+        if (err) {
+            LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_BATCH_END,
+                    "lfs_fs_batch_end -> %d", err);
+            return err;
+        }
+    }
+
+    lfs->batch.depth -= 1;
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_BATCH_END, "lfs_fs_batch_end -> %d", 0);
+    return 0;
+}
+
+int lfs_fs_batch_abort(lfs_t *lfs) {
+    LFS_TRACE("lfs_fs_batch_abort(%p)", (void*)lfs);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_BATCH_ABORT, 0, 0, 0);
+    LFS_ASSERT(lfs->batch.depth > 0);
+    // open files may still hold the state we're throwing away, detach
+    // them as if they were removed so they never write it back
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+        if (f->type == LFS_TYPE_REG &&
+                lfs_mpending_find(lfs, f->m.pair, f->id)) {
+            f->m.pair[0] = LFS_BLOCK_NULL;
+            f->m.pair[1] = LFS_BLOCK_NULL;
+        }
+    }
+
+    lfs_batch_clear(lfs);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_BATCH_ABORT,
+            "lfs_fs_batch_abort -> %d", 0);
+    return 0;
+}
+
+#ifdef LFS_YES_STATS
+int lfs_fs_stats(lfs_t *lfs, struct lfs_stats *stats) {
+    LFS_TRACE("lfs_fs_stats(%p, %p)", (void*)lfs, (void*)stats);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_STATS, 0, 0, 0);
+    *stats = lfs->stats;
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_STATS, "lfs_fs_stats -> %d", 0);
+    return 0;
+}
+
+int lfs_fs_stats_reset(lfs_t *lfs) {
+    LFS_TRACE("lfs_fs_stats_reset(%p)", (void*)lfs);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_FS_STATS_RESET, 0, 0, 0);
+    lfs->stats = (struct lfs_stats){0};
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_FS_STATS_RESET,
+            "lfs_fs_stats_reset -> %d", 0);
+    return 0;
+}
+#endif
+
 #ifdef LFS_MIGRATE
 ////// Migration from littelfs v1 below this //////
 
@@ -4503,18 +6722,24 @@ int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
                 ".lookahead_size=%"PRIu32", .read_buffer=%p, "
                 ".prog_buffer=%p, .lookahead_buffer=%p, "
                 ".name_max=%"PRIu32", .file_max=%"PRIu32", "
-                ".attr_max=%"PRIu32"})",
+                ".attr_max=%"PRIu32", .name_hash=%d, .indexed_files=%d, "
+                ".mount_checkpoint=%d, .split_size=%"PRIu32", "
+                ".compact_thresh=%"PRIu32"})",
             (void*)lfs, (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
-            cfg->name_max, cfg->file_max, cfg->attr_max);
+            cfg->name_max, cfg->file_max, cfg->attr_max, cfg->name_hash,
+            cfg->indexed_files, cfg->mount_checkpoint, cfg->split_size,
+            cfg->compact_thresh);
+    LFS_TRACE_EVENT(lfs, LFS_TRACE_MIGRATE,
+            cfg->block_size, cfg->block_count, 0);
     struct lfs1 lfs1;
     int err = lfs1_mount(lfs, &lfs1, cfg);
     if (err) {
-        LFS_TRACE("lfs_migrate -> %d", err);
+        LFS_TRACE_EXIT(lfs, LFS_TRACE_MIGRATE, "lfs_migrate -> %d", err);
         return err;
     }
 
@@ -4695,20 +6920,21 @@ int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
         dir2.split = true;
 
         lfs_superblock_t superblock = {
-            .version     = LFS_DISK_VERSION,
+            .version     = lfs->disk_version,
             .block_size  = lfs->cfg->block_size,
             .block_count = lfs->cfg->block_count,
             .name_max    = lfs->name_max,
             .file_max    = lfs->file_max,
             .attr_max    = lfs->attr_max,
+            .features    = lfs->features,
         };
 
         lfs_superblock_tole32(&superblock);
         err = lfs_dir_commit(lfs, &dir2, LFS_MKATTRS(
                 {LFS_MKTAG(LFS_TYPE_CREATE, 0, 0), NULL},
                 {LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8), "littlefs"},
-                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
-                    &superblock}));
+                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0,
+                    lfs_superblock_size(lfs)), &superblock}));
         if (err) {
             goto cleanup;
         }
@@ -4729,7 +6955,7 @@ int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
 
 cleanup:
     lfs1_unmount(lfs);
-    LFS_TRACE("lfs_migrate -> %d", err);
+    LFS_TRACE_EXIT(lfs, LFS_TRACE_MIGRATE, "lfs_migrate -> %d", err);
     return err;
 }
 
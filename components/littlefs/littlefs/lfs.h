@@ -28,7 +28,7 @@ extern "C"
 // Version of On-disk data structures
 // Major (top-nibble), incremented on backwards incompatible changes
 // Minor (bottom-nibble), incremented on feature additions
-#define LFS_DISK_VERSION 0x00020000
+#define LFS_DISK_VERSION 0x00020001
 #define LFS_DISK_VERSION_MAJOR (0xffff & (LFS_DISK_VERSION >> 16))
 #define LFS_DISK_VERSION_MINOR (0xffff & (LFS_DISK_VERSION >>  0))
 
@@ -109,9 +109,12 @@ enum lfs_type {
     LFS_TYPE_DIRSTRUCT      = 0x200,
     LFS_TYPE_CTZSTRUCT      = 0x202,
     LFS_TYPE_INLINESTRUCT   = 0x201,
+    LFS_TYPE_IDXSTRUCT      = 0x203,
     LFS_TYPE_SOFTTAIL       = 0x600,
     LFS_TYPE_HARDTAIL       = 0x601,
     LFS_TYPE_MOVESTATE      = 0x7ff,
+    LFS_TYPE_NAMEHASH       = 0x1ff,
+    LFS_TYPE_CHECKPOINT     = 0x1fe,
 
     // internal chip sources
     LFS_FROM_NOOP           = 0x000,
@@ -119,6 +122,13 @@ enum lfs_type {
     LFS_FROM_USERATTRS      = 0x102,
 };
 
+// Optional on-disk features, each one a flag in the superblock
+enum lfs_feature {
+    LFS_FEATURE_NAMEHASH    = 0x1, // Name-hash tags
+    LFS_FEATURE_INDEXED     = 0x2, // Indexed files
+    LFS_FEATURE_CHECKPOINT  = 0x4, // Mount checkpoint
+};
+
 // File open flags
 enum lfs_open_flags {
     // open flags
@@ -137,6 +147,7 @@ enum lfs_open_flags {
     LFS_F_ERRED   = 0x080000, // An error occured during write
     LFS_F_INLINE  = 0x100000, // Currently inlined in directory entry
     LFS_F_OPENED  = 0x200000, // File has been opened
+    LFS_F_INDEXED = 0x400000, // File blocks are found through an index
 };
 
 // File seek flags
@@ -240,6 +251,67 @@ struct lfs_config {
     // larger attributes size but must be <= LFS_ATTR_MAX. Defaults to
     // LFS_ATTR_MAX when zero.
     lfs_size_t attr_max;
+
+    // Optional flag to store a hash of each file name next to the name.
+    // Name hashes let path lookups skip comparing most names that can't
+    // match, which speeds up lookups in large directories at the cost of 8
+    // bytes of metadata per entry. Only used by lfs_format. Filesystems
+    // formatted with name hashes record LFS_FEATURE_NAMEHASH in the
+    // superblock and can't be mounted by older littlefs drivers.
+    bool name_hash;
+
+    // Optional flag to allow files stored with LFS_LAYOUT_INDEXED. Only used
+    // by lfs_format. Filesystems formatted with indexed files record
+    // LFS_FEATURE_INDEXED in the superblock and can't be mounted by older
+    // littlefs drivers.
+    bool indexed_files;
+
+    // Optional flag to keep a checkpoint of the global state next to the
+    // superblock. While the checkpoint is current, lfs_mount reads only the
+    // superblock's metadata pair instead of every metadata pair in the
+    // filesystem. The checkpoint is dropped before the first change after
+    // mounting and rewritten by lfs_unmount, or by lfs_fs_gc once nothing has
+    // changed since its previous call. This costs two extra commits to the
+    // superblock's metadata pair for every mount that changes something, so
+    // that pair wears faster and is expanded after fewer mounts, see
+    // block_cycles. Only used by lfs_format. Filesystems formatted with
+    // checkpoints record LFS_FEATURE_CHECKPOINT in the superblock and can't
+    // be mounted by older littlefs drivers.
+    bool mount_checkpoint;
+
+    // Optional upper limit on the metadata kept in a metadata block after
+    // compaction in bytes. Metadata that doesn't fit is split into a new
+    // metadata pair, packing as many entries as fit into each block. Larger
+    // values mean fewer metadata pairs to search through, but leave less
+    // room for new commits before the next compaction. Must be <= block_size.
+    // Defaults to half the block size when zero.
+    lfs_size_t split_size;
+
+    // Optional threshold for early metadata compaction in bytes. lfs_fs_gc
+    // compacts any metadata block that has grown past this threshold, so
+    // that the compaction doesn't land on a later, possibly time-critical,
+    // commit. Must be <= block_size. Defaults to ~88% of block_size when
+    // zero.
+    lfs_size_t compact_thresh;
+
+    // Optional flag to say the read function can read past the end of a
+    // block into the blocks after it, as if the device was one address
+    // space. Reads of indexed files then fetch runs of consecutive blocks
+    // with one call, bypassing the caches.
+    bool linear_reads;
+
+    // Optional size of the metadata tag index in bytes. When fetching a
+    // metadata pair, littlefs notes where the latest name and struct of each
+    // entry are, so later lookups in that pair can read them directly
+    // instead of searching the log backwards. Only the most recently fetched
+    // pair is indexed, and each entry takes 16 bytes, lookups of entries past
+    // what fits fall back to searching the log. Disabled when zero.
+    lfs_size_t tag_index_size;
+
+    // Optional statically allocated tag index buffer. Must be tag_index_size
+    // and aligned to a 32-bit boundary. By default lfs_malloc is used to
+    // allocate this buffer.
+    void *tag_index_buffer;
 };
 
 // File info structure
@@ -257,6 +329,19 @@ struct lfs_info {
     char name[LFS_NAME_MAX+1];
 };
 
+// File layouts, how the blocks of a file are found once it no longer fits
+// inline in its directory entry
+enum lfs_file_layout {
+    // CTZ skip-list, cheap appends but any write in the middle of the file
+    // rewrites every block after it
+    LFS_LAYOUT_CTZ     = 0,
+
+    // Tree of index blocks pointing at the data blocks, a write only rewrites
+    // the blocks it touches and their path in the index. Needs a filesystem
+    // formatted with indexed_files
+    LFS_LAYOUT_INDEXED = 1,
+};
+
 // Custom attribute structure, used to describe custom attributes
 // committed atomically during file writes.
 struct lfs_attr {
@@ -292,8 +377,61 @@ struct lfs_file_config {
 
     // Number of custom attributes in the list
     lfs_size_t attr_count;
+
+    // Layout of the file's blocks, one of enum lfs_file_layout. Only applies
+    // to files that are still inline, such as new or truncated files, files
+    // with blocks keep the layout they were written with. Defaults to
+    // LFS_LAYOUT_CTZ.
+    int layout;
 };
 
+#ifdef LFS_YES_STATS
+// Filesystem statistics, only available when compiled with LFS_YES_STATS
+//
+// Gathered from mount, or the last lfs_fs_stats_reset, to help explain
+// where the time of slow operations goes. Times are in whatever unit
+// lfs_stats_clock returns.
+struct lfs_stats {
+    // Block device operations and the bytes they transferred
+    uint32_t read_count;
+    uint32_t prog_count;
+    uint32_t erase_count;
+    uint64_t read_bytes;
+    uint64_t prog_bytes;
+    uint64_t erase_bytes;
+
+    // Reads served from the read cache, and reads that had to go to the
+    // block device to fill it
+    uint32_t rcache_hits;
+    uint32_t rcache_misses;
+
+    // Reads and progs served from a pending prog cache, and progs that had
+    // to start a new prog cache
+    uint32_t pcache_hits;
+    uint32_t pcache_misses;
+
+    // Number of lookahead refills, each a full traversal of the filesystem
+    uint32_t alloc_scans;
+
+    // Metadata compactions, splits into new metadata pairs and relocations
+    // of metadata pairs, either for wear leveling or due to bad blocks
+    uint32_t compacts;
+    uint32_t splits;
+    uint32_t relocations;
+
+    // Blocks that failed to validate after being programmed
+    uint32_t bad_blocks;
+
+    // Time spent in the block device, in lookahead refills and in metadata
+    // compactions, including any splits and relocations they cause
+    uint64_t read_time;
+    uint64_t prog_time;
+    uint64_t erase_time;
+    uint64_t alloc_time;
+    uint64_t compact_time;
+};
+#endif
+
 
 /// internal littlefs data structures ///
 typedef struct lfs_cache {
@@ -343,6 +481,11 @@ typedef struct lfs_file {
     lfs_off_t off;
     lfs_cache_t cache;
 
+    struct lfs_reserve {
+        lfs_block_t block;
+        lfs_size_t count;
+    } reserve;
+
     const struct lfs_file_config *cfg;
 } lfs_file_t;
 
@@ -353,6 +496,7 @@ typedef struct lfs_superblock {
     lfs_size_t name_max;
     lfs_size_t file_max;
     lfs_size_t attr_max;
+    uint32_t features;
 } lfs_superblock_t;
 
 // The littlefs filesystem type
@@ -369,10 +513,31 @@ typedef struct lfs {
     } *mlist;
     uint32_t seed;
 
+    struct lfs_batch {
+        lfs_size_t depth;
+        lfs_size_t count;
+    } batch;
+
+#ifdef LFS_YES_STATS
+    struct lfs_stats stats;
+#endif
+
     struct lfs_gstate {
         uint32_t tag;
         lfs_block_t pair[2];
     } gstate, gpending, gdelta;
+    uint8_t checkpoint;
+
+    struct lfs_tindex {
+        lfs_block_t block;
+        lfs_off_t off;
+        lfs_size_t count;
+        lfs_size_t size;
+        struct lfs_tentry {
+            uint32_t tag;
+            lfs_off_t off;
+        } *entries;
+    } tindex;
 
     struct lfs_free {
         lfs_block_t off;
@@ -386,6 +551,8 @@ typedef struct lfs {
     lfs_size_t name_max;
     lfs_size_t file_max;
     lfs_size_t attr_max;
+    uint32_t disk_version;
+    uint32_t features;
 
 #ifdef LFS_MIGRATE
     struct lfs1 *lfs1;
@@ -560,6 +727,39 @@ int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file);
 // Returns the size of the file, or a negative error code on failure.
 lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file);
 
+// Find where the data of a file is stored on the block device
+//
+// Looks up the block holding the byte at offset off in the file, and the
+// offset of that byte in the block, so the data can be read from the block
+// device directly, for example through a memory-mapped flash window. Any
+// pending writes are flushed first. The location stays valid until the file
+// is written or truncated, or changed or removed through another handle.
+//
+// Returns the number of bytes of the file stored contiguously from there,
+// which is at most the rest of the block, 0 if off is at or past the end of
+// the file, or a negative error code on failure. Inline files have no blocks
+// of their own and return LFS_ERR_INVAL, as do holes in indexed files, which
+// read as zeros. Iterate over a larger file by advancing off by the returned
+// size.
+lfs_ssize_t lfs_file_map(lfs_t *lfs, lfs_file_t *file, lfs_off_t off,
+        lfs_block_t *block, lfs_off_t *boff);
+
+// Reserve blocks for the file to grow to the specified size
+//
+// Looks for a run of consecutive free blocks big enough to append to the
+// file up to size bytes, and holds it for the file so later writes take
+// their blocks from the run in order instead of from the allocator. Any
+// earlier reservation of the file is given back first, and a size the file
+// has already reached just gives it back. Reserved blocks count as used by
+// lfs_fs_size and lfs_fs_traverse until they are written, and are given
+// back when the file is closed. For indexed files only data blocks are
+// reserved, the index blocks rewritten by each write still come from the
+// allocator, as does anything past the end of the reservation.
+//
+// Returns the number of blocks reserved, which is fewer than needed if free
+// space is too fragmented for one run, or a negative error code on failure.
+lfs_ssize_t lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_off_t size);
+
 
 /// Directory operations ///
 
@@ -628,6 +828,82 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 // Returns a negative error code on failure.
 int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 
+// Attempt to do filesystem maintenance ahead of time
+//
+// Compacts any metadata blocks that have grown past compact_thresh. Without
+// this, compaction happens synchronously during whatever commit fills up the
+// metadata block, which is much slower than a normal commit. Also fills the
+// block allocator's lookahead buffer when the next allocation would have to
+// scan the filesystem for free blocks, and rewrites the mount checkpoint
+// once nothing has changed since the previous call. Calling this from idle
+// time keeps commit latency predictable. It is always safe to call, but
+// never necessary.
+//
+// Returns a negative error code on failure.
+int lfs_fs_gc(lfs_t *lfs);
+
+// Start batching metadata updates
+//
+// Until the matching lfs_fs_batch_end, lfs_file_sync and lfs_file_close
+// hold back their metadata updates instead of committing them. Updates to
+// the same metadata pair are then written together as a single commit,
+// which saves a commit's worth of padding to the prog size for each file
+// and fills metadata blocks much more slowly. Reads, including through
+// reopened files, see the held back updates. Batches may be nested, only
+// the outermost lfs_fs_batch_end writes anything.
+//
+// Each metadata pair's commit is atomic on power loss, but updates that
+// land in different metadata pairs are written as separate commits.
+// Updates are never committed early, as that would escape
+// lfs_fs_batch_abort. If an update can't be held back, because no memory
+// can be allocated for it or because the file has custom attributes,
+// lfs_file_sync returns LFS_ERR_NOMEM or LFS_ERR_INVAL and leaves the file
+// dirty so it can be synced again after the batch. lfs_file_close still
+// closes the file in that case, dropping the update. lfs_rename returns
+// LFS_ERR_INVAL while any updates are held back.
+//
+// Returns a negative error code on failure.
+int lfs_fs_batch_begin(lfs_t *lfs);
+
+// Stop batching metadata updates
+//
+// Writes out any held back metadata updates once the outermost batch ends.
+// On failure the batch stays open with the updates still held back, so
+// lfs_fs_batch_end can simply be retried. lfs_unmount also writes out any
+// held back updates.
+//
+// Returns a negative error code on failure.
+int lfs_fs_batch_end(lfs_t *lfs);
+
+// Abort batching metadata updates
+//
+// Discards every held back metadata update and closes the batch, including
+// any outer nesting levels. Together with lfs_fs_batch_begin/end this
+// makes a batch a transaction: files in the same metadata pair can be
+// rewritten in place, and on lfs_fs_batch_end they are either all
+// updated by one commit or, if power is lost or the batch is aborted,
+// all left as they were. A directory that has grown past one metadata
+// pair is written as one commit per pair, so only files that share a
+// pair are covered together. Other operations, such as creating or
+// removing files, are committed immediately and are not part of it.
+// Files that are still open with discarded updates are detached, like
+// files removed while open, and won't be written back.
+//
+// Returns a negative error code on failure.
+int lfs_fs_batch_abort(lfs_t *lfs);
+
+#ifdef LFS_YES_STATS
+// Get the filesystem statistics gathered since mount or the last reset
+//
+// Returns a negative error code on failure.
+int lfs_fs_stats(lfs_t *lfs, struct lfs_stats *stats);
+
+// Reset the filesystem statistics to zero
+//
+// Returns a negative error code on failure.
+int lfs_fs_stats_reset(lfs_t *lfs);
+#endif
+
 #ifdef LFS_MIGRATE
 // Attempts to migrate a previous version of littlefs
 //
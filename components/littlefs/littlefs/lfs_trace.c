@@ -0,0 +1,108 @@
+/*
+ * lfs binary trace events
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "lfs_trace.h"
+#include "lfs_util.h"
+
+#ifdef LFS_YES_TRACE_EVENTS
+
+// the buffer size must be a power of two so sequence numbers wrap cleanly
+typedef char lfs_trace_buffer_size_is_pw2[
+        (LFS_TRACE_BUFFER_SIZE & (LFS_TRACE_BUFFER_SIZE-1)) ? -1 : 1];
+
+static struct lfs_trace_record lfs_trace_buffer[LFS_TRACE_BUFFER_SIZE];
+static uint32_t lfs_trace_head;
+
+// Atomics, writers claim a slot by incrementing the head, and mark the
+// record complete by storing its sequence number last. Without the GCC
+// builtins only a single writer at a time is supported.
+#if defined(__GNUC__)
+static inline uint32_t lfs_trace_claim(void) {
+    return __atomic_fetch_add(&lfs_trace_head, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t lfs_trace_load(const uint32_t *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void lfs_trace_store(uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline void lfs_trace_fence(void) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+#else
+static inline uint32_t lfs_trace_claim(void) {
+    return lfs_trace_head++;
+}
+
+static inline uint32_t lfs_trace_load(const uint32_t *p) {
+    return *(const volatile uint32_t*)p;
+}
+
+static inline void lfs_trace_store(uint32_t *p, uint32_t v) {
+    *(volatile uint32_t*)p = v;
+}
+
+static inline void lfs_trace_fence(void) {
+}
+#endif
+
+void lfs_trace_event(const void *lfs, uint16_t id,
+        uint32_t a, uint32_t b, uint32_t c) {
+    uint32_t seq = lfs_trace_claim() + 1;
+    struct lfs_trace_record *r =
+            &lfs_trace_buffer[seq & (LFS_TRACE_BUFFER_SIZE-1)];
+
+    // zero marks the record as being written
+    lfs_trace_store(&r->seq, 0);
+    r->time = lfs_trace_clock();
+    r->id = id;
+    r->fs = (uint16_t)(uintptr_t)lfs;
+    r->args[0] = a;
+    r->args[1] = b;
+    r->args[2] = c;
+    lfs_trace_store(&r->seq, seq);
+}
+
+uint32_t lfs_trace_read(uint32_t *cursor,
+        struct lfs_trace_record *records, uint32_t count) {
+    uint32_t head = lfs_trace_load(&lfs_trace_head);
+    if (head - *cursor > LFS_TRACE_BUFFER_SIZE) {
+        // already overwritten
+        *cursor = head - LFS_TRACE_BUFFER_SIZE;
+    }
+
+    uint32_t n = 0;
+    while (n < count && *cursor != head) {
+        uint32_t seq = *cursor + 1;
+        struct lfs_trace_record *r =
+                &lfs_trace_buffer[seq & (LFS_TRACE_BUFFER_SIZE-1)];
+
+        uint32_t before = lfs_trace_load(&r->seq);
+        if (before == 0 || (int32_t)(before - seq) < 0) {
+            // claimed but still being written, try again next time
+            break;
+        }
+
+        records[n] = *r;
+        lfs_trace_fence();
+        uint32_t after = lfs_trace_load(&r->seq);
+
+        *cursor = seq;
+        if (before != seq || after != seq) {
+            // overwritten by a newer event while we were catching up
+            continue;
+        }
+
+        n += 1;
+    }
+
+    return n;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * lfs binary trace events
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_TRACE_H
+#define LFS_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+// With LFS_YES_TRACE_EVENTS, littlefs reports each API call, its return,
+// and every block device operation and compaction in between as a small
+// binary event to lfs_trace_event, declared in lfs_util.h. Formatting and
+// output are left to whoever reads the events, so unlike LFS_TRACE this is
+// cheap enough to leave enabled.
+//
+// lfs_trace.c provides an lfs_trace_event that stores the events in a
+// lock-free ring buffer, to be copied out with lfs_trace_read and decoded
+// with scripts/trace.py. Leave out lfs_trace.c to provide a different
+// lfs_trace_event.
+
+// Config options
+#ifndef LFS_TRACE_BUFFER_SIZE
+#define LFS_TRACE_BUFFER_SIZE 1024
+#endif
+
+// Event ids, the decoder in scripts/trace.py must be kept in sync
+enum lfs_trace_id {
+    // API calls, the return is reported with the same id | LFS_TRACE_RET
+    // and the return value as the first argument
+    LFS_TRACE_FORMAT            = 0x01,
+    LFS_TRACE_MOUNT             = 0x02,
+    LFS_TRACE_UNMOUNT           = 0x03,
+    LFS_TRACE_MIGRATE           = 0x04,
+    LFS_TRACE_REMOVE            = 0x05,
+    LFS_TRACE_RENAME            = 0x06,
+    LFS_TRACE_STAT              = 0x07,
+    LFS_TRACE_GETATTR           = 0x08,
+    LFS_TRACE_SETATTR           = 0x09,
+    LFS_TRACE_REMOVEATTR        = 0x0a,
+    LFS_TRACE_FILE_OPEN         = 0x10,
+    LFS_TRACE_FILE_OPENCFG      = 0x11,
+    LFS_TRACE_FILE_CLOSE        = 0x12,
+    LFS_TRACE_FILE_SYNC         = 0x13,
+    LFS_TRACE_FILE_READ         = 0x14,
+    LFS_TRACE_FILE_WRITE        = 0x15,
+    LFS_TRACE_FILE_SEEK         = 0x16,
+    LFS_TRACE_FILE_TRUNCATE     = 0x17,
+    LFS_TRACE_FILE_TELL         = 0x18,
+    LFS_TRACE_FILE_REWIND       = 0x19,
+    LFS_TRACE_FILE_SIZE         = 0x1a,
+    LFS_TRACE_FILE_MAP          = 0x1b,
+    LFS_TRACE_FILE_RESERVE      = 0x1c,
+    LFS_TRACE_MKDIR             = 0x20,
+    LFS_TRACE_DIR_OPEN          = 0x21,
+    LFS_TRACE_DIR_CLOSE         = 0x22,
+    LFS_TRACE_DIR_READ          = 0x23,
+    LFS_TRACE_DIR_SEEK          = 0x24,
+    LFS_TRACE_DIR_TELL          = 0x25,
+    LFS_TRACE_DIR_REWIND        = 0x26,
+    LFS_TRACE_FS_SIZE           = 0x30,
+    LFS_TRACE_FS_TRAVERSE       = 0x31,
+    LFS_TRACE_FS_GC             = 0x32,
+    LFS_TRACE_FS_BATCH_BEGIN    = 0x33,
+    LFS_TRACE_FS_BATCH_END      = 0x34,
+    LFS_TRACE_FS_BATCH_ABORT    = 0x35,
+    LFS_TRACE_FS_STATS          = 0x36,
+    LFS_TRACE_FS_STATS_RESET    = 0x37,
+
+    // Internal operations
+    LFS_TRACE_ALLOC_SCAN        = 0x40, // next lookahead window
+    LFS_TRACE_COMPACT           = 0x41, // pair[0], pair[1]
+    LFS_TRACE_SPLIT             = 0x42, // pair[0], pair[1]
+    LFS_TRACE_RELOCATE          = 0x43, // old block, new block
+    LFS_TRACE_BAD_BLOCK         = 0x44, // block
+
+    // Block device operations
+    LFS_TRACE_BD_READ           = 0x50, // block, off, size
+    LFS_TRACE_BD_PROG           = 0x51, // block, off, size
+    LFS_TRACE_BD_ERASE          = 0x52, // block
+    LFS_TRACE_BD_SYNC           = 0x53,
+
+    LFS_TRACE_RET               = 0x8000,
+};
+
+// One event as stored in the ring buffer, 24 bytes in the native byte order
+struct lfs_trace_record {
+    uint32_t seq;       // sequence number from 1, gaps mean lost events
+    uint32_t time;      // lfs_trace_clock when the event happened
+    uint16_t id;        // enum lfs_trace_id
+    uint16_t fs;        // low bits of the lfs_t address
+    uint32_t args[3];
+};
+
+
+#ifdef LFS_YES_TRACE_EVENTS
+// Clock for the event timestamps. This must be provided by the system and
+// may use any unit, such as microseconds from a hardware timer, and wrap
+uint32_t lfs_trace_clock(void);
+
+// Copy up to count of the oldest events from the ring buffer, starting at
+// the sequence number in cursor, and advance cursor past them. Start with
+// a cursor of zero. Events that were overwritten before they could be read
+// are skipped, which shows up as a gap in seq. Returns the number of
+// events copied.
+uint32_t lfs_trace_read(uint32_t *cursor,
+        struct lfs_trace_record *records, uint32_t count);
+#endif
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
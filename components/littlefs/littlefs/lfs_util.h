@@ -84,6 +84,25 @@ extern "C"
 #define LFS_ASSERT(test)
 #endif
 
+// Clock for the timing statistics, only needed with LFS_YES_STATS. This must
+// be provided by the system and may use any monotonic unit, such as
+// microseconds from a hardware timer
+#ifdef LFS_YES_STATS
+uint64_t lfs_stats_clock(void);
+#endif
+
+// Binary trace events, a cheap alternative to LFS_TRACE. The id is one of
+// enum lfs_trace_id in lfs_trace.h, and lfs_trace_event must be provided by
+// the system, for example by the ring buffer in lfs_trace.c
+#ifdef LFS_YES_TRACE_EVENTS
+#define LFS_TRACE_EVENT(lfs, id, a, b, c) \
+    lfs_trace_event(lfs, id, a, b, c)
+void lfs_trace_event(const void *lfs, uint16_t id,
+        uint32_t a, uint32_t b, uint32_t c);
+#else
+#define LFS_TRACE_EVENT(lfs, id, a, b, c)
+#endif
+
 
 // Builtin functions, these may be replaced by more efficient
 // toolchain-specific implementations. LFS_NO_INTRINSICS falls back to a more
@@ -11,10 +11,12 @@ TYPES = {
     (0x7ff, 0x001): 'name reg',
     (0x7ff, 0x002): 'name dir',
     (0x7ff, 0x0ff): 'name superblock',
+    (0x7ff, 0x1ff): 'name hash',
     (0x700, 0x200): 'struct',
     (0x7ff, 0x200): 'struct dir',
     (0x7ff, 0x202): 'struct ctz',
     (0x7ff, 0x201): 'struct inline',
+    (0x7ff, 0x203): 'struct idx',
     (0x700, 0x300): 'userattr',
     (0x700, 0x600): 'tail',
     (0x7ff, 0x600): 'tail soft',
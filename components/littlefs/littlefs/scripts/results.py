@@ -21,8 +21,17 @@ def main():
 
     runtime = time.time() - os.stat('blocks').st_ctime
 
-    print 'results: %dB %dB %dB %.3fs' % (
-        read_count, prog_count, erase_count, runtime)
+    # modeled flash time, only tracked by the ram/mmap block devices
+    modeled = ''
+    if os.path.exists('blocks/.time'):
+        with open('blocks/.time') as file:
+            read_time, prog_time, erase_time = (
+                struct.unpack('<QQQ', file.read()))
+        modeled = ' (modeled %.3fs read %.3fs prog %.3fs erase)' % (
+            read_time/1e9, prog_time/1e9, erase_time/1e9)
+
+    print 'results: %dB %dB %dB %.3fs%s' % (
+        read_count, prog_count, erase_count, runtime, modeled)
 
 if __name__ == "__main__":
     main(*sys.argv[1:])
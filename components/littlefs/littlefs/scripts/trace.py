@@ -0,0 +1,281 @@
+#!/usr/bin/env python2
+
+# Decodes the binary trace events stored by lfs_trace.c, see lfs_trace.h.
+# Prints a timeline of the API calls with the block device operations each
+# one caused, and with -s a summary per API call.
+
+import struct
+import sys
+import argparse
+
+# keep in sync with enum lfs_trace_id in lfs_trace.h
+CALLS = {
+    0x01: ('lfs_format',            ['block_size', 'block_count']),
+    0x02: ('lfs_mount',             ['block_size', 'block_count']),
+    0x03: ('lfs_unmount',           []),
+    0x04: ('lfs_migrate',           ['block_size', 'block_count']),
+    0x05: ('lfs_remove',            []),
+    0x06: ('lfs_rename',            []),
+    0x07: ('lfs_stat',              []),
+    0x08: ('lfs_getattr',           ['type', 'size']),
+    0x09: ('lfs_setattr',           ['type', 'size']),
+    0x0a: ('lfs_removeattr',        ['type']),
+    0x10: ('lfs_file_open',         ['file', 'flags']),
+    0x11: ('lfs_file_opencfg',      ['file', 'flags']),
+    0x12: ('lfs_file_close',        ['file']),
+    0x13: ('lfs_file_sync',         ['file']),
+    0x14: ('lfs_file_read',         ['file', 'size', 'pos']),
+    0x15: ('lfs_file_write',        ['file', 'size', 'pos']),
+    0x16: ('lfs_file_seek',         ['file', 'off', 'whence']),
+    0x17: ('lfs_file_truncate',     ['file', 'size']),
+    0x18: ('lfs_file_tell',         ['file']),
+    0x19: ('lfs_file_rewind',       ['file']),
+    0x1a: ('lfs_file_size',         ['file']),
+    0x1b: ('lfs_file_map',          ['file', 'off']),
+    0x1c: ('lfs_file_reserve',      ['file', 'size']),
+    0x20: ('lfs_mkdir',             []),
+    0x21: ('lfs_dir_open',          ['dir']),
+    0x22: ('lfs_dir_close',         ['dir']),
+    0x23: ('lfs_dir_read',          ['dir']),
+    0x24: ('lfs_dir_seek',          ['dir', 'off']),
+    0x25: ('lfs_dir_tell',          ['dir']),
+    0x26: ('lfs_dir_rewind',        ['dir']),
+    0x30: ('lfs_fs_size',           []),
+    0x31: ('lfs_fs_traverse',       []),
+    0x32: ('lfs_fs_gc',             []),
+    0x33: ('lfs_fs_batch_begin',    []),
+    0x34: ('lfs_fs_batch_end',      []),
+    0x35: ('lfs_fs_batch_abort',    []),
+    0x36: ('lfs_fs_stats',          []),
+    0x37: ('lfs_fs_stats_reset',    []),
+}
+
+EVENTS = {
+    0x40: ('alloc_scan',            ['off']),
+    0x41: ('compact',               ['pair0', 'pair1']),
+    0x42: ('split',                 ['pair0', 'pair1']),
+    0x43: ('relocate',              ['old', 'new']),
+    0x44: ('bad_block',             ['block']),
+    0x50: ('read',                  ['block', 'off', 'size']),
+    0x51: ('prog',                  ['block', 'off', 'size']),
+    0x52: ('erase',                 ['block']),
+    0x53: ('sync',                  []),
+}
+
+RET = 0x8000
+
+ERRORS = {
+    -5: 'LFS_ERR_IO',
+    -84: 'LFS_ERR_CORRUPT',
+    -2: 'LFS_ERR_NOENT',
+    -17: 'LFS_ERR_EXIST',
+    -20: 'LFS_ERR_NOTDIR',
+    -21: 'LFS_ERR_ISDIR',
+    -39: 'LFS_ERR_NOTEMPTY',
+    -9: 'LFS_ERR_BADF',
+    -27: 'LFS_ERR_FBIG',
+    -22: 'LFS_ERR_INVAL',
+    -28: 'LFS_ERR_NOSPC',
+    -12: 'LFS_ERR_NOMEM',
+    -61: 'LFS_ERR_NOATTR',
+    -36: 'LFS_ERR_NAMETOOLONG',
+}
+
+RECORD = struct.Struct('<IIHH3I')
+
+# block device operations and internal events counted per call
+COUNTERS = ['read', 'prog', 'erase', 'sync',
+    'alloc_scan', 'compact', 'split', 'relocate', 'bad_block']
+
+def signed(v):
+    return v - (1 << 32) if v & 0x80000000 else v
+
+def fmtarg(name, v):
+    if name in ('file', 'dir'):
+        return '%s=0x%08x' % (name, v)
+    elif name == 'flags':
+        return '%s=0x%x' % (name, v)
+    elif name == 'off':
+        return '%s=%d' % (name, signed(v))
+    else:
+        return '%s=%d' % (name, v)
+
+def fmtcall(names, args):
+    return ', '.join(fmtarg(n, a) for n, a in zip(names, args))
+
+def fmtret(v):
+    v = signed(v)
+    return ERRORS.get(v, str(v))
+
+class Call:
+    def __init__(self, fs, id, start, args):
+        self.fs = fs
+        self.id = id
+        self.start = start
+        self.end = None
+        self.args = args
+        self.ret = None
+        self.children = []
+        self.events = []
+        self.counts = dict((c, 0) for c in COUNTERS)
+        self.bytes = {'read': 0, 'prog': 0}
+
+    def name(self):
+        return CALLS[self.id][0] if self.id in CALLS else '%02x' % self.id
+
+    def duration(self):
+        return self.end - self.start if self.end is not None else None
+
+    def io(self):
+        parts = []
+        for c in ('read', 'prog'):
+            if self.counts[c]:
+                parts.append('%d %s %dB' % (self.counts[c], c, self.bytes[c]))
+        for c in COUNTERS[2:]:
+            if self.counts[c]:
+                parts.append('%d %s' % (self.counts[c], c))
+        return ', '.join(parts)
+
+def decode(files):
+    records = []
+    for path in files:
+        with (sys.stdin if path == '-' else open(path, 'rb')) as file:
+            data = file.read()
+        for off in range(0, len(data) - RECORD.size + 1, RECORD.size):
+            records.append(RECORD.unpack_from(data, off))
+
+    calls = []      # top-level calls in order
+    stacks = {}     # open calls per filesystem
+    orphans = Call(None, None, 0, [])
+    lost = 0
+    prevseq = None
+    prevtime = None
+    now = 0
+
+    for seq, time, id, fs, a, b, c in sorted(records):
+        if prevseq is not None and seq != prevseq + 1:
+            lost += seq - prevseq - 1
+            # calls in flight can't be trusted to see all their events
+            stacks = {}
+        prevseq = seq
+
+        # unwrap the 32-bit clock
+        if prevtime is not None:
+            now += (time - prevtime) & 0xffffffff
+        prevtime = time
+
+        stack = stacks.setdefault(fs, [])
+        if id & RET:
+            # pop until we find the matching call, in case events were lost
+            while stack:
+                call = stack.pop()
+                if call.id == id & ~RET:
+                    call.end = now
+                    call.ret = a
+                    break
+        elif id in CALLS:
+            call = Call(fs, id, now, [a, b, c])
+            if stack:
+                stack[-1].children.append(call)
+            else:
+                calls.append(call)
+            stack.append(call)
+        else:
+            event = (now, id, [a, b, c])
+            for call in stack or [orphans]:
+                if id in EVENTS:
+                    kind = EVENTS[id][0]
+                    call.counts[kind] += 1
+                    if kind in call.bytes:
+                        call.bytes[kind] += c
+            (stack[-1] if stack else orphans).events.append(event)
+
+    return calls, orphans, lost
+
+def timeline(calls, unit, verbose, depth=0):
+    for call in calls:
+        if call.end is not None:
+            ret = ' -> %s' % fmtret(call.ret)
+            dur = '%d%s' % (call.duration(), unit)
+        else:
+            ret = ' -> ?'
+            dur = '?'
+        io = call.io()
+        print('%12d %04x %s%s(%s)%s  [%s%s]' % (
+            call.start, call.fs, '  '*depth,
+            call.name(), fmtcall(CALLS.get(call.id, ('', []))[1], call.args),
+            ret, dur, ', ' + io if io else ''))
+
+        if verbose:
+            # interleave the events with the nested calls by time
+            items = ([(e[0], 0, e) for e in call.events] +
+                [(c.start, 1, c) for c in call.children])
+            for _, kind, item in sorted(items, key=lambda i: i[:2]):
+                if kind == 0:
+                    time, id, args = item
+                    name, names = EVENTS.get(id, ('%02x' % id, []))
+                    print('%12d %04x %s  %s(%s)' % (
+                        time, call.fs, '  '*depth,
+                        name, fmtcall(names, args)))
+                else:
+                    timeline([item], unit, verbose, depth+1)
+        else:
+            timeline(call.children, unit, verbose, depth+1)
+
+def summary(calls, orphans, unit):
+    ops = {}
+    for call in calls:
+        if call.end is None:
+            continue
+        op = ops.setdefault(call.name(), {
+            'count': 0, 'total': 0, 'max': 0,
+            'counts': dict((c, 0) for c in COUNTERS),
+            'bytes': {'read': 0, 'prog': 0}})
+        op['count'] += 1
+        op['total'] += call.duration()
+        op['max'] = max(op['max'], call.duration())
+        for c in COUNTERS:
+            op['counts'][c] += call.counts[c]
+        for c in op['bytes']:
+            op['bytes'][c] += call.bytes[c]
+
+    print('%-20s %7s %10s %10s %8s %8s %8s %8s %8s' % (
+        'call', 'count', 'avg '+unit, 'max '+unit,
+        'reads', 'read B', 'progs', 'prog B', 'erases'))
+    for name, op in sorted(ops.items()):
+        n = float(op['count'])
+        print('%-20s %7d %10.1f %10d %8.1f %8.1f %8.1f %8.1f %8.2f' % (
+            name, op['count'], op['total']/n, op['max'],
+            op['counts']['read']/n, op['bytes']['read']/n,
+            op['counts']['prog']/n, op['bytes']['prog']/n,
+            op['counts']['erase']/n))
+
+    io = orphans.io()
+    if io:
+        print('outside of calls: %s' % io)
+
+def main(args):
+    calls, orphans, lost = decode(args.files)
+
+    if lost:
+        sys.stderr.write('warning: %d events lost\n' % lost)
+
+    if args.summary:
+        summary(calls, orphans, args.unit)
+    else:
+        timeline(calls, args.unit, args.verbose)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Decode littlefs binary trace events.")
+    parser.add_argument('files', nargs='+',
+        help="Files of struct lfs_trace_record as copied out with "
+            "lfs_trace_read, or - for stdin.")
+    parser.add_argument('-s', '--summary', action='store_true',
+        help="Summarize time and block device operations per API call "
+            "instead of printing a timeline.")
+    parser.add_argument('-v', '--verbose', action='store_true',
+        help="Show each block device operation in the timeline.")
+    parser.add_argument('-u', '--unit', default='us',
+        help="Unit of lfs_trace_clock to show with times, default us.")
+    sys.exit(main(parser.parse_args()))
@@ -362,6 +362,32 @@ scripts/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Rename churn test ---"
+rm -rf blocks
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "churn") => 0;
+    memset(buffer, 'c', 64);
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "churn/a%d", i);
+        lfs_file_open(&lfs, &file, path,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_write(&lfs, &file, buffer, 64) => 64;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+
+    // renames alone must keep acknowledging the allocator, otherwise the
+    // relocations they cause eventually run out of lookahead
+    for (int i = 0; i < 4000; i++) {
+        char oldpath[32], newpath[32];
+        sprintf(oldpath, "churn/%c%d", (i/20) % 2 ? 'b' : 'a', i % 20);
+        sprintf(newpath, "churn/%c%d", (i/20) % 2 ? 'a' : 'b', i % 20);
+        lfs_rename(&lfs, oldpath, newpath) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Outdated lookahead test ---"
 scripts/test.py << TEST
     lfs_format(&lfs, &cfg) => 0;
@@ -481,4 +507,104 @@ scripts/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Reservation test ---"
+rm -rf blocks
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    // leave free space in short runs
+    for (int n = 0; n < 16; n++) {
+        sprintf(path, "scattered%d", n);
+        lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        for (lfs_size_t i = 0; i < 2*cfg.block_size; i += 8) {
+            lfs_file_write(&lfs, &file, "scatter!", 8) => 8;
+        }
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    for (int n = 0; n < 16; n += 2) {
+        sprintf(path, "scattered%d", n);
+        lfs_remove(&lfs, path) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+    lfs_size_t size = 16*cfg.block_size;
+    lfs_file_open(&lfs, &file, "reserved", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_ssize_t count = lfs_file_reserve(&lfs, &file, size);
+    (count > 16) => 1;
+    lfs_fs_size(&lfs) => before + count;
+    for (lfs_size_t i = 0; i < size; i++) {
+        uint8_t c = i * 13;
+        lfs_file_write(&lfs, &file, &c, 1) => 1;
+    }
+    lfs_fs_size(&lfs) => before + count;
+
+    // the file was written in order into one run of blocks
+    lfs_block_t block;
+    lfs_block_t prev = 0;
+    lfs_off_t boff;
+    for (lfs_off_t off = 0; off < size;) {
+        lfs_ssize_t res = lfs_file_map(&lfs, &file, off, &block, &boff);
+        (res > 0) => 1;
+        if (off > 0) {
+            block => prev + 1;
+        }
+        prev = block;
+        off += res;
+    }
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_fs_size(&lfs) => before + count;
+
+    lfs_file_open(&lfs, &file, "reserved", LFS_O_RDONLY) => 0;
+    for (lfs_size_t i = 0; i < size; i++) {
+        uint8_t c;
+        lfs_file_read(&lfs, &file, &c, 1) => 1;
+        c => (uint8_t)(i * 13);
+    }
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+    lfs_file_open(&lfs, &file, "reserved", LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    // appending copies the incomplete last block
+    lfs_file_reserve(&lfs, &file, 16*cfg.block_size) => 1;
+
+    // more than is free gets what can be found
+    lfs_ssize_t count = lfs_file_reserve(&lfs, &file,
+            cfg.block_count*cfg.block_size);
+    (count > 0) => 1;
+    (count < (lfs_ssize_t)(cfg.block_count - before)) => 1;
+    lfs_fs_size(&lfs) => before + count;
+
+    // which is given back when no longer needed
+    lfs_file_reserve(&lfs, &file, 0) => 0;
+    lfs_fs_size(&lfs) => before;
+    count = lfs_file_reserve(&lfs, &file, 24*cfg.block_size);
+    (count > 8) => 1;
+    lfs_fs_size(&lfs) => before + count;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_fs_size(&lfs) => before;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Lookahead prefill test ---"
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    // a fresh mount has nothing in the lookahead
+    (lfs.free.i == lfs.free.size) => 1;
+    lfs_fs_gc(&lfs) => 0;
+    (lfs.free.i < lfs.free.size) => 1;
+
+    // which the next allocation then uses
+    lfs_block_t off = lfs.free.off;
+    lfs_mkdir(&lfs, "prefilled") => 0;
+    lfs.free.off => off;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 scripts/results.py
@@ -0,0 +1,334 @@
+#!/bin/bash
+set -eu
+export TEST_FILE=$0
+trap 'export TEST_LINE=$LINENO' DEBUG
+
+echo "=== Batch tests ==="
+rm -rf blocks
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "batch") => 0;
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Batched closes ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_batch_begin(&lfs) => 0;
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_file_open(&lfs, &file, path, LFS_O_WRONLY) => 0;
+        sprintf((char*)buffer, "hello%d", i);
+        lfs_size_t size = strlen((char*)buffer);
+        lfs_file_write(&lfs, &file, buffer, size) => size;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+
+    // nothing should be on disk yet
+    lfs_t lfs2;
+    lfs_mount(&lfs2, &cfg) => 0;
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_stat(&lfs2, path, &info) => 0;
+        info.size => 0;
+    }
+    lfs_unmount(&lfs2) => 0;
+
+    // but we should see our own updates
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_stat(&lfs, path, &info) => 0;
+        info.size => strlen("hello0");
+        lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) => 0;
+        lfs_file_read(&lfs, &file, buffer, sizeof(buffer))
+                => strlen("hello0");
+        sprintf(path, "hello%d", i);
+        memcmp(buffer, path, strlen("hello0")) => 0;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+
+    lfs_fs_batch_end(&lfs) => 0;
+
+    lfs_mount(&lfs2, &cfg) => 0;
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_stat(&lfs2, path, &info) => 0;
+        info.size => strlen("hello0");
+    }
+    lfs_unmount(&lfs2) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) => 0;
+        lfs_file_read(&lfs, &file, buffer, sizeof(buffer))
+                => strlen("hello0");
+        sprintf(path, "hello%d", i);
+        memcmp(buffer, path, strlen("hello0")) => 0;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Batched commit size ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_t files[10];
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_file_open(&lfs, &files[i], path, LFS_O_WRONLY) => 0;
+        lfs_file_write(&lfs, &files[i], "a", 1) => 1;
+    }
+    uint32_t progs = bd.stats.prog_count;
+    for (int i = 0; i < 10; i++) {
+        lfs_file_sync(&lfs, &files[i]) => 0;
+    }
+    lfs_size_t unbatched = bd.stats.prog_count - progs;
+
+    for (int i = 0; i < 10; i++) {
+        lfs_file_write(&lfs, &files[i], "b", 1) => 1;
+    }
+    progs = bd.stats.prog_count;
+    lfs_fs_batch_begin(&lfs) => 0;
+    for (int i = 0; i < 10; i++) {
+        lfs_file_sync(&lfs, &files[i]) => 0;
+    }
+    lfs_fs_batch_end(&lfs) => 0;
+    lfs_size_t batched = bd.stats.prog_count - progs;
+    (batched < unbatched) => true;
+
+    for (int i = 0; i < 10; i++) {
+        lfs_file_close(&lfs, &files[i]) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Nested batches ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_batch_begin(&lfs) => 0;
+    lfs_file_open(&lfs, &file, "batch/file0", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file, "first", 5) => 5;
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_fs_batch_begin(&lfs) => 0;
+    lfs_file_open(&lfs, &file, "batch/file0", LFS_O_WRONLY | LFS_O_APPEND) => 0;
+    lfs_file_write(&lfs, &file, "second", 6) => 6;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_fs_batch_end(&lfs) => 0;
+
+    lfs_t lfs2;
+    lfs_mount(&lfs2, &cfg) => 0;
+    lfs_stat(&lfs2, "batch/file0", &info) => 0;
+    info.size => strlen("hello0");
+    lfs_unmount(&lfs2) => 0;
+
+    lfs_fs_batch_end(&lfs) => 0;
+    lfs_unmount(&lfs) => 0;
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "batch/file0", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 11;
+    memcmp(buffer, "firstsecond", 11) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Directory changes during batch ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_batch_begin(&lfs) => 0;
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+        lfs_file_write(&lfs, &file, "changed", 7) => 7;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+
+    // shift ids around the held back updates
+    lfs_file_open(&lfs, &file, "batch/aaa", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_remove(&lfs, "batch/file1") => 0;
+    // moves can't be part of the batch
+    lfs_rename(&lfs, "batch/file2", "batch/moved") => LFS_ERR_INVAL;
+    lfs_fs_batch_end(&lfs) => 0;
+    lfs_rename(&lfs, "batch/file2", "batch/moved") => 0;
+    lfs_unmount(&lfs) => 0;
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "batch/file1", &info) => LFS_ERR_NOENT;
+    lfs_stat(&lfs, "batch/file2", &info) => LFS_ERR_NOENT;
+    lfs_stat(&lfs, "batch/aaa", &info) => 0;
+    info.size => 0;
+    const char *names[] = {"batch/file0", "batch/moved", "batch/file3"};
+    for (int i = 0; i < 3; i++) {
+        lfs_file_open(&lfs, &file, names[i], LFS_O_RDONLY) => 0;
+        lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 7;
+        memcmp(buffer, "changed", 7) => 0;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    lfs_file_open(&lfs, &file, "batch/file4", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 6;
+    memcmp(buffer, "abllo4", 6) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Large files during batch ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_batch_begin(&lfs) => 0;
+    for (int i = 5; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+        memset(buffer, 'a'+i, sizeof(buffer));
+        for (lfs_size_t j = 0; j < 4*cfg.block_size; j += sizeof(buffer)) {
+            lfs_file_write(&lfs, &file, buffer, sizeof(buffer))
+                    => sizeof(buffer);
+        }
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    lfs_fs_batch_end(&lfs) => 0;
+    lfs_unmount(&lfs) => 0;
+
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 5; i < 10; i++) {
+        sprintf(path, "batch/file%d", i);
+        lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) => 0;
+        lfs_file_size(&lfs, &file) => 4*cfg.block_size;
+        for (lfs_size_t j = 0; j < 4*cfg.block_size; j += sizeof(buffer)) {
+            uint8_t rbuffer[sizeof(buffer)];
+            memset(buffer, 'a'+i, sizeof(buffer));
+            lfs_file_read(&lfs, &file, rbuffer, sizeof(rbuffer))
+                    => sizeof(rbuffer);
+            memcmp(rbuffer, buffer, sizeof(buffer)) => 0;
+        }
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Aborted batch ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_batch_begin(&lfs) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file, "aborted", 7) => 7;
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_t files[2];
+    lfs_file_open(&lfs, &files[0], "batch/file4", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &files[0], "aborted", 7) => 7;
+    lfs_file_sync(&lfs, &files[0]) => 0;
+    lfs_file_open(&lfs, &files[1], "batch/file4", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &files[1], buffer, sizeof(buffer)) => 7;
+    memcmp(buffer, "aborted", 7) => 0;
+
+    lfs_fs_batch_abort(&lfs) => 0;
+    lfs_file_close(&lfs, &files[1]) => 0;
+    lfs_file_write(&lfs, &files[0], "again", 5) => 5;
+    lfs_file_close(&lfs, &files[0]);
+
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 7;
+    memcmp(buffer, "changed", 7) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 7;
+    memcmp(buffer, "changed", 7) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_file_open(&lfs, &file, "batch/file4", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 6;
+    memcmp(buffer, "abllo4", 6) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Custom attributes during batch ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    uint8_t attr[4] = "v1";
+    struct lfs_attr attrs[] = {{'A', attr, sizeof(attr)}};
+    struct lfs_file_config filecfg = {.attrs = attrs, .attr_count = 1};
+    lfs_fs_batch_begin(&lfs) => 0;
+    lfs_file_opencfg(&lfs, &file, "batch/file3",
+            LFS_O_WRONLY | LFS_O_TRUNC, &filecfg) => 0;
+    lfs_file_write(&lfs, &file, "attrs", 5) => 5;
+    // can't be held back, and isn't committed behind the batch's back
+    lfs_file_sync(&lfs, &file) => LFS_ERR_INVAL;
+    lfs_fs_batch_abort(&lfs) => 0;
+    lfs_file_sync(&lfs, &file) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 5;
+    memcmp(buffer, "attrs", 5) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_getattr(&lfs, "batch/file3", 'A', buffer, 4) => 4;
+    memcmp(buffer, "v1", 3) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Transaction power-loss ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file, "config-v1", 9) => 9;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_file_open(&lfs, &file, "batch/file4", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file, "sum-v1", 6) => 6;
+    lfs_file_close(&lfs, &file) => 0;
+
+    // write both files, but lose power before the batch ends
+    lfs_fs_batch_begin(&lfs) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file, "config-v2", 9) => 9;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_file_open(&lfs, &file, "batch/file4", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file, "sum-v2", 6) => 6;
+    lfs_file_close(&lfs, &file) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 9;
+    memcmp(buffer, "config-v1", 9) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_file_open(&lfs, &file, "batch/file4", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 6;
+    memcmp(buffer, "sum-v1", 6) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Unmount during batch ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_batch_begin(&lfs) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_WRONLY | LFS_O_TRUNC) => 0;
+    lfs_file_write(&lfs, &file, "unmounted", 9) => 9;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "batch/file3", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 9;
+    memcmp(buffer, "unmounted", 9) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+scripts/results.py
@@ -486,4 +486,173 @@ scripts/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Multi-block directory with mixed-size entries ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "mixed") => 0;
+    // appends first, then inserts between them, with names and inline
+    // data of different sizes so splits can't just halve the entry count
+    for (int i = 0; i < 2*$LARGESIZE; i++) {
+        int j = (i < $LARGESIZE) ? 2*i : 2*((i*7) % $LARGESIZE) + 1;
+        sprintf(path, "mixed/%0*d", 4 + j % 13, j);
+        lfs_size_t size = (j*13) % 97;
+        memset(buffer, 'a' + j % 26, size);
+        lfs_file_open(&lfs, &file, path,
+                LFS_O_WRONLY | LFS_O_CREAT | LFS_O_EXCL) => 0;
+        lfs_file_write(&lfs, &file, buffer, size) => size;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    // every metadata pair the directory was split into holds entries
+    lfs_dir_open(&lfs, &dir, "mixed") => 0;
+    lfs_block_t pair = dir.m.pair[0];
+    int pairs = 1;
+    int count = 0;
+    while (lfs_dir_read(&lfs, &dir, &info) == 1) {
+        if (dir.m.pair[0] != pair) {
+            pair = dir.m.pair[0];
+            pairs += 1;
+        }
+        (dir.m.count > 0 && dir.m.off <= cfg.block_size) => true;
+        count += 1;
+    }
+    lfs_dir_close(&lfs, &dir) => 0;
+    (pairs > 1) => true;
+    count => 2 + 2*$LARGESIZE;
+
+    for (int j = 0; j < 2*$LARGESIZE; j++) {
+        sprintf(path, "mixed/%0*d", 4 + j % 13, j);
+        lfs_size_t size = (j*13) % 97;
+        lfs_stat(&lfs, path, &info) => 0;
+        info.type => LFS_TYPE_REG;
+        info.size => size;
+        lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) => 0;
+        lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => size;
+        for (lfs_size_t k = 0; k < size; k++) {
+            buffer[k] => 'a' + j % 26;
+        }
+        lfs_file_close(&lfs, &file) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Early compaction ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "gc") => 0;
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "gc/file%03d", i);
+        lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+
+    // gc skips compaction when a compacted pair wouldn't have room for
+    // another commit, mirror that threshold here
+    lfs_size_t split = cfg.split_size ? cfg.split_size : cfg.block_size/2;
+    split = ((split + cfg.prog_size-1) / cfg.prog_size) * cfg.prog_size;
+    if (split > cfg.block_size - 36) {
+        split = cfg.block_size - 36;
+    }
+    lfs_size_t thresh = cfg.compact_thresh
+            ? cfg.compact_thresh
+            : cfg.block_size - cfg.block_size/8;
+    lfs_size_t thresh_min = ((split + 36 + cfg.prog_size-1)
+            / cfg.prog_size) * cfg.prog_size;
+    if (thresh < thresh_min) {
+        thresh = thresh_min;
+    }
+    bool compacts = cfg.prog_size <= cfg.block_size/16 &&
+            thresh < cfg.block_size - cfg.prog_size;
+
+    for (int i = 0; i < 100; i++) {
+        lfs_fs_gc(&lfs) => 0;
+        uint64_t erases = bd.stats.erase_count;
+        lfs_setattr(&lfs, "gc/file000", 'A', &i, sizeof(i)) => 0;
+        (!compacts || bd.stats.erase_count == erases) => true;
+    }
+
+    lfs_fs_gc(&lfs) => 0;
+    uint64_t erases = bd.stats.erase_count;
+    lfs_fs_gc(&lfs) => 0;
+    bd.stats.erase_count => erases;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    int i;
+    lfs_getattr(&lfs, "gc/file000", 'A', &i, sizeof(i)) => sizeof(i);
+    i => 99;
+    for (int j = 0; j < 4; j++) {
+        sprintf(path, "gc/file%03d", j);
+        lfs_stat(&lfs, path, &info) => 0;
+        info.type => LFS_TYPE_REG;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Tag index ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_mkdir(&lfs, "tindex") => 0;
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "tindex/file%03d", i);
+        lfs_file_open(&lfs, &file, path,
+                LFS_O_WRONLY | LFS_O_CREAT) => 0;
+        lfs_file_write(&lfs, &file, buffer, i) => i;
+        lfs_file_close(&lfs, &file) => 0;
+    }
+
+    // deletes and renames shift the ids of the entries after them
+    for (int i = 0; i < 40; i += 3) {
+        sprintf(path, "tindex/file%03d", i);
+        lfs_remove(&lfs, path) => 0;
+    }
+    for (int i = 1; i < 40; i += 6) {
+        sprintf(path, "tindex/file%03d", i);
+        char newpath[64];
+        sprintf(newpath, "tindex/a%03d", i);
+        lfs_rename(&lfs, path, newpath) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "tindex/%s%03d", (i % 6 == 1) ? "a" : "file", i);
+        lfs_stat(&lfs, path, &info) => (i % 3 == 0) ? LFS_ERR_NOENT : 0;
+        if (i % 3 != 0) {
+            info.type => LFS_TYPE_REG;
+            info.size => i;
+        }
+    }
+
+    lfs_dir_open(&lfs, &dir, "tindex") => 0;
+    lfs_dir_read(&lfs, &dir, &info) => 1;
+    strcmp(info.name, ".") => 0;
+    lfs_dir_read(&lfs, &dir, &info) => 1;
+    strcmp(info.name, "..") => 0;
+    for (int i = 1; i < 40; i += 6) {
+        lfs_dir_read(&lfs, &dir, &info) => 1;
+        sprintf(path, "a%03d", i);
+        strcmp(info.name, path) => 0;
+        info.size => i;
+    }
+    for (int i = 0; i < 40; i++) {
+        if (i % 3 == 0 || i % 6 == 1) {
+            continue;
+        }
+        lfs_dir_read(&lfs, &dir, &info) => 1;
+        sprintf(path, "file%03d", i);
+        strcmp(info.name, path) => 0;
+        info.type => LFS_TYPE_REG;
+        info.size => i;
+    }
+    lfs_dir_read(&lfs, &dir, &info) => 0;
+    lfs_dir_close(&lfs, &dir) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 scripts/results.py
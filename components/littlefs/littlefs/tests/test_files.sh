@@ -218,4 +218,139 @@ scripts/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Statistics test ---"
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+#ifdef LFS_YES_STATS
+    struct lfs_stats stats;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_stats(&lfs, &stats) => 0;
+    stats.prog_count => 0;
+    stats.erase_count => 0;
+
+    memset(buffer, 'x', sizeof(buffer));
+    lfs_file_open(&lfs, &file, "stats", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    for (lfs_size_t i = 0; i < 4*cfg.block_size; i += sizeof(buffer)) {
+        lfs_file_write(&lfs, &file, buffer, sizeof(buffer))
+                => sizeof(buffer);
+    }
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_fs_stats(&lfs, &stats) => 0;
+    (stats.prog_bytes >= 4*cfg.block_size) => 1;
+    (stats.erase_count >= 4) => 1;
+    stats.erase_bytes => stats.erase_count*cfg.block_size;
+    (stats.pcache_misses > 0) => 1;
+
+    lfs_fs_stats_reset(&lfs) => 0;
+    lfs_fs_stats(&lfs, &stats) => 0;
+    stats.read_count => 0;
+    stats.read_bytes => 0;
+
+    lfs_file_open(&lfs, &file, "stats", LFS_O_RDONLY) => 0;
+    for (lfs_size_t i = 0; i < 4*cfg.block_size; i += sizeof(buffer)) {
+        lfs_file_read(&lfs, &file, buffer, sizeof(buffer))
+                => sizeof(buffer);
+    }
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_fs_stats(&lfs, &stats) => 0;
+    (stats.read_bytes >= 4*cfg.block_size) => 1;
+    stats.rcache_misses => stats.read_count;
+    stats.prog_count => 0;
+    stats.erase_count => 0;
+    lfs_unmount(&lfs) => 0;
+#endif
+TEST
+
+echo "--- Trace events test ---"
+rm -f trace.bin
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+#ifdef LFS_YES_TRACE_EVENTS
+    static struct lfs_trace_record records[LFS_TRACE_BUFFER_SIZE];
+    uint32_t cursor = 0;
+    lfs_trace_read(&cursor, records, LFS_TRACE_BUFFER_SIZE);
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "trace", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_file_write(&lfs, &file, buffer, 16) => 16;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+
+    uint32_t n = lfs_trace_read(&cursor, records, LFS_TRACE_BUFFER_SIZE);
+    lfs_trace_read(&cursor, records, LFS_TRACE_BUFFER_SIZE) => 0;
+    records[0].id => LFS_TRACE_MOUNT;
+    records[n-1].id => LFS_TRACE_UNMOUNT | LFS_TRACE_RET;
+    records[n-1].args[0] => 0;
+
+    uint32_t depth = 0;
+    uint32_t progs = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        records[i].seq => records[0].seq + i;
+        if (records[i].id == LFS_TRACE_FILE_CLOSE) {
+            depth += 1;
+        } else if (records[i].id == (LFS_TRACE_FILE_CLOSE | LFS_TRACE_RET)) {
+            depth -= 1;
+        } else if (records[i].id == LFS_TRACE_BD_PROG && depth > 0) {
+            progs += 1;
+        }
+    }
+    depth => 0;
+    (progs > 0) => 1;
+
+    FILE *f = fopen("trace.bin", "wb");
+    fwrite(records, sizeof(struct lfs_trace_record), n, f) => n;
+    fclose(f) => 0;
+#endif
+TEST
+if [ -f trace.bin ]
+then
+    scripts/trace.py -s trace.bin
+    rm trace.bin
+fi
+
+echo "--- File map test ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "mapped",
+            LFS_O_RDWR | LFS_O_CREAT | LFS_O_TRUNC) => 0;
+    for (lfs_size_t i = 0; i < $MEDIUMSIZE; i++) {
+        uint8_t c = i * 7;
+        lfs_file_write(&lfs, &file, &c, 1) => 1;
+    }
+
+    // pending writes are flushed before mapping
+    lfs_block_t block;
+    lfs_off_t boff;
+    static uint8_t bbuffer[LFS_BLOCK_SIZE];
+    lfs_off_t off = 0;
+    while (off < $MEDIUMSIZE) {
+        lfs_ssize_t size = lfs_file_map(&lfs, &file, off, &block, &boff);
+        (size > 0) => 1;
+        (boff + size <= LFS_BLOCK_SIZE) => 1;
+        cfg.read(&cfg, block, 0, bbuffer, LFS_BLOCK_SIZE) => 0;
+        for (lfs_ssize_t i = 0; i < size; i++) {
+            bbuffer[boff+i] => (uint8_t)((off+i) * 7);
+        }
+        off += size;
+    }
+    off => $MEDIUMSIZE;
+    lfs_file_map(&lfs, &file, off, &block, &boff) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_open(&lfs, &file, "mapped", LFS_O_RDONLY) => 0;
+    lfs_file_map(&lfs, &file, $MEDIUMSIZE-1, &block, &boff) => 1;
+    cfg.read(&cfg, block, 0, bbuffer, LFS_BLOCK_SIZE) => 0;
+    bbuffer[boff] => (uint8_t)(($MEDIUMSIZE-1) * 7);
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_open(&lfs, &file, "inline", LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    // small enough to stay inline even with the smallest cache
+    lfs_file_write(&lfs, &file, "inl", 3) => 3;
+    lfs_file_map(&lfs, &file, 0, &block, &boff) => LFS_ERR_INVAL;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 scripts/results.py
@@ -48,4 +48,137 @@ scripts/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Name hash formatting ---"
+scripts/test.py << TEST
+    struct lfs_config hcfg = cfg;
+    hcfg.name_hash = true;
+    lfs_format(&lfs, &hcfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.disk_version => 0x00020001;
+    (lfs.features & LFS_FEATURE_NAMEHASH) => LFS_FEATURE_NAMEHASH;
+    for (int i = 0; i < 64; i++) {
+        sprintf(path, "hash%03d", i);
+        lfs_mkdir(&lfs, path) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 0; i < 64; i++) {
+        sprintf(path, "hash%03d", i);
+        lfs_stat(&lfs, path, &info) => 0;
+        strcmp(info.name, path) => 0;
+    }
+    lfs_stat(&lfs, "hash064", &info) => LFS_ERR_NOENT;
+    lfs_rename(&lfs, "hash000", "renamed") => 0;
+    lfs_stat(&lfs, "hash000", &info) => LFS_ERR_NOENT;
+    lfs_stat(&lfs, "renamed", &info) => 0;
+    lfs_file_open(&lfs, &file, "renamed/file",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_stat(&lfs, "renamed/file", &info) => 0;
+    lfs_file_open(&lfs, &file, "renamed/missing", LFS_O_RDONLY)
+            => LFS_ERR_NOENT;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Mount checkpoint ---"
+scripts/test.py << TEST
+    struct lfs_config ccfg = cfg;
+    ccfg.name_hash = false;
+    ccfg.mount_checkpoint = true;
+    lfs_format(&lfs, &ccfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.disk_version => 0x00020001;
+    lfs.features => LFS_FEATURE_CHECKPOINT;
+    lfs.checkpoint => 1;
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "ckpt%02d", i);
+        lfs_mkdir(&lfs, path) => 0;
+    }
+    lfs.checkpoint => 2;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.checkpoint => 1;
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "ckpt%02d", i);
+        lfs_stat(&lfs, path, &info) => 0;
+    }
+    lfs_rename(&lfs, "ckpt00", "ckpt99") => 0;
+    lfs_mkdir(&lfs, "parent") => 0;
+    lfs_mkdir(&lfs, "parent/orphan") => 0;
+    lfs_mkdir(&lfs, "parent/child") => 0;
+    lfs_remove(&lfs, "parent/orphan") => 0;
+TEST
+# lose power before the last commit fixing the orphan, the checkpoint
+# must not hide the orphan from the next mount
+scripts/corrupt.py
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.checkpoint => 3;
+    lfs.gstate.tag >> 31 => 1;
+    lfs_stat(&lfs, "ckpt99", &info) => 0;
+    lfs_stat(&lfs, "parent/orphan", &info) => LFS_ERR_NOENT;
+    lfs_fs_gc(&lfs) => 0;
+    lfs.gstate.tag >> 31 => 0;
+    lfs.checkpoint => 3;
+    lfs_fs_gc(&lfs) => 0;
+    lfs.checkpoint => 1;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.checkpoint => 1;
+    lfs.gstate.tag >> 31 => 0;
+    lfs_stat(&lfs, "ckpt99", &info) => 0;
+    lfs_stat(&lfs, "parent/child", &info) => 0;
+    lfs_file_open(&lfs, &file, "parent/file",
+            LFS_O_WRONLY | LFS_O_CREAT) => 0;
+    lfs_fs_gc(&lfs) => 0;
+    lfs_fs_gc(&lfs) => 0;
+    lfs.checkpoint => 3;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.checkpoint => 1;
+    lfs_stat(&lfs, "parent/file", &info) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Mount checkpoint after superblock expansion ---"
+scripts/test.py << TEST
+    struct lfs_config ccfg = cfg;
+    ccfg.mount_checkpoint = true;
+    ccfg.block_cycles = 2;
+    lfs_format(&lfs, &ccfg) => 0;
+    lfs_mount(&lfs, &ccfg) => 0;
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "expand%02d", i);
+        lfs_mkdir(&lfs, path) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+
+    // the superblock moved on from {0,1} while mounted, the checkpoint
+    // must have been written next to it
+    lfs_mount(&lfs, &ccfg) => 0;
+    (lfs.root[0] > 1 && lfs.root[1] > 1) => true;
+    lfs.checkpoint => 1;
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "expand%02d", i);
+        lfs_stat(&lfs, path, &info) => 0;
+    }
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Formatting without name hashes ---"
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.features => (LFS_NAME_HASH ? LFS_FEATURE_NAMEHASH : 0)
+            | (LFS_MOUNT_CHECKPOINT ? LFS_FEATURE_CHECKPOINT : 0);
+    lfs.disk_version => lfs.features ? 0x00020001 : 0x00020000;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 scripts/results.py
@@ -0,0 +1,466 @@
+#!/bin/bash
+set -eu
+export TEST_FILE=$0
+trap 'export TEST_LINE=$LINENO' DEBUG
+
+echo "=== Indexed file tests ==="
+
+# big enough for two levels of index blocks
+SIZE="((cfg.block_size/4 + 32)*cfg.block_size)"
+PATTERN="(uint8_t)(i ^ (i >> 8) ^ (i >> 16))"
+
+rm -rf blocks
+scripts/test.py << TEST
+    struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_opencfg(&lfs, &file, "indexed",
+            LFS_O_WRONLY | LFS_O_CREAT, &fcfg) => LFS_ERR_INVAL;
+    lfs_unmount(&lfs) => 0;
+
+    struct lfs_config icfg = cfg;
+    icfg.name_hash = false;
+    icfg.mount_checkpoint = false;
+    icfg.indexed_files = true;
+    lfs_format(&lfs, &icfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs.disk_version => 0x00020001;
+    lfs.features => LFS_FEATURE_INDEXED;
+    lfs_unmount(&lfs) => 0;
+
+    icfg.name_hash = LFS_NAME_HASH;
+    icfg.mount_checkpoint = LFS_MOUNT_CHECKPOINT;
+    lfs_format(&lfs, &icfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Sequential write ---"
+scripts/test.py << TEST
+    struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_opencfg(&lfs, &file, "indexed",
+            LFS_O_WRONLY | LFS_O_CREAT, &fcfg) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+
+    lfs_file_opencfg(&lfs, &file, "indexed", LFS_O_WRONLY, &fcfg) => 0;
+    for (lfs_size_t i = 0; i < $SIZE; i++) {
+        uint8_t c = $PATTERN;
+        lfs_file_write(&lfs, &file, &c, 1) => 1;
+    }
+    lfs_file_close(&lfs, &file) => 0;
+
+    // data blocks, a root and two index blocks below it
+    lfs_fs_size(&lfs) => before + $SIZE/cfg.block_size + 3;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "indexed", &info) => 0;
+    info.size => $SIZE;
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDONLY) => 0;
+    for (lfs_size_t i = 0; i < $SIZE; i++) {
+        uint8_t c;
+        lfs_file_read(&lfs, &file, &c, 1) => 1;
+        c => $PATTERN;
+    }
+    lfs_file_read(&lfs, &file, &(uint8_t){0}, 1) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Random writes ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+    bool insuper = (lfs.root[0] <= 1 && lfs.root[1] <= 1);
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDWR) => 0;
+    uint32_t prng = 1;
+    for (int j = 0; j < 100; j++) {
+        prng = prng*1103515245 + 12345;
+        lfs_off_t off = (prng >> 8) % ($SIZE - 16);
+        for (int k = 0; k < 16; k++) {
+            buffer[k] = ~(uint8_t)(off + k);
+        }
+        lfs_file_seek(&lfs, &file, off, LFS_SEEK_SET) => off;
+        lfs_file_write(&lfs, &file, buffer, 16) => 16;
+        if (j % 10 == 0) {
+            lfs_file_sync(&lfs, &file) => 0;
+        }
+    }
+
+    // writes across a block boundary
+    lfs_file_seek(&lfs, &file, 3*cfg.block_size - 8, LFS_SEEK_SET)
+            => 3*cfg.block_size - 8;
+    memset(buffer, 0xaa, 16);
+    lfs_file_write(&lfs, &file, buffer, 16) => 16;
+    lfs_file_close(&lfs, &file) => 0;
+
+    // old copies of the blocks are free again, the root only leaves the
+    // superblock's pair if that pair was expanded, which takes a new pair
+    bool expanded = insuper && (lfs.root[0] > 1 || lfs.root[1] > 1);
+    lfs_fs_size(&lfs) => before + (expanded ? 2 : 0);
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "indexed", &info) => 0;
+    info.size => $SIZE;
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDONLY) => 0;
+    uint32_t prng = 1;
+    for (int j = 0; j < 100; j++) {
+        prng = prng*1103515245 + 12345;
+        lfs_off_t off = (prng >> 8) % ($SIZE - 16);
+        if (off + 16 > 3*cfg.block_size - 8 && off < 3*cfg.block_size + 8) {
+            continue;
+        }
+        lfs_file_seek(&lfs, &file, off, LFS_SEEK_SET) => off;
+        lfs_file_read(&lfs, &file, buffer, 16) => 16;
+        for (int k = 0; k < 16; k++) {
+            buffer[k] => (uint8_t)~(uint8_t)(off + k);
+        }
+    }
+
+    lfs_file_seek(&lfs, &file, 3*cfg.block_size - 8, LFS_SEEK_SET)
+            => 3*cfg.block_size - 8;
+    lfs_file_read(&lfs, &file, buffer, 16) => 16;
+    for (int k = 0; k < 16; k++) {
+        buffer[k] => 0xaa;
+    }
+
+    lfs_file_seek(&lfs, &file, $SIZE - 1, LFS_SEEK_SET) => $SIZE - 1;
+    lfs_file_read(&lfs, &file, buffer, 16) => 1;
+    lfs_size_t i = $SIZE - 1;
+    buffer[0] => $PATTERN;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Truncate and grow ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDWR) => 0;
+    lfs_file_truncate(&lfs, &file, 4*cfg.block_size + 100) => 0;
+    lfs_file_size(&lfs, &file) => 4*cfg.block_size + 100;
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDWR) => 0;
+    lfs_file_seek(&lfs, &file, 4*cfg.block_size, LFS_SEEK_SET)
+            => 4*cfg.block_size;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 100;
+    for (lfs_size_t i = 4*cfg.block_size; i < 4*cfg.block_size + 50; i++) {
+        buffer[i - 4*cfg.block_size] => $PATTERN;
+    }
+
+    // grow past the end, the gap reads as zeros
+    lfs_file_seek(&lfs, &file, 6*cfg.block_size, LFS_SEEK_SET)
+            => 6*cfg.block_size;
+    lfs_file_write(&lfs, &file, "end", 3) => 3;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "indexed", &info) => 0;
+    info.size => 6*cfg.block_size + 3;
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDWR) => 0;
+    lfs_file_seek(&lfs, &file, 4*cfg.block_size + 100, LFS_SEEK_SET)
+            => 4*cfg.block_size + 100;
+    for (lfs_size_t i = 0; i < 2*cfg.block_size - 100; i++) {
+        uint8_t c;
+        lfs_file_read(&lfs, &file, &c, 1) => 1;
+        c => 0;
+    }
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 3;
+    memcmp(buffer, "end", 3) => 0;
+
+    lfs_file_truncate(&lfs, &file, 10) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 10;
+    for (lfs_size_t i = 0; i < 10; i++) {
+        buffer[i] => $PATTERN;
+    }
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDWR) => 0;
+    lfs_file_truncate(&lfs, &file, 0) => 0;
+    lfs_file_write(&lfs, &file, "hello", 5) => 5;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 5;
+    memcmp(buffer, "hello", 5) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Inline file outlined as indexed ---"
+scripts/test.py << TEST
+    struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_file_opencfg(&lfs, &file, "small",
+            LFS_O_WRONLY | LFS_O_CREAT, &fcfg) => 0;
+    lfs_file_write(&lfs, &file, "0123456789", 10) => 10;
+    lfs_file_close(&lfs, &file) => 0;
+
+    // write from the middle of the inline data past what fits inline
+    lfs_file_opencfg(&lfs, &file, "small", LFS_O_WRONLY, &fcfg) => 0;
+    lfs_file_seek(&lfs, &file, 5, LFS_SEEK_SET) => 5;
+    memset(buffer, 'x', cfg.block_size);
+    lfs_file_write(&lfs, &file, buffer, cfg.block_size) => cfg.block_size;
+    lfs_file_close(&lfs, &file) => 0;
+
+    // a random write only rewrites the one block
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+    lfs_file_open(&lfs, &file, "small", LFS_O_WRONLY) => 0;
+    lfs_file_seek(&lfs, &file, 2, LFS_SEEK_SET) => 2;
+    lfs_file_write(&lfs, &file, "yy", 2) => 2;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_fs_size(&lfs) => before;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "small", &info) => 0;
+    info.size => 5 + cfg.block_size;
+    lfs_file_open(&lfs, &file, "small", LFS_O_RDONLY) => 0;
+    lfs_file_read(&lfs, &file, buffer, 5) => 5;
+    memcmp(buffer, "01yy4", 5) => 0;
+    for (lfs_size_t i = 0; i < cfg.block_size; i++) {
+        uint8_t c;
+        lfs_file_read(&lfs, &file, &c, 1) => 1;
+        c => 'x';
+    }
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Sparse holes ---"
+scripts/test.py << TEST
+    struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+    lfs_file_opencfg(&lfs, &file, "sparse",
+            LFS_O_WRONLY | LFS_O_CREAT, &fcfg) => 0;
+    lfs_file_seek(&lfs, &file, 10*cfg.block_size + 7, LFS_SEEK_SET)
+            => 10*cfg.block_size + 7;
+    lfs_file_write(&lfs, &file, "x", 1) => 1;
+    lfs_file_close(&lfs, &file) => 0;
+
+    // only the written block and the root are stored
+    lfs_fs_size(&lfs) => before + 2;
+
+    lfs_file_open(&lfs, &file, "sparse", LFS_O_RDWR) => 0;
+    lfs_file_truncate(&lfs, &file, 40*cfg.block_size + 3) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_fs_size(&lfs) => before + 2;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "sparse", &info) => 0;
+    info.size => 40*cfg.block_size + 3;
+    lfs_file_open(&lfs, &file, "sparse", LFS_O_RDWR) => 0;
+    for (lfs_size_t i = 0; i < 40*cfg.block_size + 3; i++) {
+        uint8_t c;
+        lfs_file_read(&lfs, &file, &c, 1) => 1;
+        c => (i == 10*cfg.block_size + 7) ? 'x' : 0;
+    }
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 0;
+
+    // writes into a hole fill in just that block
+    lfs_file_seek(&lfs, &file, 20*cfg.block_size + 100, LFS_SEEK_SET)
+            => 20*cfg.block_size + 100;
+    lfs_file_write(&lfs, &file, "y", 1) => 1;
+    lfs_file_seek(&lfs, &file, 40*cfg.block_size + 1, LFS_SEEK_SET)
+            => 40*cfg.block_size + 1;
+    lfs_file_write(&lfs, &file, "z", 1) => 1;
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_open(&lfs, &file, "sparse", LFS_O_RDONLY) => 0;
+    lfs_file_size(&lfs, &file) => 40*cfg.block_size + 3;
+    for (lfs_size_t i = 0; i < 40*cfg.block_size + 3; i++) {
+        uint8_t c;
+        lfs_file_read(&lfs, &file, &c, 1) => 1;
+        c => (i == 10*cfg.block_size + 7) ? 'x'
+            : (i == 20*cfg.block_size + 100) ? 'y'
+            : (i == 40*cfg.block_size + 1) ? 'z' : 0;
+    }
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_block_t block;
+    lfs_off_t off;
+    lfs_file_open(&lfs, &file, "sparse", LFS_O_RDONLY) => 0;
+    lfs_file_map(&lfs, &file, 0, &block, &off) => LFS_ERR_INVAL;
+    lfs_file_map(&lfs, &file, 10*cfg.block_size, &block, &off)
+            => cfg.block_size;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_remove(&lfs, "sparse") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Sparse file larger than the device ---"
+scripts/test.py << TEST
+    struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+    lfs_size_t depth = 0;
+    for (lfs_size_t span = 1; span < 2*cfg.block_count;
+            span *= cfg.block_size/4) {
+        depth += 1;
+    }
+
+    lfs_file_opencfg(&lfs, &file, "sparse",
+            LFS_O_WRONLY | LFS_O_CREAT, &fcfg) => 0;
+    lfs_file_write(&lfs, &file, "x", 1) => 1;
+    lfs_file_sync(&lfs, &file) => 0;
+
+    // growing over the holes only writes the data block and one path
+    // through the index
+    uint64_t erases = bd.stats.erase_count;
+    lfs_file_truncate(&lfs, &file, 2*cfg.block_count*cfg.block_size) => 0;
+    (bd.stats.erase_count - erases <= (1 + depth)*cfg.block_size) => true;
+    lfs_file_close(&lfs, &file) => 0;
+    (lfs_fs_size(&lfs) <= before + 1 + (lfs_ssize_t)depth) => true;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "sparse", &info) => 0;
+    info.size => 2*cfg.block_count*cfg.block_size;
+    lfs_file_open(&lfs, &file, "sparse", LFS_O_RDWR) => 0;
+    lfs_file_seek(&lfs, &file, 3*cfg.block_count*cfg.block_size/2,
+            LFS_SEEK_SET) => 3*cfg.block_count*cfg.block_size/2;
+    lfs_file_write(&lfs, &file, "y", 1) => 1;
+    lfs_file_close(&lfs, &file) => 0;
+
+    lfs_file_open(&lfs, &file, "sparse", LFS_O_RDONLY) => 0;
+    for (lfs_size_t i = 0; i < 2*cfg.block_count*cfg.block_size;
+            i += sizeof(buffer)) {
+        lfs_file_read(&lfs, &file, buffer, sizeof(buffer))
+                => sizeof(buffer);
+        for (lfs_size_t j = 0; j < sizeof(buffer); j++) {
+            buffer[j] => (i+j == 0) ? 'x'
+                : (i+j == 3*cfg.block_count*cfg.block_size/2) ? 'y' : 0;
+        }
+    }
+    lfs_file_read(&lfs, &file, buffer, sizeof(buffer)) => 0;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_remove(&lfs, "sparse") => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Indexed file traversal ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_remove(&lfs, "indexed") => 0;
+    lfs_remove(&lfs, "small") => 0;
+    lfs_ssize_t before = lfs_fs_size(&lfs);
+
+    // fill most of the disk with rewrites, the allocator has to find the
+    // blocks in use through the index
+    struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_file_opencfg(&lfs, &file, "indexed",
+            LFS_O_RDWR | LFS_O_CREAT, &fcfg) => 0;
+    memset(buffer, 0x55, cfg.block_size);
+    for (int j = 0; j < 4; j++) {
+        lfs_file_write(&lfs, &file, buffer, cfg.block_size) => cfg.block_size;
+    }
+    for (lfs_size_t j = 0; j < 2*cfg.block_count; j++) {
+        lfs_off_t off = (j % 4)*cfg.block_size + (j / 4) % 64;
+        lfs_file_seek(&lfs, &file, off, LFS_SEEK_SET) => off;
+        lfs_file_write(&lfs, &file, &(uint8_t){0xaa}, 1) => 1;
+        if (j % 8 == 0) {
+            lfs_file_sync(&lfs, &file) => 0;
+        }
+    }
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_fs_size(&lfs) => before + 4 + 1;
+
+    lfs_file_open(&lfs, &file, "indexed", LFS_O_RDONLY) => 0;
+    for (lfs_size_t j = 0; j < 4*cfg.block_size; j++) {
+        uint8_t c;
+        lfs_file_read(&lfs, &file, &c, 1) => 1;
+        c => (j % cfg.block_size < 64) ? 0xaa : 0x55;
+    }
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
+echo "--- Contiguous blocks and linear reads ---"
+scripts/test.py << TEST
+    struct lfs_config lcfg = cfg;
+    lcfg.linear_reads = true;
+    lfs_mount(&lfs, &lcfg) => 0;
+    lfs_remove(&lfs, "indexed") => 0;
+    struct lfs_file_config fcfg = {.layout = LFS_LAYOUT_INDEXED};
+    lfs_file_opencfg(&lfs, &file, "linear",
+            LFS_O_RDWR | LFS_O_CREAT, &fcfg) => 0;
+    for (lfs_size_t i = 0; i < 32*cfg.block_size; i++) {
+        uint8_t c = i * 7;
+        lfs_file_write(&lfs, &file, &c, 1) => 1;
+    }
+    lfs_file_close(&lfs, &file) => 0;
+
+    // data blocks follow each other, the index is kept out of the way
+    lfs_file_open(&lfs, &file, "linear", LFS_O_RDONLY) => 0;
+    lfs_block_t block;
+    lfs_block_t first;
+    lfs_off_t boff;
+    lfs_file_map(&lfs, &file, 0, &first, &boff) => cfg.block_size;
+    for (lfs_size_t j = 1; j < 32; j++) {
+        lfs_file_map(&lfs, &file, j*cfg.block_size, &block, &boff)
+                => cfg.block_size;
+        block => first + j;
+    }
+
+    // which reads in runs across blocks, from any offset
+    static uint8_t rbuffer[8*LFS_BLOCK_SIZE];
+    lfs_off_t off = 0;
+    for (lfs_size_t j = 1; off < 32*cfg.block_size; j++) {
+        lfs_size_t size = lfs_min(j*cfg.block_size/3 + j,
+                sizeof(rbuffer));
+        size = lfs_min(size, 32*cfg.block_size - off);
+        lfs_file_read(&lfs, &file, rbuffer, size) => size;
+        for (lfs_size_t i = 0; i < size; i++) {
+            rbuffer[i] => (uint8_t)((off+i) * 7);
+        }
+        off += size;
+    }
+    lfs_file_read(&lfs, &file, rbuffer, sizeof(rbuffer)) => 0;
+
+    lfs_file_seek(&lfs, &file, cfg.block_size/2, LFS_SEEK_SET)
+            => cfg.block_size/2;
+    lfs_file_read(&lfs, &file, rbuffer, sizeof(rbuffer)) => sizeof(rbuffer);
+    for (lfs_size_t i = 0; i < sizeof(rbuffer); i++) {
+        rbuffer[i] => (uint8_t)((cfg.block_size/2+i) * 7);
+    }
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+scripts/test.py << TEST
+    struct lfs_config lcfg = cfg;
+    lcfg.linear_reads = true;
+    lfs_mount(&lfs, &lcfg) => 0;
+#ifdef LFS_YES_STATS
+    // a run takes one read plus the index lookups, instead of one read
+    // per cache line
+    struct lfs_stats stats;
+    static uint8_t rbuffer[8*LFS_BLOCK_SIZE];
+    lfs_file_open(&lfs, &file, "linear", LFS_O_RDONLY) => 0;
+    lfs_fs_stats_reset(&lfs) => 0;
+    lfs_file_read(&lfs, &file, rbuffer, sizeof(rbuffer)) => sizeof(rbuffer);
+    lfs_fs_stats(&lfs, &stats) => 0;
+    (stats.read_count <= 1 + 2*8) => 1;
+    lfs_file_close(&lfs, &file) => 0;
+    lfs_unmount(&lfs) => 0;
+#endif
+TEST
+
+scripts/results.py
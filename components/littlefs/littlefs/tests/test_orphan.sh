@@ -43,4 +43,44 @@ scripts/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Orphan among many directories ---"
+rm -rf blocks
+scripts/test.py << TEST
+    lfs_format(&lfs, &cfg) => 0;
+    lfs_mount(&lfs, &cfg) => 0;
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "dir%02d", i);
+        lfs_mkdir(&lfs, path) => 0;
+        sprintf(path, "dir%02d/sub", i);
+        lfs_mkdir(&lfs, path) => 0;
+    }
+    lfs_mkdir(&lfs, "parent") => 0;
+    lfs_mkdir(&lfs, "parent/orphan") => 0;
+    lfs_mkdir(&lfs, "parent/child") => 0;
+    lfs_remove(&lfs, "parent/orphan") => 0;
+TEST
+scripts/corrupt.py
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_stat(&lfs, "parent/orphan", &info) => LFS_ERR_NOENT;
+    lfs_ssize_t orphaned = lfs_fs_size(&lfs);
+
+    lfs_mkdir(&lfs, "parent/otherchild") => 0;
+    lfs_ssize_t deorphaned = lfs_fs_size(&lfs);
+    deorphaned => orphaned;
+    lfs_unmount(&lfs) => 0;
+
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_fs_size(&lfs) => deorphaned;
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "dir%02d/sub", i);
+        lfs_stat(&lfs, path, &info) => 0;
+        info.type => LFS_TYPE_DIR;
+    }
+    lfs_stat(&lfs, "parent/child", &info) => 0;
+    lfs_stat(&lfs, "parent/otherchild", &info) => 0;
+    lfs_stat(&lfs, "parent/orphan", &info) => LFS_ERR_NOENT;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 scripts/results.py
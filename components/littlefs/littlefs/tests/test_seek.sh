@@ -114,6 +114,40 @@ scripts/test.py << TEST
     lfs_unmount(&lfs) => 0;
 TEST
 
+echo "--- Dir seek to metadata pair boundaries ---"
+scripts/test.py << TEST
+    lfs_mount(&lfs, &cfg) => 0;
+    lfs_dir_open(&lfs, &dir, "hello") => 0;
+    lfs_dir_read(&lfs, &dir, &info) => 1;
+    lfs_dir_read(&lfs, &dir, &info) => 1;
+
+    // find the positions where reading moves on to the next metadata pair
+    lfs_soff_t bounds[$LARGESIZE];
+    int count = 0;
+    lfs_block_t pair = dir.m.pair[0];
+    for (int i = 0; i < $LARGESIZE; i++) {
+        lfs_soff_t pos = lfs_dir_tell(&lfs, &dir);
+        lfs_dir_read(&lfs, &dir, &info) => 1;
+        if (dir.m.pair[0] != pair) {
+            pair = dir.m.pair[0];
+            bounds[count] = pos;
+            count += 1;
+        }
+    }
+    (count > 0) => true;
+
+    for (int j = 0; j < count; j++) {
+        lfs_dir_seek(&lfs, &dir, bounds[j]) => 0;
+        lfs_dir_tell(&lfs, &dir) => bounds[j];
+        sprintf(path, "kitty%03d", (int)bounds[j] - 2);
+        lfs_dir_read(&lfs, &dir, &info) => 1;
+        strcmp(info.name, path) => 0;
+    }
+
+    lfs_dir_close(&lfs, &dir) => 0;
+    lfs_unmount(&lfs) => 0;
+TEST
+
 echo "--- Simple file seek ---"
 scripts/test.py << TEST
     lfs_mount(&lfs, &cfg) => 0;
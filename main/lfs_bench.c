@@ -0,0 +1,590 @@
+/* LittleFS VFS benchmark
+
+   Measures fopen/fwrite/fread/fsync/stat/readdir through esp_vfs_lfs_register,
+   so the cost of the VFS glue and its locking shows up next to the cost of
+   littlefs itself. Every case runs on one or more tasks at once, each in its
+   own directory, and records per-call latency with esp_timer_get_time, the
+   flash operations done by the case and the heap and stack watermarks.
+
+   Afterwards it measures what the flash driver under littlefs spends on each
+   flash operation besides the flash access itself, with debug logging
+   compiled in and with counters instead.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_spi_flash.h"
+#include "sdkconfig.h"
+#include "lfs_bench.h"
+
+static const char *TAG = "bench";
+
+#define BENCH_FILE_SIZE     CONFIG_EXAMPLE_LFS_BENCH_FILE_SIZE
+#define BENCH_MAX_TASKS     CONFIG_EXAMPLE_LFS_BENCH_MAX_TASKS
+#define BENCH_FSYNC_OPS     32
+#define BENCH_READDIR_OPS   8
+#define BENCH_STACK_SIZE    4096
+#define BENCH_START_BIT     BIT0
+#define BENCH_DRIVER_CALLS  10000
+
+typedef enum {
+    BENCH_WRITE,
+    BENCH_READ,
+    BENCH_FSYNC,
+    BENCH_CREATE,
+    BENCH_STAT,
+    BENCH_READDIR,
+    BENCH_UNLINK,
+} bench_op_t;
+
+static const char *const bench_op_names[] = {
+    [BENCH_WRITE]   = "fwrite",
+    [BENCH_READ]    = "fread",
+    [BENCH_FSYNC]   = "fsync",
+    [BENCH_CREATE]  = "fopen",
+    [BENCH_STAT]    = "stat",
+    [BENCH_READDIR] = "readdir",
+    [BENCH_UNLINK]  = "unlink",
+};
+
+typedef struct {
+    bench_op_t op;
+    size_t buf_size;    /*!< Bytes per fwrite/fread call */
+    size_t files;       /*!< Files per task for the metadata cases */
+    size_t tasks;       /*!< Tasks running the case at the same time */
+} bench_case_t;
+
+/* Cases run in order, so the read, stat, readdir and unlink cases find the
+ * files left behind by the write and create cases before them. Cases asking
+ * for more than BENCH_MAX_TASKS tasks are skipped. */
+static const bench_case_t bench_cases[] = {
+    {BENCH_WRITE,   64,   1,   1},
+    {BENCH_READ,    64,   1,   1},
+    {BENCH_WRITE,   512,  1,   1},
+    {BENCH_READ,    512,  1,   1},
+    {BENCH_WRITE,   4096, 1,   1},
+    {BENCH_READ,    4096, 1,   1},
+    {BENCH_WRITE,   512,  1,   2},
+    {BENCH_READ,    512,  1,   2},
+    {BENCH_WRITE,   512,  1,   4},
+    {BENCH_READ,    512,  1,   4},
+    {BENCH_FSYNC,   64,   1,   1},
+    {BENCH_FSYNC,   64,   1,   4},
+    {BENCH_CREATE,  64,   16,  1},
+    {BENCH_STAT,    64,   16,  1},
+    {BENCH_READDIR, 64,   16,  1},
+    {BENCH_UNLINK,  64,   16,  1},
+    {BENCH_CREATE,  64,   64,  1},
+    {BENCH_STAT,    64,   64,  1},
+    {BENCH_READDIR, 64,   64,  1},
+    {BENCH_UNLINK,  64,   64,  1},
+    {BENCH_CREATE,  64,   16,  4},
+    {BENCH_STAT,    64,   16,  4},
+    {BENCH_READDIR, 64,   16,  4},
+    {BENCH_UNLINK,  64,   16,  4},
+};
+
+typedef struct {
+    uint32_t ops;
+    uint64_t bytes;
+    int64_t lat_sum;
+    int64_t lat_min;
+    int64_t lat_max;
+} bench_lat_t;
+
+typedef struct {
+    const bench_case_t *bcase;
+    const char *base_path;
+    int task_id;
+    uint8_t *buf;
+    bench_lat_t lat;
+    UBaseType_t stack_min;
+    esp_err_t err;
+} bench_task_t;
+
+typedef struct {
+    bench_lat_t lat;
+    int64_t wall_us;
+    UBaseType_t stack_min;
+    uint32_t heap_min;
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+    spi_flash_counters_t flash;
+#endif
+} bench_result_t;
+
+static EventGroupHandle_t s_start;
+static SemaphoreHandle_t s_done;
+
+static void bench_lat_init(bench_lat_t *lat)
+{
+    memset(lat, 0, sizeof(*lat));
+    lat->lat_min = INT64_MAX;
+}
+
+static void bench_lat_add(bench_lat_t *lat, int64_t t0, size_t bytes)
+{
+    int64_t us = esp_timer_get_time() - t0;
+    lat->ops += 1;
+    lat->bytes += bytes;
+    lat->lat_sum += us;
+    if (us < lat->lat_min) {
+        lat->lat_min = us;
+    }
+    if (us > lat->lat_max) {
+        lat->lat_max = us;
+    }
+}
+
+static void bench_lat_merge(bench_lat_t *dst, const bench_lat_t *src)
+{
+    dst->ops += src->ops;
+    dst->bytes += src->bytes;
+    dst->lat_sum += src->lat_sum;
+    if (src->lat_min < dst->lat_min) {
+        dst->lat_min = src->lat_min;
+    }
+    if (src->lat_max > dst->lat_max) {
+        dst->lat_max = src->lat_max;
+    }
+}
+
+static esp_err_t bench_write(bench_task_t *t, const char *dir)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s/data", dir);
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return ESP_FAIL;
+    }
+    // unbuffered, so every call goes through the VFS with the given size
+    setvbuf(f, NULL, _IONBF, 0);
+
+    esp_err_t err = ESP_OK;
+    for (size_t off = 0; off < BENCH_FILE_SIZE; off += t->bcase->buf_size) {
+        int64_t t0 = esp_timer_get_time();
+        if (fwrite(t->buf, 1, t->bcase->buf_size, f) != t->bcase->buf_size) {
+            err = ESP_FAIL;
+            break;
+        }
+        bench_lat_add(&t->lat, t0, t->bcase->buf_size);
+    }
+
+    if (err == ESP_OK && fsync(fileno(f)) != 0) {
+        err = ESP_FAIL;
+    }
+    if (fclose(f) != 0) {
+        err = ESP_FAIL;
+    }
+    return err;
+}
+
+static esp_err_t bench_read(bench_task_t *t, const char *dir)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s/data", dir);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return ESP_FAIL;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+
+    esp_err_t err = ESP_OK;
+    while (true) {
+        int64_t t0 = esp_timer_get_time();
+        size_t res = fread(t->buf, 1, t->bcase->buf_size, f);
+        if (res == 0) {
+            err = ferror(f) ? ESP_FAIL : ESP_OK;
+            break;
+        }
+        bench_lat_add(&t->lat, t0, res);
+    }
+
+    fclose(f);
+    return err;
+}
+
+static esp_err_t bench_fsync(bench_task_t *t, const char *dir)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s/log", dir);
+
+    FILE *f = fopen(path, "a");
+    if (f == NULL) {
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < BENCH_FSYNC_OPS; i++) {
+        int64_t t0 = esp_timer_get_time();
+        if (fwrite(t->buf, 1, t->bcase->buf_size, f) != t->bcase->buf_size ||
+                fflush(f) != 0 || fsync(fileno(f)) != 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        bench_lat_add(&t->lat, t0, t->bcase->buf_size);
+    }
+
+    if (fclose(f) != 0) {
+        err = ESP_FAIL;
+    }
+    unlink(path);
+    return err;
+}
+
+static esp_err_t bench_files(bench_task_t *t, const char *dir)
+{
+    char path[64];
+    struct stat st;
+
+    for (size_t i = 0; i < t->bcase->files; i++) {
+        snprintf(path, sizeof(path), "%s/f%u", dir, (unsigned)i);
+        int64_t t0 = esp_timer_get_time();
+        size_t bytes = 0;
+        switch (t->bcase->op) {
+            case BENCH_CREATE: {
+                FILE *f = fopen(path, "w");
+                if (f == NULL) {
+                    return ESP_FAIL;
+                }
+                bytes = fwrite(t->buf, 1, t->bcase->buf_size, f);
+                if (fclose(f) != 0 || bytes != t->bcase->buf_size) {
+                    return ESP_FAIL;
+                }
+                break;
+            }
+            case BENCH_STAT:
+                if (stat(path, &st) != 0) {
+                    return ESP_FAIL;
+                }
+                break;
+            case BENCH_UNLINK:
+                if (unlink(path) != 0) {
+                    return ESP_FAIL;
+                }
+                break;
+            default:
+                return ESP_ERR_INVALID_ARG;
+        }
+        bench_lat_add(&t->lat, t0, bytes);
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t bench_readdir(bench_task_t *t, const char *dir)
+{
+    for (int i = 0; i < BENCH_READDIR_OPS; i++) {
+        int64_t t0 = esp_timer_get_time();
+        DIR *d = opendir(dir);
+        if (d == NULL) {
+            return ESP_FAIL;
+        }
+
+        while (readdir(d) != NULL) {
+        }
+
+        closedir(d);
+        bench_lat_add(&t->lat, t0, 0);
+    }
+
+    return ESP_OK;
+}
+
+static void bench_task(void *arg)
+{
+    bench_task_t *t = (bench_task_t *)arg;
+    char dir[32];
+    snprintf(dir, sizeof(dir), "%s/bench/t%d", t->base_path, t->task_id);
+
+    xEventGroupWaitBits(s_start, BENCH_START_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    switch (t->bcase->op) {
+        case BENCH_WRITE:
+            t->err = bench_write(t, dir);
+            break;
+        case BENCH_READ:
+            t->err = bench_read(t, dir);
+            break;
+        case BENCH_FSYNC:
+            t->err = bench_fsync(t, dir);
+            break;
+        case BENCH_READDIR:
+            t->err = bench_readdir(t, dir);
+            break;
+        default:
+            t->err = bench_files(t, dir);
+            break;
+    }
+
+    t->stack_min = uxTaskGetStackHighWaterMark(NULL);
+    xSemaphoreGive(s_done);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t bench_run_case(const char *base_path, const bench_case_t *bcase,
+        uint8_t *bufs[], bench_result_t *res)
+{
+    bench_task_t tasks[BENCH_MAX_TASKS];
+    size_t started = 0;
+    esp_err_t err = ESP_OK;
+
+    memset(res, 0, sizeof(*res));
+    bench_lat_init(&res->lat);
+    res->stack_min = BENCH_STACK_SIZE;
+
+    xEventGroupClearBits(s_start, BENCH_START_BIT);
+    for (size_t i = 0; i < bcase->tasks; i++) {
+        tasks[i] = (bench_task_t) {
+            .bcase = bcase,
+            .base_path = base_path,
+            .task_id = i,
+            .buf = bufs[i],
+        };
+        bench_lat_init(&tasks[i].lat);
+
+        if (xTaskCreate(bench_task, "bench", BENCH_STACK_SIZE, &tasks[i],
+                uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+            err = ESP_ERR_NO_MEM;
+            break;
+        }
+        started += 1;
+    }
+
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+    spi_flash_reset_counters();
+#endif
+    int64_t t0 = esp_timer_get_time();
+    xEventGroupSetBits(s_start, BENCH_START_BIT);
+    for (size_t i = 0; i < started; i++) {
+        xSemaphoreTake(s_done, portMAX_DELAY);
+    }
+    res->wall_us = esp_timer_get_time() - t0;
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+    res->flash = *spi_flash_get_counters();
+#endif
+    res->heap_min = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+
+    for (size_t i = 0; i < started; i++) {
+        bench_lat_merge(&res->lat, &tasks[i].lat);
+        if (tasks[i].stack_min < res->stack_min) {
+            res->stack_min = tasks[i].stack_min;
+        }
+        if (tasks[i].err != ESP_OK) {
+            ESP_LOGE(TAG, "%s failed on task %d (%s)", bench_op_names[bcase->op],
+                    tasks[i].task_id, esp_err_to_name(tasks[i].err));
+            err = tasks[i].err;
+        }
+    }
+
+    return err;
+}
+
+static void bench_print_header(void)
+{
+    printf("%-8s %5s %5s %5s %6s %9s %9s %8s %8s %8s",
+            "op", "buf", "files", "tasks", "ops", "KiB/s", "ops/s",
+            "avg_us", "min_us", "max_us");
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+    printf(" %7s %7s %7s %9s %9s", "fl_rd", "fl_wr", "fl_er",
+            "rd_KiB", "wr_KiB");
+#endif
+    printf(" %8s %6s\n", "heap_min", "stack");
+}
+
+static void bench_print_result(const bench_case_t *bcase, const bench_result_t *res)
+{
+    double secs = res->wall_us / 1000000.0;
+    printf("%-8s %5u %5u %5u %6u %9.1f %9.1f %8lld %8lld %8lld",
+            bench_op_names[bcase->op],
+            (unsigned)bcase->buf_size, (unsigned)bcase->files,
+            (unsigned)bcase->tasks, (unsigned)res->lat.ops,
+            secs > 0 ? res->lat.bytes / 1024.0 / secs : 0.0,
+            secs > 0 ? res->lat.ops / secs : 0.0,
+            res->lat.ops ? (long long)(res->lat.lat_sum / res->lat.ops) : 0,
+            res->lat.ops ? (long long)res->lat.lat_min : 0,
+            (long long)res->lat.lat_max);
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+    printf(" %7u %7u %7u %9u %9u",
+            res->flash.read.count, res->flash.write.count,
+            res->flash.erase.count,
+            res->flash.read.bytes / 1024, res->flash.write.bytes / 1024);
+#endif
+    printf(" %8u %6u\n", res->heap_min, (unsigned)res->stack_min);
+}
+
+static void bench_cleanup(const char *base_path)
+{
+    char dir[32];
+    char path[64];
+    for (int i = 0; i < BENCH_MAX_TASKS; i++) {
+        snprintf(dir, sizeof(dir), "%s/bench/t%d", base_path, i);
+        DIR *d = opendir(dir);
+        if (d == NULL) {
+            continue;
+        }
+
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+        closedir(d);
+        rmdir(dir);
+    }
+    snprintf(dir, sizeof(dir), "%s/bench", base_path);
+    rmdir(dir);
+}
+
+/* Stand-ins for the per-operation work of lfs_api_read, called through a
+ * pointer so they aren't inlined into the timing loop. The logged one does
+ * what a compiled in ESP_LOGD does when the runtime level filters it out. */
+static volatile uint32_t s_driver_count;
+static volatile uint64_t s_driver_bytes;
+
+static void bench_driver_none(uint32_t block, uint32_t off, uint32_t size)
+{
+}
+
+static void bench_driver_logged(uint32_t block, uint32_t off, uint32_t size)
+{
+    ESP_LOG_LEVEL(ESP_LOG_DEBUG, "LFS", "%s - block=0x%08x off=0x%08x size=%d",
+            "lfs_api_read", block, off, size);
+}
+
+static void bench_driver_counted(uint32_t block, uint32_t off, uint32_t size)
+{
+    s_driver_count += 1;
+    s_driver_bytes += size;
+}
+
+static int64_t bench_driver_time(void (*op)(uint32_t, uint32_t, uint32_t))
+{
+    void (*volatile call)(uint32_t, uint32_t, uint32_t) = op;
+    int64_t t0 = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_DRIVER_CALLS; i++) {
+        call(i, i * 16, 256);
+    }
+    return esp_timer_get_time() - t0;
+}
+
+static void bench_driver_overhead(void)
+{
+    static uint8_t buf[256];
+    int64_t none = bench_driver_time(bench_driver_none);
+    int64_t logged = bench_driver_time(bench_driver_logged);
+    int64_t counted = bench_driver_time(bench_driver_counted);
+
+    int64_t t0 = esp_timer_get_time();
+    for (int i = 0; i < 100; i++) {
+        spi_flash_read(0x1000, buf, sizeof(buf));
+    }
+    int64_t flash = esp_timer_get_time() - t0;
+
+    printf("\nflash driver cost per operation:\n");
+    printf("  ESP_LOGD  %6lld ns, %s\n",
+            (long long)((logged - none) * 1000 / BENCH_DRIVER_CALLS),
+#if CONFIG_LFS_FLASH_DEBUG_LOG
+            "compiled in (CONFIG_LFS_FLASH_DEBUG_LOG)"
+#else
+            "compiled out in this build"
+#endif
+            );
+    printf("  counters  %6lld ns, %s\n",
+            (long long)((counted - none) * 1000 / BENCH_DRIVER_CALLS),
+#if CONFIG_LFS_FLASH_COUNTERS
+            "enabled (CONFIG_LFS_FLASH_COUNTERS)"
+#else
+            "disabled in this build"
+#endif
+            );
+    printf("  flash     %6lld ns, 256 byte read for comparison\n",
+            (long long)(flash * 1000 / 100));
+}
+
+esp_err_t lfs_bench_run(const char *base_path)
+{
+    esp_err_t err = ESP_OK;
+    uint8_t *bufs[BENCH_MAX_TASKS] = {0};
+    char path[32];
+
+    ESP_LOGI(TAG, "Running benchmark on %s, %u byte files, up to %u tasks",
+            base_path, BENCH_FILE_SIZE, BENCH_MAX_TASKS);
+
+    s_start = xEventGroupCreate();
+    s_done = xSemaphoreCreateCounting(BENCH_MAX_TASKS, 0);
+    if (s_start == NULL || s_done == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < BENCH_MAX_TASKS; i++) {
+        bufs[i] = malloc(4096);
+        if (bufs[i] == NULL) {
+            err = ESP_ERR_NO_MEM;
+            goto cleanup;
+        }
+        memset(bufs[i], 'a' + i, 4096);
+    }
+
+    // leftovers from an interrupted run would skew the first cases
+    bench_cleanup(base_path);
+    snprintf(path, sizeof(path), "%s/bench", base_path);
+    mkdir(path, 0777);
+    for (int i = 0; i < BENCH_MAX_TASKS; i++) {
+        snprintf(path, sizeof(path), "%s/bench/t%d", base_path, i);
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            ESP_LOGE(TAG, "Failed to create %s", path);
+            err = ESP_FAIL;
+            goto cleanup;
+        }
+    }
+
+    bench_print_header();
+    for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        const bench_case_t *bcase = &bench_cases[i];
+        if (bcase->tasks > BENCH_MAX_TASKS || bcase->buf_size > 4096) {
+            continue;
+        }
+
+        bench_result_t res;
+        esp_err_t case_err = bench_run_case(base_path, bcase, bufs, &res);
+        if (case_err != ESP_OK) {
+            err = case_err;
+            continue;
+        }
+        bench_print_result(bcase, &res);
+    }
+
+    bench_driver_overhead();
+
+cleanup:
+    bench_cleanup(base_path);
+    for (int i = 0; i < BENCH_MAX_TASKS; i++) {
+        free(bufs[i]);
+    }
+    if (s_done) {
+        vSemaphoreDelete(s_done);
+        s_done = NULL;
+    }
+    if (s_start) {
+        vEventGroupDelete(s_start);
+        s_start = NULL;
+    }
+    return err;
+}
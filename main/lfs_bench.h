@@ -0,0 +1,32 @@
+/* LittleFS VFS benchmark
+*/
+
+#ifndef _LFS_BENCH_H_
+#define _LFS_BENCH_H_
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Run the benchmark on a mounted filesystem and print the results as a table.
+ *
+ * Files are created in a "bench" directory under base_path, which is removed
+ * again when the benchmark is done.
+ *
+ * @param base_path  Path prefix the filesystem was registered with.
+ *
+ * @return
+ *          - ESP_OK         if all benchmark cases ran
+ *          - ESP_ERR_NO_MEM if buffers or tasks could not be allocated
+ *          - ESP_FAIL       if a file operation failed
+ */
+esp_err_t lfs_bench_run(const char *base_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LFS_BENCH_H_ */
@@ -10,6 +10,10 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_lfs.h"
+#include "sdkconfig.h"
+#if CONFIG_EXAMPLE_LFS_BENCHMARK
+#include "lfs_bench.h"
+#endif
 
 static const char *TAG = "example";
 
@@ -22,7 +26,11 @@ void app_main(void)
 	esp_vfs_lfs_conf_t conf = {
 			.base_path = "/lfs",
 			.partition_label = "littlefs",
+#if CONFIG_EXAMPLE_LFS_BENCHMARK && CONFIG_EXAMPLE_LFS_BENCH_MAX_TASKS > 5
+			.max_files = CONFIG_EXAMPLE_LFS_BENCH_MAX_TASKS,
+#else
 			.max_files = 5,
+#endif
 			.format_if_mount_failed = true
 	};
 
@@ -57,6 +65,12 @@ void app_main(void)
 		}
 	}
 
+#if CONFIG_EXAMPLE_LFS_BENCHMARK
+	res = lfs_bench_run(conf.base_path);
+	if (res != ESP_OK) {
+		ESP_LOGE(TAG, "Benchmark failed (%s)", esp_err_to_name(res));
+	}
+#else
 	// Use POSIX and C standard library functions to work with files.
     // First create a file.
     ESP_LOGI(TAG, "Opening file /lfs/hello.txt");
@@ -99,6 +113,7 @@ void app_main(void)
         *pos = '\0';
     }
     ESP_LOGI(TAG, "Read from file: '%s'", line);
+#endif
 
 	res = esp_vfs_lfs_unregister(conf.partition_label);
 	if (res == ESP_OK) {